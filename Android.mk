@@ -23,9 +23,13 @@ LOCAL_CFLAGS += $(TGVOIP_ADDITIONAL_CFLAGS)
 LOCAL_SRC_FILES := ./TgVoip.cpp \
 ./VoIPController.cpp \
 ./tools/Buffers.cpp \
+./tools/CryptoWorkerPool.cpp \
+./tools/HardwareCrypto.cpp \
 ./controller/net/CongestionControl.cpp \
+./controller/net/DelayGradientEstimator.cpp \
 ./controller/audio/EchoCanceller.cpp \
 ./controller/net/JitterBuffer.cpp \
+./controller/net/PacketPacer.cpp \
 ./tools/logging.cpp \
 ./controller/media/MediaStreamItf.cpp \
 ./tools/MessageThread.cpp \
@@ -35,6 +39,7 @@ LOCAL_SRC_FILES := ./TgVoip.cpp \
 ./controller/audio/OpusEncoder.cpp \
 ./controller/audio/AudioPacketSender.cpp \
 ./controller/net/PacketReassembler.cpp \
+./controller/net/RackLossDetector.cpp \
 ./controller/protocol/packets/PacketManager.cpp \
 ./controller/protocol/packets/PacketSender.cpp \
 ./controller/protocol/packets/PacketStructs.cpp \
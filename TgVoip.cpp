@@ -4,6 +4,7 @@
 
 #include "VoIPController.h"
 #include "VoIPServerConfig.h"
+#include "tools/HardwareCrypto.h"
 
 #include <stdarg.h>
 
@@ -47,6 +48,21 @@ void tgvoip_openssl_sha256(uint8_t *msg, size_t len, uint8_t *output)
     SHA256(msg, len, output);
 }
 
+void tgvoip_openssl_sha256_init(void *ctx)
+{
+    SHA256_Init(static_cast<SHA256_CTX *>(ctx));
+}
+
+void tgvoip_openssl_sha256_update(void *ctx, const uint8_t *msg, size_t len)
+{
+    SHA256_Update(static_cast<SHA256_CTX *>(ctx), msg, len);
+}
+
+void tgvoip_openssl_sha256_final(void *ctx, uint8_t *output)
+{
+    SHA256_Final(output, static_cast<SHA256_CTX *>(ctx));
+}
+
 void tgvoip_openssl_aes_ctr_encrypt(uint8_t *inout, size_t length, uint8_t *key, uint8_t *iv, uint8_t *ecount, uint32_t *num)
 {
     AES_KEY akey;
@@ -58,6 +74,23 @@ void tgvoip_openssl_aes_ctr_encrypt(uint8_t *inout, size_t length, uint8_t *key,
 #endif
 }
 
+void tgvoip_openssl_aes_set_encrypt_key(void *ctx, const uint8_t *key)
+{
+    AES_set_encrypt_key(key, 32 * 8, static_cast<AES_KEY *>(ctx));
+}
+
+void tgvoip_openssl_aes_ctr_encrypt_keyed(uint8_t *inout, size_t length, const void *ctx, uint8_t *iv, uint8_t *ecount, uint32_t *num)
+{
+    const AES_KEY *akey = static_cast<const AES_KEY *>(ctx);
+#ifdef ANDROID
+    AES_ctr128_encrypt(inout, inout, length, akey, iv, ecount, num);
+#else
+    CRYPTO_ctr128_encrypt(inout, inout, length, akey, iv, ecount, num, (block128_f)AES_encrypt);
+#endif
+}
+
+static_assert(sizeof(SHA256_CTX) <= TGVOIP_CRYPTO_CONTEXT_SIZE && sizeof(AES_KEY) <= TGVOIP_CRYPTO_CONTEXT_SIZE, "OpenSSL contexts don't fit");
+
 void tgvoip_openssl_aes_cbc_encrypt(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv)
 {
     AES_KEY akey;
@@ -80,7 +113,20 @@ tgvoip::CryptoFunctions tgvoip::VoIPController::crypto = {
     tgvoip_openssl_aes_ige_decrypt,
     tgvoip_openssl_aes_ctr_encrypt,
     tgvoip_openssl_aes_cbc_encrypt,
-    tgvoip_openssl_aes_cbc_decrypt};
+    tgvoip_openssl_aes_cbc_decrypt,
+    tgvoip_openssl_sha256_init,
+    tgvoip_openssl_sha256_update,
+    tgvoip_openssl_sha256_final,
+    tgvoip_openssl_aes_set_encrypt_key,
+    tgvoip_openssl_aes_ctr_encrypt_keyed};
+#endif
+
+// Set by TgVoip::enableHardwareCrypto, custom crypto passed to later instances is overridden again where possible
+static bool hardwareCryptoEnabled = false;
+
+#ifdef TGVOIP_USE_CUSTOM_CRYPTO
+// Only what the embedder passed to TgVoip::setCryptoExtensions, everything stays null otherwise
+static TgVoipCryptoExtensions cryptoExtensions{};
 #endif
 
 class TgVoipImpl : public TgVoip
@@ -110,6 +156,13 @@ public:
         tgvoip::VoIPController::crypto.aes_ige_encrypt = crypto.aes_ige_encrypt;
         tgvoip::VoIPController::crypto.aes_ige_decrypt = crypto.aes_ige_decrypt;
         tgvoip::VoIPController::crypto.aes_ctr_encrypt = crypto.aes_ctr_encrypt;
+        tgvoip::VoIPController::crypto.sha256_init = cryptoExtensions.sha256_init;
+        tgvoip::VoIPController::crypto.sha256_update = cryptoExtensions.sha256_update;
+        tgvoip::VoIPController::crypto.sha256_final = cryptoExtensions.sha256_final;
+        tgvoip::VoIPController::crypto.aes_set_encrypt_key = cryptoExtensions.aes_set_encrypt_key;
+        tgvoip::VoIPController::crypto.aes_ctr_encrypt_keyed = cryptoExtensions.aes_ctr_encrypt_keyed;
+        if (hardwareCryptoEnabled)
+            tgvoip::HardwareCrypto::Install(tgvoip::VoIPController::crypto);
 #endif
 
         controller_ = new tgvoip::VoIPController();
@@ -429,6 +482,19 @@ int TgVoip::getConnectionMaxLayer()
     return tgvoip::VoIPController::GetConnectionMaxLayer();
 }
 
+bool TgVoip::enableHardwareCrypto()
+{
+    hardwareCryptoEnabled = tgvoip::HardwareCrypto::Install(tgvoip::VoIPController::crypto);
+    return hardwareCryptoEnabled;
+}
+
+#ifdef TGVOIP_USE_CUSTOM_CRYPTO
+void TgVoip::setCryptoExtensions(TgVoipCryptoExtensions const &extensions)
+{
+    cryptoExtensions = extensions;
+}
+#endif
+
 std::string TgVoip::getVersion()
 {
     return tgvoip::VoIPController::GetVersion();
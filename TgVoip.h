@@ -77,6 +77,18 @@ struct TgVoipCrypto
     void (*aes_cbc_encrypt)(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv);
     void (*aes_cbc_decrypt)(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv);
 };
+
+// Optional additions to TgVoipCrypto, passed through TgVoip::setCryptoExtensions.
+// Zero-initialize it (TgVoipCryptoExtensions ext{};) so that whatever you don't provide stays null and isn't used.
+// Contexts are 512 bytes of 16-byte aligned storage.
+struct TgVoipCryptoExtensions
+{
+    void (*sha256_init)(void *ctx);
+    void (*sha256_update)(void *ctx, const uint8_t *msg, size_t length);
+    void (*sha256_final)(void *ctx, uint8_t *output);
+    void (*aes_set_encrypt_key)(void *ctx, const uint8_t *key);
+    void (*aes_ctr_encrypt_keyed)(uint8_t *inout, size_t length, const void *ctx, uint8_t *iv, uint8_t *ecount, uint32_t *num);
+};
 #endif
 
 struct TgVoipConfig
@@ -145,6 +157,13 @@ public:
     static void setGlobalServerConfig(std::string const &serverConfig);
     static int getConnectionMaxLayer();
     static std::string getVersion();
+    // Switches AES and SHA over to the built-in AES-NI/SHA-NI implementations where the CPU has them.
+    // Returns false if it doesn't and the current crypto functions stay in use.
+    static bool enableHardwareCrypto();
+#ifdef TGVOIP_USE_CUSTOM_CRYPTO
+    // Used along with the TgVoipCrypto passed to instances made after this call
+    static void setCryptoExtensions(TgVoipCryptoExtensions const &extensions);
+#endif
     static TgVoip *makeInstance(
         TgVoipConfig const &config,
         TgVoipPersistentState const &persistentState,
@@ -41,16 +41,20 @@ extern jclass jniUtilitiesClass;
 #include "controller/audio/OpusDecoder.h"
 #include "controller/audio/OpusEncoder.h"
 #include "controller/net/CongestionControl.h"
+#include "controller/net/DelayGradientEstimator.h"
 #include "controller/net/Endpoint.h"
 #include "controller/net/JitterBuffer.h"
+#include "controller/net/PacketPacer.h"
 #include "controller/net/PacketReassembler.h"
 #include "controller/protocol/Stream.h"
 #include "controller/protocol/packets/PacketManager.h"
 #include "controller/protocol/packets/PacketStructs.h"
 #include "controller/protocol/protocol/Extra.h"
-#include "tools/BlockingQueue.h"
 #include "tools/Buffers.h"
+#include "tools/CryptoWorkerPool.h"
+#include "tools/MPSCQueue.h"
 #include "tools/MessageThread.h"
+#include "tools/SPSCQueue.h"
 #include "tools/utils.h"
 #include "video/ScreamCongestionController.h"
 #include "video/VideoRenderer.h"
@@ -61,6 +65,7 @@ extern jclass jniUtilitiesClass;
 #include <iomanip>
 #include <map>
 #include <memory>
+#include <queue>
 #include <stdint.h>
 #include <string>
 #include <unordered_map>
@@ -136,11 +141,20 @@ struct CryptoFunctions
     void (*rand_bytes)(uint8_t *buffer, size_t length);
     void (*sha1)(uint8_t *msg, size_t length, uint8_t *output);
     void (*sha256)(uint8_t *msg, size_t length, uint8_t *output);
+    // Packets are encrypted and decrypted in place, so in and out may point to the same memory
     void (*aes_ige_encrypt)(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv);
     void (*aes_ige_decrypt)(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv);
     void (*aes_ctr_encrypt)(uint8_t *inout, size_t length, uint8_t *key, uint8_t *iv, uint8_t *ecount, uint32_t *num);
     void (*aes_cbc_encrypt)(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv);
     void (*aes_cbc_decrypt)(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv);
+    // Everything below is optional and may be left null, the one-shot functions above are used instead.
+    // Contexts are TGVOIP_CRYPTO_CONTEXT_SIZE bytes of 16-byte aligned storage owned by the caller.
+    void (*sha256_init)(void *ctx);
+    void (*sha256_update)(void *ctx, const uint8_t *msg, size_t length);
+    void (*sha256_final)(void *ctx, uint8_t *output);
+    // Expands a 256-bit key once for connections that keep the same key for every packet
+    void (*aes_set_encrypt_key)(void *ctx, const uint8_t *key);
+    void (*aes_ctr_encrypt_keyed)(uint8_t *inout, size_t length, const void *ctx, uint8_t *iv, uint8_t *ecount, uint32_t *num);
 };
 
 struct CellularCarrierInfo
@@ -271,6 +285,16 @@ public:
       * @param stats
       */
     void GetStats(TrafficStats *stats);
+    /**
+      * Get how late the tasks on the internal message thread ran and for how long, grouped by tag
+      * @return
+      */
+    std::vector<MessageThread::TaskStats> GetMessageThreadStats();
+    /**
+      * Get how many outgoing packets are queued in the pacer and how long they waited, per stream
+      * @return
+      */
+    PacketPacer::Stats GetPacerStats();
     /**
       *
       * @return
@@ -416,11 +440,28 @@ protected:
     virtual void ProcessIncomingPacket(Packet &packet, Endpoint &srcEndpoint);
     virtual void ProcessExtraData(const Wrapped<Extra> &data, Endpoint &srcEndpoint);
 
+    // Result of decrypting a packet ahead of time on the crypto worker pool
+    struct PreDecryptedPacket
+    {
+        bool attempted = false;
+        // Where the encrypted part started, the packet has to be handled with the same layout
+        size_t offset = 0;
+        const unsigned char *inner = nullptr;
+        size_t innerLen = 0;
+    };
+    // Whether the packets in the current receive batch can be decrypted ahead of time, called on the message thread
+    virtual bool CanPreDecryptPackets();
+    // Called on the crypto workers while the message thread waits, ProcessIncomingPacket has to pick up the result
+    virtual void PreDecryptPacket(NetworkPacket &packet, Endpoint &srcEndpoint, PreDecryptedPacket &result);
+
     //virtual uint8_t WritePacketHeader(PendingOutgoingPacket &pkt, BufferOutputStream &s, PacketSender *source);
     virtual void SendUdpPing(Endpoint &endpoint);
     virtual void SendRelayPings();
 
     PendingOutgoingPacket PreparePacket(unsigned char *data, size_t len, Endpoint &ep, CongestionControlPacket &&pkt);
+    PendingOutgoingPacket PreparePacket(SendBuffer &&buf, Endpoint &ep, CongestionControlPacket &&pkt);
+    // A buffer with enough headroom in front of the payload for everything PreparePacket prepends
+    SendBuffer GetSendBuffer(const Endpoint &ep, size_t payloadLength = 0);
 
     void SendPacket(OutgoingPacket &&pkt, double retryInterval = 0.5, double timeout = 5.0, uint8_t tries = 0);
 
@@ -531,6 +572,19 @@ private:
         TGVOIP_MOVE_ONLY(RawPendingOutgoingPacket);
         NetworkPacket packet;
         std::shared_ptr<NetworkSocket> socket;
+        uint8_t streamId = StreamId::Signaling;
+        uint32_t seq = 0;
+        double enqueueTime = 0;
+    };
+    // Sent back by the send thread once the pacer lets a packet go or drops it, or made up on the message thread
+    // for a packet the full raw send queue evicted
+    struct SentPacketReport
+    {
+        uint8_t streamId;
+        uint32_t seq;
+        uint32_t size;
+        double sendTime;
+        bool dropped;
     };
     enum
     {
@@ -545,13 +599,20 @@ private:
     void RunRecvThread();
     void RunSendThread();
     void UpdateAudioBitrateLimit();
+    // Hands the delay-based target out to the audio encoder and the video source
+    void UpdateDelayBasedBitrate();
+    // Paces outgoing packets at a multiple of what the congestion controllers currently target
+    void UpdatePacingRate();
+    video::VideoPacketSender *GetOutgoingVideoSender();
     void SetState(int state);
     void UpdateAudioOutputState();
     void InitUDPProxy();
     void UpdateDataSavingState();
 
+    // Decrypts the packet in place and points in at the inner payload, returns its length or 0 if the packet is invalid
     size_t decryptPacket(unsigned char *buffer, BufferInputStream &in);
-    void encryptPacket(unsigned char *data, size_t len, BufferOutputStream &out);
+    // Encrypts the payload of the buffer in place and prepends the key fingerprint and msg_key
+    void encryptPacket(SendBuffer &buf);
 
     void KDF(unsigned char *msgKey, size_t x, unsigned char *aesKey, unsigned char *aesIv);
     void KDF2(unsigned char *msgKey, size_t x, unsigned char *aesKey, unsigned char *aesIv);
@@ -572,7 +633,9 @@ private:
     void UpdateAudioBitrate();
     void UpdateSignalBars();
     void UpdateReliablePackets();
+    void ArmReliablePacketsTimer();
     void TickJitterBufferAndCongestionControl();
+    void DetectLostPackets();
     void ResetUdpAvailability();
     inline static std::string NetworkTypeToString(int type)
     {
@@ -636,10 +699,20 @@ private:
 
     bool parseRelayPacket(const BufferInputStream &in, Endpoint &srcEndpoint);
 
-    void HandleReliablePackets(const PacketManager &pm);
+    // newlyAcked are the seqs the last ack acked for the first time
+    void HandleReliablePackets(const PacketManager &pm, const std::vector<uint32_t> &newlyAcked);
+    void HandleAckedPacket(PacketManager &pm, RecentOutgoingPacket &opkt, PacketSender &sender);
+    void HandleSelectiveAck(PacketManager &pm, const ExtraSelectiveAck &sack);
 
     void SetupOutgoingVideoStream();
-    void NetworkPacketReceived(std::shared_ptr<NetworkPacket> packet);
+    void NetworkPacketReceived(NetworkPacket &packet);
+    Endpoint *FindPacketSource(const NetworkPacket &packet);
+    void ProcessIncomingNetworkPackets();
+    void ProcessSentPacketReports();
+    void HandleSentPacketReport(const SentPacketReport &report);
+    // Called on the send thread
+    void ReportSentPacket(const SentPacketReport &report);
+    void PreDecryptIncomingPackets();
     void TrySendOutgoingPackets();
 
     int state = STATE_WAIT_INIT;
@@ -697,11 +770,24 @@ private:
     bool dataSavingRequestedByPeer = false;
     std::string activeNetItfName;
     double publicEndpointsReqTime = 0;
-    std::vector<ReliableOutgoingPacket> reliablePackets;
+    // Reliable packets waiting for an ack, by ReliableOutgoingPacket::Key
+    std::unordered_map<uint64_t, ReliableOutgoingPacket> reliablePackets;
+    // Earliest deadline first. Entries of packets that were acked or rescheduled since are skipped when they come up
+    std::priority_queue<ReliablePacketDeadline, std::vector<ReliablePacketDeadline>, std::greater<ReliablePacketDeadline>> reliablePacketDeadlines;
+    // The one timer that runs UpdateReliablePackets for the earliest deadline
+    uint32_t reliablePacketsTimerID = MessageThread::INVALID_ID;
+    double reliablePacketsTimerDeadline = 0;
+    // Reused for every ack that comes in
+    std::vector<uint32_t> newlyAckedSeqs;
     double connectionInitTime = 0;
     double lastRecvPacketTime = 0;
+    // Arrival time of the packet that's being processed, used for RTT and jitter measurements
+    double currentPacketRecvTime = 0;
+    // Set while processing a packet the crypto worker pool has already decrypted
+    const PreDecryptedPacket *currentPreDecrypted = nullptr;
     Config config;
     CongestionControl conctl;
+    DelayGradientEstimator delayEstimator;
     TrafficStats stats;
     bool receivedInit = false;
     bool receivedInitAck = false;
@@ -734,6 +820,8 @@ private:
     NetworkAddress resolvedProxyAddress = NetworkAddress::Empty();
 
     uint32_t peerCapabilities = 0;
+    // Both sides attach ExtraSelectiveAck to their packets
+    bool peerSupportsSelectiveAck = false;
     Callbacks callbacks{0};
     bool didReceiveGroupCallKey = false;
     bool didReceiveGroupCallKeyAck = false;
@@ -758,7 +846,24 @@ private:
     HistoricBuffer<unsigned int, 5> unsentStreamPacketsHistory;
     bool needReInitUdpProxy = true;
     bool needRate = false;
-    BlockingQueue<RawPendingOutgoingPacket> rawSendQueue;
+    MPSCQueue<RawPendingOutgoingPacket> rawSendQueue;
+    // Only used on the send thread
+    PacketPacer pacer;
+    // Only used on the message thread
+    SharedBufferPool<SEND_BUFFER_SIZE, SEND_BUFFER_COUNT> outgoingPacketPool;
+    // Filled by the receive thread, drained on the message thread
+    SPSCQueue<NetworkPacket> incomingPackets;
+    std::atomic<bool> incomingPacketsDrainPosted = ATOMIC_VAR_INIT(false);
+    // Filled by the send thread, drained on the message thread
+    SPSCQueue<SentPacketReport> sentPacketReports;
+    std::atomic<bool> sentPacketReportsDrainPosted = ATOMIC_VAR_INIT(false);
+    // Optional, decrypts batches of incoming packets in parallel
+    std::unique_ptr<CryptoWorkerPool> cryptoPool;
+    unsigned int cryptoWorkerThreads;
+    unsigned int cryptoPoolMinBatch;
+    std::vector<NetworkPacket> incomingBatch;
+    std::vector<Endpoint *> incomingBatchSources;
+    std::vector<PreDecryptedPacket> incomingBatchDecrypted;
 
     uint32_t initTimeoutID = MessageThread::INVALID_ID;
     uint32_t udpPingTimeoutID = MessageThread::INVALID_ID;
@@ -789,6 +894,8 @@ private:
     uint32_t lastReceivedVideoFrameNumber = UINT32_MAX;
 
     uint32_t sendLosses = 0;
+    // Losses whose packets can no longer be acked, only these count towards the loss rate the encoder adapts to
+    uint32_t confirmedSendLosses = 0;
     uint32_t unacknowledgedIncomingPacketCount = 0;
 
     VersionInfo ver;
@@ -816,6 +923,11 @@ private:
     uint32_t minAudioBitrate;
     uint32_t audioBitrateStepIncr;
     uint32_t audioBitrateStepDecr;
+    bool useDelayBasedBitrate;
+    uint32_t maxVideoBitrate;
+    bool usePacer;
+    double pacingRateFactor;
+    bool useSelectiveAck;
     double relaySwitchThreshold;
     double p2pToRelaySwitchThreshold;
     double relayToP2pSwitchThreshold;
@@ -238,6 +238,13 @@ void VoIPGroupController::ProcessIncomingPacket(NetworkPacket &packet, Endpoint
 {
 }
 
+bool VoIPGroupController::CanPreDecryptPackets()
+{
+	// Group packets use their own format. Overriding PreDecryptPacket for it has to wait until ProcessIncomingPacket
+	// handles them, until then every packet is left to it.
+	return false;
+}
+
 void VoIPGroupController::SendUdpPing(Endpoint &endpoint)
 {
 }
@@ -31,6 +31,7 @@ public:
 
 protected:
     virtual void ProcessIncomingPacket(NetworkPacket &packet, Endpoint &srcEndpoint);
+    virtual bool CanPreDecryptPackets();
     virtual void SendInit();
     virtual void SendUdpPing(Endpoint &endpoint);
     virtual void SendRelayPings();
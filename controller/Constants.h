@@ -15,6 +15,15 @@ inline int pad4(int x)
 // Max recent packets
 #define MAX_RECENT_PACKETS 128
 
+// Max packets read from a socket in one go
+#define RECV_BATCH_SIZE 32
+
+// Outgoing packets are built and encrypted in place in pooled buffers of this size
+#define SEND_BUFFER_SIZE 2048
+#define SEND_BUFFER_COUNT 128
+// Room left after the payload for the encryption padding
+#define SEND_BUFFER_TAILROOM 32
+
 // Packet types (all deprecated)
 #define PKT_INIT 1
 #define PKT_INIT_ACK 2
@@ -91,7 +91,7 @@ void AudioPacketSender::SendFrame(unsigned char *data, size_t len, unsigned char
 
             controller->SendPacket(std::move(*pkt), retry / 1000.0, (stream->frameDuration * 4) / 1000.0, resendCount);
         }
-    });
+    }, 0.0, 0.0, "SendAudioFrame");
 
 #if defined(TGVOIP_USE_CALLBACK_AUDIO_IO)
     if (audioPreprocDataCallback)
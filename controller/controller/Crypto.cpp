@@ -2,6 +2,32 @@
 
 using namespace tgvoip;
 
+// SHA-256 of a followed by b, streamed when the crypto table allows it so neither needs to be copied
+static void sha256TwoParts(const uint8_t *a, size_t aLen, const uint8_t *b, size_t bLen, uint8_t *output)
+{
+    CryptoFunctions &crypto = VoIPController::crypto;
+    if (crypto.sha256_init && crypto.sha256_update && crypto.sha256_final)
+    {
+        alignas(16) uint8_t ctx[TGVOIP_CRYPTO_CONTEXT_SIZE];
+        crypto.sha256_init(ctx);
+        crypto.sha256_update(ctx, a, aLen);
+        crypto.sha256_update(ctx, b, bLen);
+        crypto.sha256_final(ctx, output);
+        return;
+    }
+    uint8_t joined[32 + 2048];
+    if (aLen + bLen <= sizeof(joined))
+    {
+        memcpy(joined, a, aLen);
+        memcpy(joined + aLen, b, bLen);
+        crypto.sha256(joined, aLen + bLen, output);
+        return;
+    }
+    BufferOutputStream buf(aLen + bLen);
+    buf.WriteBytes(a, aLen);
+    buf.WriteBytes(b, bLen);
+    crypto.sha256(buf.GetBuffer(), buf.GetLength(), output);
+}
 
 size_t VoIPController::decryptPacket(unsigned char *buffer, BufferInputStream &in)
 {
@@ -17,28 +43,34 @@ size_t VoIPController::decryptPacket(unsigned char *buffer, BufferInputStream &i
         in.ReadBytes(msgHash, 16);
         unsigned char key[32], iv[32];
         KDF(msgHash, isOutgoing ? 8 : 0, key, iv);
-        unsigned char aesOut[MSC_STACK_FALLBACK(in.Remaining(), 1500)];
-        if (in.Remaining() > sizeof(aesOut))
-            return 0;
-        crypto.aes_ige_decrypt(const_cast<uint8_t *>(in.GetRawBuffer()), aesOut, in.Remaining(), key, iv);
-        BufferInputStream _in(aesOut, in.Remaining());
+        unsigned char *encrypted = buffer + in.GetOffset();
+        size_t encryptedLen = in.Remaining();
+        // Decryption happens in place, keep the ciphertext around if we might have to try again with MTProto2
+        Buffer ciphertext;
+        if (state == STATE_WAIT_INIT || state == STATE_WAIT_INIT_ACK)
+        {
+            ciphertext = Buffer(encryptedLen);
+            ciphertext.CopyFrom(encrypted, 0, encryptedLen);
+        }
+        crypto.aes_ige_decrypt(encrypted, encrypted, encryptedLen, key, iv);
+        BufferInputStream _in(encrypted, encryptedLen);
         unsigned char sha[SHA1_LENGTH];
         uint32_t _len = _in.ReadUInt32();
         if (_len > _in.Remaining())
             _len = (uint32_t)_in.Remaining();
-        crypto.sha1((uint8_t *)(aesOut), static_cast<size_t>(_len) + 4, sha);
+        crypto.sha1(encrypted, static_cast<size_t>(_len) + 4, sha);
         if (memcmp(msgHash, sha + (SHA1_LENGTH - 16), 16) != 0)
         {
             LOGW("Received packet has wrong hash after decryption");
-            if (state == STATE_WAIT_INIT || state == STATE_WAIT_INIT_ACK)
-                retryWith2 = true;
-            else
+            if (ciphertext.IsEmpty())
                 return 0;
+            memcpy(encrypted, *ciphertext, encryptedLen);
+            retryWith2 = true;
         }
         else
         {
-            memcpy(buffer + in.GetOffset(), aesOut, in.Remaining());
-            return in.ReadInt32();
+            in = BufferInputStream(encrypted + 4, _len);
+            return _len;
         }
     }
 
@@ -58,30 +90,23 @@ size_t VoIPController::decryptPacket(unsigned char *buffer, BufferInputStream &i
         }
         in.ReadBytes(msgKey, 16);
 
-        unsigned char decrypted[1500];
         unsigned char aesKey[32], aesIv[32];
         KDF2(msgKey, isOutgoing ? 8 : 0, aesKey, aesIv);
+        unsigned char *decrypted = buffer + in.GetOffset();
         size_t decryptedLen = in.Remaining();
-        if (decryptedLen > sizeof(decrypted))
-            return 0;
         if (decryptedLen % 16 != 0)
         {
             LOGW("wrong decrypted length");
             return 0;
         }
 
-        crypto.aes_ige_decrypt(buffer + in.GetOffset(), decrypted, decryptedLen, aesKey, aesIv);
+        crypto.aes_ige_decrypt(decrypted, decrypted, decryptedLen, aesKey, aesIv);
 
-        in = BufferInputStream(decrypted, decryptedLen);
-        //LOGD("received packet length: %d", in.ReadInt32());
         size_t sizeSize = shortFormat ? 0 : 4;
 
-        BufferOutputStream buf(decryptedLen + 32);
         size_t x = isOutgoing ? 8 : 0;
-        buf.WriteBytes(encryptionKey + 88 + x, 32);
-        buf.WriteBytes(decrypted + sizeSize, decryptedLen - sizeSize);
         unsigned char msgKeyLarge[32];
-        crypto.sha256(buf.GetBuffer(), buf.GetLength(), msgKeyLarge);
+        sha256TwoParts(encryptionKey + 88 + x, 32, decrypted + sizeSize, decryptedLen - sizeSize, msgKeyLarge);
 
         if (memcmp(msgKey, msgKeyLarge + 8, 16) != 0)
         {
@@ -89,6 +114,7 @@ size_t VoIPController::decryptPacket(unsigned char *buffer, BufferInputStream &i
             return 0;
         }
 
+        in = BufferInputStream(decrypted, decryptedLen);
         innerLen = static_cast<uint32_t>(shortFormat ? in.ReadInt16() : in.ReadInt32());
         if (innerLen > decryptedLen - sizeSize)
         {
@@ -100,8 +126,7 @@ size_t VoIPController::decryptPacket(unsigned char *buffer, BufferInputStream &i
             LOGW("Received packet has too little padding (%u)", (unsigned int)(decryptedLen - innerLen));
             return 0;
         }
-        memcpy(buffer, decrypted + (shortFormat ? 2 : 4), innerLen);
-        in = BufferInputStream(buffer, innerLen);
+        in = BufferInputStream(decrypted + (shortFormat ? 2 : 4), innerLen);
         if (retryWith2)
         {
             LOGD("Successfully decrypted packet in MTProto2.0 fallback, upgrading");
@@ -112,72 +137,93 @@ size_t VoIPController::decryptPacket(unsigned char *buffer, BufferInputStream &i
     return innerLen;
 }
 
-void VoIPController::encryptPacket(unsigned char *data, size_t len, BufferOutputStream &out)
+// Runs on a crypto worker. Mirrors the checks ProcessIncomingPacket makes before decrypting, anything that
+// fails them is left alone for ProcessIncomingPacket to reject or handle as a relay packet.
+void VoIPController::PreDecryptPacket(NetworkPacket &packet, Endpoint &srcEndpoint, PreDecryptedPacket &result)
 {
+    static const unsigned char relayPacketPrefix[12] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    unsigned char *buffer = **packet.data;
+    BufferInputStream in(*packet.data);
+    if (ver.peerVersion < 9 || srcEndpoint.IsReflector())
+    {
+        if (in.Remaining() < 16 || memcmp(buffer, srcEndpoint.IsReflector() ? (void *)srcEndpoint.peerTag : (void *)callID, 16) != 0)
+            return;
+        in.Seek(16);
+    }
+    if (in.Remaining() >= 16 && srcEndpoint.IsReflector() && memcmp(in.GetRawBuffer(), relayPacketPrefix, sizeof(relayPacketPrefix)) == 0)
+        return;
+    if (in.Remaining() < 40)
+        return;
+    result.offset = in.GetOffset();
+    result.innerLen = decryptPacket(buffer, in);
+    result.inner = in.GetRawBuffer();
+    result.attempted = true;
+}
+
+void VoIPController::encryptPacket(SendBuffer &buf)
+{
+    size_t len = buf.Length();
     if (useMTProto2)
     {
         //LOGE("Using MTProto2");
-        BufferOutputStream inner(len + 128);
         size_t sizeSize;
         if (!ver.isLegacyLegacy())
         {
-            inner.WriteInt16((uint16_t)len);
+            uint16_t len16 = (uint16_t)len;
+            unsigned char *lenBytes = buf.Push(2);
+            lenBytes[0] = (unsigned char)(len16 & 0xFF);
+            lenBytes[1] = (unsigned char)(len16 >> 8);
             sizeSize = 0;
         }
         else
         {
-            inner.WriteInt32((uint32_t)len);
-            out.WriteBytes(keyFingerprint, 8);
+            unsigned char *lenBytes = buf.Push(4);
+            for (int i = 0; i < 4; i++)
+                lenBytes[i] = (unsigned char)((len >> (i * 8)) & 0xFF);
             sizeSize = 4;
         }
-        inner.WriteBytes(data, len);
 
-        size_t padLen = 16 - inner.GetLength() % 16;
+        size_t padLen = 16 - buf.Length() % 16;
         if (padLen < 16)
             padLen += 16;
-        unsigned char padding[32];
-        crypto.rand_bytes((uint8_t *)padding, padLen);
-        inner.WriteBytes(padding, padLen);
-        assert(inner.GetLength() % 16 == 0);
+        crypto.rand_bytes(buf.Put(padLen), padLen);
+        assert(buf.Length() % 16 == 0);
+        unsigned char *inner = buf.Data();
+        size_t innerLen = buf.Length();
 
         unsigned char key[32], iv[32], msgKey[16];
-        BufferOutputStream buf(len + 32);
         size_t x = isOutgoing ? 0 : 8;
-        buf.WriteBytes(encryptionKey + 88 + x, 32);
-        buf.WriteBytes(inner.GetBuffer() + sizeSize, inner.GetLength() - sizeSize);
         unsigned char msgKeyLarge[32];
-        crypto.sha256(buf.GetBuffer(), buf.GetLength(), msgKeyLarge);
+        sha256TwoParts(encryptionKey + 88 + x, 32, inner + sizeSize, innerLen - sizeSize, msgKeyLarge);
         memcpy(msgKey, msgKeyLarge + 8, 16);
         KDF2(msgKey, isOutgoing ? 0 : 8, key, iv);
-        out.WriteBytes(msgKey, 16);
         //LOGV("<- MSG KEY: %08x %08x %08x %08x, hashed %u", *reinterpret_cast<int32_t*>(msgKey), *reinterpret_cast<int32_t*>(msgKey+4), *reinterpret_cast<int32_t*>(msgKey+8), *reinterpret_cast<int32_t*>(msgKey+12), inner.GetLength()-4);
 
-        unsigned char aesOut[MSC_STACK_FALLBACK(inner.GetLength(), 1500)];
-        crypto.aes_ige_encrypt(inner.GetBuffer(), aesOut, inner.GetLength(), key, iv);
-        out.WriteBytes(aesOut, inner.GetLength());
+        crypto.aes_ige_encrypt(inner, inner, innerLen, key, iv);
+        memcpy(buf.Push(16), msgKey, 16);
+        if (ver.isLegacyLegacy())
+            memcpy(buf.Push(8), keyFingerprint, 8);
     }
     else
     {
         //LOGE("Using MTProto1");
-        BufferOutputStream inner(len + 128);
-        inner.WriteInt32(static_cast<int32_t>(len));
-        inner.WriteBytes(data, len);
-        if (inner.GetLength() % 16 != 0)
+        unsigned char *lenBytes = buf.Push(4);
+        for (int i = 0; i < 4; i++)
+            lenBytes[i] = (unsigned char)((len >> (i * 8)) & 0xFF);
+        if (buf.Length() % 16 != 0)
         {
-            size_t padLen = 16 - inner.GetLength() % 16;
-            unsigned char padding[16];
-            crypto.rand_bytes((uint8_t *)padding, padLen);
-            inner.WriteBytes(padding, padLen);
+            size_t padLen = 16 - buf.Length() % 16;
+            crypto.rand_bytes(buf.Put(padLen), padLen);
         }
-        assert(inner.GetLength() % 16 == 0);
+        assert(buf.Length() % 16 == 0);
+        unsigned char *inner = buf.Data();
+        size_t innerLen = buf.Length();
         unsigned char key[32], iv[32], msgHash[SHA1_LENGTH];
-        crypto.sha1((uint8_t *)inner.GetBuffer(), len + 4, msgHash);
-        out.WriteBytes(keyFingerprint, 8);
-        out.WriteBytes((msgHash + (SHA1_LENGTH - 16)), 16);
+        crypto.sha1(inner, len + 4, msgHash);
         KDF(msgHash + (SHA1_LENGTH - 16), isOutgoing ? 0 : 8, key, iv);
-        unsigned char aesOut[MSC_STACK_FALLBACK(inner.GetLength(), 1500)];
-        crypto.aes_ige_encrypt(inner.GetBuffer(), aesOut, inner.GetLength(), key, iv);
-        out.WriteBytes(aesOut, inner.GetLength());
+        crypto.aes_ige_encrypt(inner, inner, innerLen, key, iv);
+        memcpy(buf.Push(16), msgHash + (SHA1_LENGTH - 16), 16);
+        memcpy(buf.Push(8), keyFingerprint, 8);
     }
 }
 
@@ -231,22 +277,12 @@ void VoIPController::KDF(unsigned char *msgKey, size_t x, unsigned char *aesKey,
 void VoIPController::KDF2(unsigned char *msgKey, size_t x, unsigned char *aesKey, unsigned char *aesIv)
 {
     uint8_t sA[32], sB[32];
-    BufferOutputStream buf(128);
-    buf.WriteBytes(msgKey, 16);
-    buf.WriteBytes(encryptionKey + x, 36);
-    crypto.sha256(buf.GetBuffer(), buf.GetLength(), sA);
-    buf.Reset();
-    buf.WriteBytes(encryptionKey + 40 + x, 36);
-    buf.WriteBytes(msgKey, 16);
-    crypto.sha256(buf.GetBuffer(), buf.GetLength(), sB);
-    buf.Reset();
-    buf.WriteBytes(sA, 8);
-    buf.WriteBytes(sB + 8, 16);
-    buf.WriteBytes(sA + 24, 8);
-    memcpy(aesKey, buf.GetBuffer(), 32);
-    buf.Reset();
-    buf.WriteBytes(sB, 8);
-    buf.WriteBytes(sA + 8, 16);
-    buf.WriteBytes(sB + 24, 8);
-    memcpy(aesIv, buf.GetBuffer(), 32);
+    sha256TwoParts(msgKey, 16, encryptionKey + x, 36, sA);
+    sha256TwoParts(encryptionKey + 40 + x, 36, msgKey, 16, sB);
+    memcpy(aesKey, sA, 8);
+    memcpy(aesKey + 8, sB + 8, 16);
+    memcpy(aesKey + 24, sA + 24, 8);
+    memcpy(aesIv, sB, 8);
+    memcpy(aesIv + 8, sA + 8, 16);
+    memcpy(aesIv + 24, sB + 24, 8);
 }
\ No newline at end of file
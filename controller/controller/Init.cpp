@@ -6,7 +6,10 @@ using namespace tgvoip;
 
 #pragma mark - Internal intialization
 
-VoIPController::VoIPController() : rawSendQueue(64)
+VoIPController::VoIPController() : rawSendQueue(64, MPSCQueue<RawPendingOutgoingPacket>::OverflowPolicy::DropOldest),
+                                   pacer(ServerConfig::GetSharedInstance()->GetUInt("pacer_burst_bytes", 4000), ServerConfig::GetSharedInstance()->GetDouble("pacer_max_queue_delay", 0.1)),
+                                   incomingPackets(256),
+                                   sentPacketReports(256)
 {
     selectCanceller = SocketSelectCanceller::Create();
     udpSocket = NetworkSocket::Create(NetworkProtocol::UDP);
@@ -23,6 +26,18 @@ VoIPController::VoIPController() : rawSendQueue(64)
     audioBitrateStepIncr = ServerConfig::GetSharedInstance()->GetUInt("audio_bitrate_step_incr", 1000);
     audioBitrateStepDecr = ServerConfig::GetSharedInstance()->GetUInt("audio_bitrate_step_decr", 1000);
     minAudioBitrate = ServerConfig::GetSharedInstance()->GetUInt("audio_min_bitrate", 8000);
+    useDelayBasedBitrate = ServerConfig::GetSharedInstance()->GetBoolean("use_delay_based_bitrate", true);
+    maxVideoBitrate = ServerConfig::GetSharedInstance()->GetUInt("video_max_bitrate", 500 * 1024);
+    usePacer = ServerConfig::GetSharedInstance()->GetBoolean("use_pacer", true);
+    pacingRateFactor = ServerConfig::GetSharedInstance()->GetDouble("pacer_rate_factor", 2.5);
+    useSelectiveAck = ServerConfig::GetSharedInstance()->GetBoolean("use_selective_ack", true);
+    // Audio jumps the queue and isn't worth sending once it's too late to be played, signaling and video share what's left
+    pacer.ConfigureStream(StreamId::Audio,
+                          ServerConfig::GetSharedInstance()->GetBoolean("audio_strict_priority", true) ? PacketPacer::Scheduling::StrictPriority : PacketPacer::Scheduling::Weighted,
+                          ServerConfig::GetSharedInstance()->GetUInt("send_weight_audio", 4),
+                          ServerConfig::GetSharedInstance()->GetDouble("audio_max_send_delay", 0.15));
+    pacer.ConfigureStream(StreamId::Signaling, PacketPacer::Scheduling::Weighted, ServerConfig::GetSharedInstance()->GetUInt("send_weight_signaling", 2), 0);
+    pacer.ConfigureStream(StreamId::Video, PacketPacer::Scheduling::Weighted, ServerConfig::GetSharedInstance()->GetUInt("send_weight_video", 1), 0);
     relaySwitchThreshold = ServerConfig::GetSharedInstance()->GetDouble("relay_switch_threshold", 0.8);
     p2pToRelaySwitchThreshold = ServerConfig::GetSharedInstance()->GetDouble("p2p_to_relay_switch_threshold", 0.6);
     relayToP2pSwitchThreshold = ServerConfig::GetSharedInstance()->GetDouble("relay_to_p2p_switch_threshold", 0.8);
@@ -33,6 +48,8 @@ VoIPController::VoIPController() : rawSendQueue(64)
     packetLossToEnableExtraEC = ServerConfig::GetSharedInstance()->GetDouble("packet_loss_for_extra_ec", 0.02);
     maxUnsentStreamPackets = ServerConfig::GetSharedInstance()->GetUInt("max_unsent_stream_packets", 2);
     unackNopThreshold = ServerConfig::GetSharedInstance()->GetUInt("unack_nop_threshold", 10);
+    cryptoWorkerThreads = ServerConfig::GetSharedInstance()->GetUInt("crypto_worker_threads", 0);
+    cryptoPoolMinBatch = ServerConfig::GetSharedInstance()->GetUInt("crypto_worker_min_batch", 8);
 
     initAudioBitrate = 20000;
     
@@ -66,7 +66,7 @@ void VoIPController::Stop()
     //Buffer emptyBuf(0);
     //PendingOutgoingPacket emptyPacket{0, 0, 0, move(emptyBuf), 0};
     //sendQueue->Put(move(emptyPacket));
-    rawSendQueue.Put(RawPendingOutgoingPacket{NetworkPacket::Empty(), nullptr});
+    rawSendQueue.Push(RawPendingOutgoingPacket{NetworkPacket::Empty(), nullptr});
     LOGD("before join sendThread");
     if (sendThread)
     {
@@ -106,6 +106,9 @@ void VoIPController::Start()
         return;
     }
 
+    if (cryptoWorkerThreads > 0)
+        cryptoPool = std::make_unique<CryptoWorkerPool>(cryptoWorkerThreads);
+
     runReceiver = true;
     recvThread = std::make_unique<Thread>(bind(&VoIPController::RunRecvThread, this));
     recvThread->SetName("VoipRecv");
@@ -245,6 +248,13 @@ string VoIPController::GetDebugString()
              (long long unsigned int)(stats.bytesRecvdMobile + stats.bytesRecvdWifi));
     r += buffer;
 
+    r += "\nSend queues:";
+    for (PacketPacer::StreamStats &st : pacer.GetStats().streams)
+    {
+        snprintf(buffer, sizeof(buffer), " %hhu:%u", st.streamId, (unsigned int)st.queued);
+        r += buffer;
+    }
+
     if (config.enableVideoSend)
     {
         auto *vstm = GetStreamByType<OutgoingVideoStream>();
@@ -291,6 +301,16 @@ void VoIPController::GetStats(TrafficStats *stats)
     memcpy(stats, &this->stats, sizeof(TrafficStats));
 }
 
+vector<MessageThread::TaskStats> VoIPController::GetMessageThreadStats()
+{
+    return messageThread.GetTaskStats();
+}
+
+PacketPacer::Stats VoIPController::GetPacerStats()
+{
+    return pacer.GetStats();
+}
+
 string VoIPController::GetDebugLog()
 {
     map<string, json11::Json> network{
@@ -388,6 +408,48 @@ string VoIPController::GetDebugLog()
     else if (cur.type == Endpoint::Type::UDP_P2P_LAN)
         p2pType = "lan";
 
+    vector<json11::Json> _tasks;
+    for (MessageThread::TaskStats &t : messageThread.GetTaskStats())
+    {
+        vector<json11::Json> lateness, runTime;
+        for (size_t i = 0; i < MessageThread::TaskStats::HISTOGRAM_SIZE; i++)
+        {
+            lateness.push_back((double)t.lateness[i]);
+            runTime.push_back((double)t.runTime[i]);
+        }
+        _tasks.push_back(json11::Json::object{
+            {"tag", t.tag},
+            {"count", (double)t.count},
+            {"late_avg", t.totalLateness / t.count},
+            {"late_max", t.maxLateness},
+            {"late_hist", lateness},
+            {"run_avg", t.totalRunTime / t.count},
+            {"run_max", t.maxRunTime},
+            {"run_hist", runTime}});
+    }
+
+    uint32_t spuriousLosses = 0;
+    for (auto &stm : outgoingStreams)
+        spuriousLosses += stm->packetManager.lossDetector.GetSpuriousLossCount();
+
+    PacketPacer::Stats pacerStats = pacer.GetStats();
+    vector<json11::Json> _pacerStreams;
+    for (PacketPacer::StreamStats &st : pacerStats.streams)
+    {
+        _pacerStreams.push_back(json11::Json::object{
+            {"stream_id", (int)st.streamId},
+            {"queued", (int)st.queued},
+            {"queued_max", (int)st.maxQueued},
+            {"sent", (double)st.packets},
+            {"dropped", (double)st.dropped},
+            {"delay_avg", st.packets ? st.totalDelay / st.packets : 0.0},
+            {"delay_max", st.maxDelay}});
+    }
+    json11::Json::object _pacer{
+        {"rate", (int)pacerStats.rate},
+        {"budget_overruns", (double)pacerStats.budgetOverruns},
+        {"streams", _pacerStreams}};
+
     vector<string> problems;
     if (lastError == ERROR_TIMEOUT)
         problems.push_back("timeout");
@@ -410,12 +472,18 @@ string VoIPController::GetDebugLog()
                             {"udp_avail", udpConnectivityState == UDP_AVAILABLE},
                             {"tcp_used", useTCP},
                             {"p2p_type", p2pType},
+                            {"congestion_control", conctl.GetStrategyName()},
+                            {"delay_bwe_target", useDelayBasedBitrate && delayEstimator.HasEstimate() ? (int)delayEstimator.GetTargetBitrate() : 0},
                             {"packet_stats", json11::Json::object{
                                                  {"out", (int)getBestPacketManager().getLocalSeq()},
                                                  {"in", (int)packetsReceived},
                                                  {"lost_out", (int)conctl.GetSendLossCount()},
+                                                 {"lost_out_spurious", (int)spuriousLosses},
+                                                 {"dropped_out", realUdpSocket ? (double)realUdpSocket->GetDroppedPacketCount() : 0.0},
                                                  {"lost_in", (int)recvLossCount}}},
                             {"endpoints", _endpoints},
+                            {"message_thread", _tasks},
+                            {"pacer", _pacer},
                             {"problems", problems}})
         .dump();
 }
@@ -18,8 +18,11 @@ using namespace tgvoip;
 CongestionControlPacket::CongestionControlPacket(uint32_t _seq, uint8_t _streamId) : seq(_seq), streamId(_streamId){};
 CongestionControlPacket::CongestionControlPacket(const Packet &pkt) : seq(pkt.seq), streamId(pkt.streamId){};
 
-CongestionControl::CongestionControl() : cwnd(static_cast<size_t>(ServerConfig::GetSharedInstance()->GetInt("audio_congestion_window", 1024)))
+CongestionControl::CongestionControl()
 {
+    inflightStreams.reserve(4);
+    strategy = CongestionControlStrategy::Create(ServerConfig::GetSharedInstance()->GetString("congestion_control", "inflight_window"));
+    LOGI("Congestion control strategy: %s", strategy->GetName());
 }
 
 CongestionControl::~CongestionControl()
@@ -43,7 +46,7 @@ size_t CongestionControl::GetInflightDataSize()
 
 size_t CongestionControl::GetCongestionWindow()
 {
-    return cwnd;
+    return strategy->GetCongestionWindow();
 }
 
 double CongestionControl::GetMinimumRTT()
@@ -51,73 +54,98 @@ double CongestionControl::GetMinimumRTT()
     return rttHistory.Min();
 }
 
-void CongestionControl::PacketSent(const CongestionControlPacket &pkt, size_t size)
+void CongestionControl::SetStrategy(std::unique_ptr<CongestionControlStrategy> strategy)
+{
+    this->strategy = std::move(strategy);
+    LOGI("Congestion control strategy: %s", this->strategy->GetName());
+}
+
+const char *CongestionControl::GetStrategyName()
+{
+    return strategy->GetName();
+}
+
+CongestionControl::InflightStream &CongestionControl::GetInflightStream(uint8_t streamId)
 {
-    if (lastSentSeq.find(pkt.streamId) == lastSentSeq.end())
+    for (InflightStream &stream : inflightStreams)
     {
-        lastSentSeq[pkt.streamId] = 0;
+        if (stream.streamId == streamId)
+            return stream;
     }
-    if (!seqgt(pkt.seq, lastSentSeq[pkt.streamId]) || pkt.seq == lastSentSeq[pkt.streamId])
+    inflightStreams.emplace_back();
+    inflightStreams.back().streamId = streamId;
+    return inflightStreams.back();
+}
+
+tgvoip_congestionctl_packet_t *CongestionControl::FindInflightPacket(const CongestionControlPacket &pkt)
+{
+    for (InflightStream &stream : inflightStreams)
     {
-        //LOGW("Duplicate outgoing seq %u", pkt.seq);
-        return;
+        if (stream.streamId != pkt.streamId)
+            continue;
+        tgvoip_congestionctl_packet_t &packet = stream.packets[pkt.seq & (TGVOIP_CONCTL_INFLIGHT_SIZE - 1)];
+        if (packet.sendTime > 0 && packet.seq == pkt.seq)
+            return &packet;
+        return nullptr;
     }
-    lastSentSeq[pkt.streamId] = pkt.seq;
-    double smallestSendTime = INFINITY;
-    tgvoip_congestionctl_packet_t *slot = NULL;
-    for (auto &packet : inflightPackets)
+    return nullptr;
+}
+
+void CongestionControl::RemoveInflightPacket(tgvoip_congestionctl_packet_t &packet)
+{
+    packet.sendTime = 0;
+    inflightDataSize -= packet.size;
+}
+
+void CongestionControl::PacketSent(const CongestionControlPacket &pkt, size_t size, double sendTime)
+{
+    static_assert((TGVOIP_CONCTL_INFLIGHT_SIZE & (TGVOIP_CONCTL_INFLIGHT_SIZE - 1)) == 0, "TGVOIP_CONCTL_INFLIGHT_SIZE must be a power of two");
+    InflightStream &stream = GetInflightStream(pkt.streamId);
+    if (!seqgt(pkt.seq, stream.lastSentSeq) || pkt.seq == stream.lastSentSeq)
     {
-        if (packet.sendTime == 0)
-        {
-            slot = &packet;
-            break;
-        }
-        if (smallestSendTime > packet.sendTime)
-        {
-            slot = &packet;
-            smallestSendTime = slot->sendTime;
-        }
+        //LOGW("Duplicate outgoing seq %u", pkt.seq);
+        return;
     }
-    assert(slot != NULL);
-    if (slot->sendTime > 0)
+    if (stream.lastSentSeq == 0 || pkt.seq - stream.oldestSeq >= TGVOIP_CONCTL_INFLIGHT_SIZE)
+        stream.oldestSeq = pkt.seq - (stream.lastSentSeq == 0 ? 0 : TGVOIP_CONCTL_INFLIGHT_SIZE - 1);
+    stream.lastSentSeq = pkt.seq;
+    tgvoip_congestionctl_packet_t &slot = stream.packets[pkt.seq & (TGVOIP_CONCTL_INFLIGHT_SIZE - 1)];
+    if (slot.sendTime > 0)
     {
-        inflightDataSize -= slot->size;
+        // The window is full, the packet we're replacing is as good as lost
+        RemoveInflightPacket(slot);
         lossCount++;
-        LOGD("Packet with seq %u, streamId=%hhu was not acknowledged", slot->seq, slot->streamId);
+        strategy->PacketLost(slot.size);
+        LOGD("Packet with seq %u, streamId=%hhu was not acknowledged", slot.seq, slot.streamId);
     }
-    slot->seq = pkt.seq;
-    slot->size = size;
-    slot->streamId = pkt.streamId;
-    slot->sendTime = VoIPController::GetCurrentTime();
+    slot.seq = pkt.seq;
+    slot.size = size;
+    slot.streamId = pkt.streamId;
+    slot.sendTime = sendTime ? sendTime : VoIPController::GetCurrentTime();
     inflightDataSize += size;
+    strategy->PacketSent(size, slot.sendTime);
 }
 
-void CongestionControl::PacketAcknowledged(const CongestionControlPacket &pkt)
+void CongestionControl::PacketAcknowledged(const CongestionControlPacket &pkt, double ackTime)
 {
-    for (auto &packet : inflightPackets)
+    if (ackTime == 0)
+        ackTime = VoIPController::GetCurrentTime();
+    if (tgvoip_congestionctl_packet_t *packet = FindInflightPacket(pkt))
     {
-        if (packet.seq == pkt.seq && packet.streamId == pkt.streamId && packet.sendTime > 0)
-        {
-            tmpRtt += (VoIPController::GetCurrentTime() - packet.sendTime);
-            tmpRttCount++;
-            packet.sendTime = 0;
-            inflightDataSize -= packet.size;
-            break;
-        }
+        tmpRtt += (ackTime - packet->sendTime);
+        tmpRttCount++;
+        strategy->PacketAcknowledged(packet->size, packet->sendTime, ackTime);
+        RemoveInflightPacket(*packet);
     }
 }
 
 void CongestionControl::PacketLost(const CongestionControlPacket &pkt)
 {
-    for (auto &packet : inflightPackets)
+    if (tgvoip_congestionctl_packet_t *packet = FindInflightPacket(pkt))
     {
-        if (packet.seq == pkt.seq && packet.streamId == pkt.streamId && packet.sendTime > 0)
-        {
-            packet.sendTime = 0;
-            inflightDataSize -= packet.size;
-            lossCount++;
-            break;
-        }
+        RemoveInflightPacket(*packet);
+        lossCount++;
+        strategy->PacketLost(packet->size);
     }
 }
 
@@ -130,40 +158,81 @@ void CongestionControl::Tick()
         tmpRtt = 0;
         tmpRttCount = 0;
     }
-    for (auto &packet : inflightPackets)
+    // Packets are sent in seq order, so only the oldest ones can have timed out
+    double currentTime = VoIPController::GetCurrentTime();
+    for (InflightStream &stream : inflightStreams)
     {
-        if (packet.sendTime && VoIPController::GetCurrentTime() - packet.sendTime > TGVOIP_CONCTL_LOST_AFTER)
+        while (stream.lastSentSeq && seqgte(stream.lastSentSeq, stream.oldestSeq))
         {
-            packet.sendTime = 0;
-            inflightDataSize -= packet.size;
-            lossCount++;
-            LOGD("Packet with seq %u was not acknowledged", packet.seq);
+            tgvoip_congestionctl_packet_t &packet = stream.packets[stream.oldestSeq & (TGVOIP_CONCTL_INFLIGHT_SIZE - 1)];
+            if (packet.sendTime > 0 && packet.seq == stream.oldestSeq)
+            {
+                if (currentTime - packet.sendTime <= TGVOIP_CONCTL_LOST_AFTER)
+                    break;
+                RemoveInflightPacket(packet);
+                lossCount++;
+                strategy->PacketLost(packet.size);
+                LOGD("Packet with seq %u was not acknowledged", packet.seq);
+            }
+            stream.oldestSeq++;
         }
     }
+    strategy->Tick(*this);
     inflightHistory.Add(inflightDataSize);
 }
 
 CongestionControl::Action CongestionControl::GetBandwidthControlAction(int netMode, double multiply)
+{
+    return strategy->GetBandwidthControlAction(*this, netMode, multiply);
+}
+
+uint32_t CongestionControl::GetSendLossCount()
+{
+    return lossCount;
+}
+
+std::unique_ptr<CongestionControlStrategy> CongestionControlStrategy::Create(const std::string &name)
+{
+    if (name != "inflight_window")
+        LOGW("Unknown congestion control strategy %s, using the default one", name.c_str());
+    return std::make_unique<InflightWindowStrategy>(static_cast<size_t>(ServerConfig::GetSharedInstance()->GetInt("audio_congestion_window", 1024)));
+}
+
+InflightWindowStrategy::InflightWindowStrategy(size_t cwnd) : cwnd(cwnd)
+{
+}
+
+const char *InflightWindowStrategy::GetName() const
+{
+    return "inflight_window";
+}
+
+size_t InflightWindowStrategy::GetCongestionWindow() const
+{
+    return cwnd;
+}
+
+CongestionControl::Action InflightWindowStrategy::GetBandwidthControlAction(CongestionControl &conctl, int netMode, double multiply)
 {
     if (VoIPController::GetCurrentTime() - lastActionTime < 1)
-        return None;
+        return CongestionControl::None;
 
-    Action action;
-    size_t inflightAvg = GetInflightDataSize();
+    CongestionControl::Action action;
+    size_t inflightAvg = conctl.GetInflightDataSize();
     size_t max = (cwnd * multiply) * 1.1;
     size_t min = (cwnd * multiply) * 0.9;
     LOGW("inflightAvg=%lu, max=%lu, min=%lu", inflightAvg, max, min);
     if (inflightAvg < min)
     {
-        action = Increase;
+        action = CongestionControl::Increase;
     }
     else if (inflightAvg > max)
     {
-        action = Decrease;
+        action = CongestionControl::Decrease;
     }
     else
     {
-        action = None;
+        action = CongestionControl::None;
     }
 
     uint8_t actAfter = 3;
@@ -195,10 +264,5 @@ CongestionControl::Action CongestionControl::GetBandwidthControlAction(int netMo
         LOGE("Would act on %hhu, current tries %hhu, act after %hhu", action, lastActionCount, actAfter);
     }
     lastAction = action;
-    return None;
-}
-
-uint32_t CongestionControl::GetSendLossCount()
-{
-    return lossCount;
+    return CongestionControl::None;
 }
@@ -9,12 +9,17 @@
 
 #include "tools/Buffers.h"
 #include "tools/threading.h"
+#include <array>
 #include <cstdint>
-#include <map>
+#include <memory>
 #include <stdlib.h>
+#include <string>
+#include <vector>
 
 #define TGVOIP_CONCTL_LOST_AFTER 2
 #define TGVOIP_CONCTL_ACT_AFTER 2
+// Per stream, has to be a power of two
+#define TGVOIP_CONCTL_INFLIGHT_SIZE 128
 
 namespace tgvoip
 {
@@ -38,6 +43,8 @@ struct CongestionControlPacket
     uint8_t streamId;
 };
 
+class CongestionControlStrategy;
+
 class CongestionControl
 {
 public:
@@ -52,9 +59,11 @@ public:
         Min = 3
     };
 
-    void PacketSent(const CongestionControlPacket &pkt, size_t size);
+    // sendTime is when the packet actually left, 0 for now
+    void PacketSent(const CongestionControlPacket &pkt, size_t size, double sendTime = 0);
     void PacketLost(const CongestionControlPacket &pkt);
-    void PacketAcknowledged(const CongestionControlPacket &pkt);
+    // ackTime is when the acknowledgement arrived, 0 for now
+    void PacketAcknowledged(const CongestionControlPacket &pkt, double ackTime = 0);
 
     double GetAverageRTT();
     double GetMinimumRTT();
@@ -65,24 +74,79 @@ public:
     Action GetBandwidthControlAction(int netMode, double multiply = 1.0);
     uint32_t GetSendLossCount();
 
+    // Replaces the algorithm that decides on bitrate changes, the in-flight accounting stays as it is
+    void SetStrategy(std::unique_ptr<CongestionControlStrategy> strategy);
+    const char *GetStrategyName();
 
 private:
+    // In-flight packets of one stream, the packet with a given seq lives at seq & (TGVOIP_CONCTL_INFLIGHT_SIZE - 1)
+    struct InflightStream
+    {
+        uint8_t streamId;
+        uint32_t lastSentSeq = 0;
+        // Nothing older than this is in flight anymore
+        uint32_t oldestSeq = 0;
+        std::array<tgvoip_congestionctl_packet_t, TGVOIP_CONCTL_INFLIGHT_SIZE> packets{};
+    };
+
+    InflightStream &GetInflightStream(uint8_t streamId);
+    // Null if the packet isn't in flight
+    tgvoip_congestionctl_packet_t *FindInflightPacket(const CongestionControlPacket &pkt);
+    void RemoveInflightPacket(tgvoip_congestionctl_packet_t &packet);
+
     HistoricBuffer<double, 100> rttHistory;
     HistoricBuffer<size_t, 30> inflightHistory;
-    std::array<tgvoip_congestionctl_packet_t, 100> inflightPackets{};
+    // There are only a handful of streams, so a vector beats any map here
+    std::vector<InflightStream> inflightStreams;
+    std::unique_ptr<CongestionControlStrategy> strategy;
     uint32_t lossCount = 0;
-    Action lastAction = None;
-    uint8_t lastActionCount = 0;
     double tmpRtt = 0.0;
-    double lastActionTime = 0;
-    double lastActionRtt = 0;
     double stateTransitionTime = 0;
     uint32_t tmpRttCount = 0;
-    std::map<uint8_t, uint32_t> lastSentSeq;
     uint32_t tickCount = 0;
     size_t inflightDataSize = 0;
+};
+
+// Decides when the bitrate should go up or down. CongestionControl feeds it every in-flight packet event,
+// so new controllers (delay-based ones, for example) can be added and picked via the congestion_control server config.
+class CongestionControlStrategy
+{
+public:
+    virtual ~CongestionControlStrategy() = default;
+    // Returns the default strategy if there's none with this name
+    static std::unique_ptr<CongestionControlStrategy> Create(const std::string &name);
 
+    virtual const char *GetName() const = 0;
+    virtual size_t GetCongestionWindow() const = 0;
+    virtual void PacketSent(size_t size, double sendTime)
+    {
+    }
+    virtual void PacketAcknowledged(size_t size, double sendTime, double ackTime)
+    {
+    }
+    virtual void PacketLost(size_t size)
+    {
+    }
+    virtual void Tick(CongestionControl &conctl)
+    {
+    }
+    virtual CongestionControl::Action GetBandwidthControlAction(CongestionControl &conctl, int netMode, double multiply) = 0;
+};
+
+// The original algorithm: keep the average amount of in-flight data within 10% of a fixed congestion window
+class InflightWindowStrategy : public CongestionControlStrategy
+{
+public:
+    InflightWindowStrategy(size_t cwnd);
+    virtual const char *GetName() const override;
+    virtual size_t GetCongestionWindow() const override;
+    virtual CongestionControl::Action GetBandwidthControlAction(CongestionControl &conctl, int netMode, double multiply) override;
+
+private:
     size_t cwnd;
+    CongestionControl::Action lastAction = CongestionControl::None;
+    uint8_t lastActionCount = 0;
+    double lastActionTime = 0;
 };
 } // namespace tgvoip
 
@@ -0,0 +1,251 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "DelayGradientEstimator.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace tgvoip;
+
+// Exponential smoothing of the accumulated delay
+#define SMOOTHING_COEF 0.9
+#define TREND_GAIN 4.0
+#define MAX_TREND_SAMPLES 60
+// Threshold adaptation speed when the trend is below / above it, per millisecond
+#define THRESHOLD_K_DOWN 0.039
+#define THRESHOLD_K_UP 0.0087
+#define MIN_THRESHOLD 6.0
+#define MAX_THRESHOLD 600.0
+// How long the trend has to stay over the threshold before we call it overuse, ms
+#define OVERUSE_TIME 10.0
+#define DECREASE_FACTOR 0.85
+// Gives the queue time to drain before backing off again, seconds
+#define MIN_DECREASE_INTERVAL 0.3
+// Relative increase per second while the delay is stable
+#define INCREASE_RATE 0.08
+// Arrival and send deltas further apart than this mean the peer's clock jumped, ms
+#define MAX_DELTA_DIFF 3000.0
+
+DelayGradientEstimator::DelayGradientEstimator()
+{
+}
+
+void DelayGradientEstimator::Reset(uint32_t bitrate)
+{
+    targetBitrate = std::min(std::max(bitrate, minBitrate), maxBitrate);
+    hasGroup = hasPrevGroup = false;
+    numDeltas = 0;
+    accumulatedDelay = smoothedDelay = 0;
+    firstArrivalTime = -1;
+    historyPos = historyCount = 0;
+    trend = prevTrend = modifiedTrend = 0;
+    usage = Usage::Normal;
+    threshold = 12.5;
+    timeOverUsing = -1;
+    overuseCounter = 0;
+    lastThresholdUpdate = lastRateUpdate = lastDecrease = 0;
+}
+
+void DelayGradientEstimator::SetBitrateLimits(uint32_t minBitrate, uint32_t maxBitrate)
+{
+    this->minBitrate = minBitrate;
+    this->maxBitrate = std::max(minBitrate, maxBitrate);
+    targetBitrate = std::min(std::max(targetBitrate, (double)this->minBitrate), (double)this->maxBitrate);
+}
+
+void DelayGradientEstimator::SetTargetBitrate(uint32_t bitrate)
+{
+    targetBitrate = std::min(std::max(bitrate, minBitrate), maxBitrate);
+}
+
+void DelayGradientEstimator::PacketAcknowledged(double sendTime, uint32_t recvTS, double now)
+{
+    int64_t arrival = UnwrapArrival(recvTS);
+    if (!hasGroup)
+    {
+        group = {sendTime, sendTime, arrival};
+        hasGroup = true;
+        return;
+    }
+    // Acks for different streams can come in out of send order, older samples tell us nothing new
+    if (sendTime < group.firstSendTime)
+        return;
+    if (sendTime - group.firstSendTime <= TGVOIP_DGE_BURST_INTERVAL)
+    {
+        group.lastSendTime = std::max(group.lastSendTime, sendTime);
+        group.lastArrival = std::max(group.lastArrival, arrival);
+        return;
+    }
+    if (hasPrevGroup)
+    {
+        double sendDelta = (group.lastSendTime - prevGroup.lastSendTime) * 1000.0;
+        double arrivalDelta = (group.lastArrival - prevGroup.lastArrival) / 1000.0;
+        if (fabs(arrivalDelta - sendDelta) > MAX_DELTA_DIFF)
+        {
+            uint32_t bitrate = (uint32_t)targetBitrate;
+            Reset(bitrate);
+            group = {sendTime, sendTime, arrival};
+            hasGroup = true;
+            return;
+        }
+        ProcessGroupDelta(sendDelta, arrivalDelta, group.lastArrival / 1000.0, now);
+    }
+    prevGroup = group;
+    hasPrevGroup = true;
+    group = {sendTime, sendTime, arrival};
+}
+
+void DelayGradientEstimator::ProcessGroupDelta(double sendDelta, double arrivalDelta, double arrivalTime, double now)
+{
+    numDeltas = std::min(numDeltas + 1, 1000U);
+    accumulatedDelay += arrivalDelta - sendDelta;
+    smoothedDelay = SMOOTHING_COEF * smoothedDelay + (1 - SMOOTHING_COEF) * accumulatedDelay;
+    if (firstArrivalTime < 0)
+        firstArrivalTime = arrivalTime;
+
+    history[historyPos] = std::make_pair(arrivalTime - firstArrivalTime, smoothedDelay);
+    historyPos = (historyPos + 1) % history.size();
+    historyCount = std::min(historyCount + 1, history.size());
+
+    prevTrend = trend;
+    if (historyCount == history.size())
+        trend = FitTrend();
+
+    Detect(sendDelta, now);
+    UpdateTargetBitrate(now);
+}
+
+double DelayGradientEstimator::FitTrend() const
+{
+    // Least squares slope of smoothed delay over arrival time
+    double sumX = 0, sumY = 0;
+    for (const auto &p : history)
+    {
+        sumX += p.first;
+        sumY += p.second;
+    }
+    double avgX = sumX / history.size();
+    double avgY = sumY / history.size();
+    double num = 0, den = 0;
+    for (const auto &p : history)
+    {
+        num += (p.first - avgX) * (p.second - avgY);
+        den += (p.first - avgX) * (p.first - avgX);
+    }
+    return den == 0 ? trend : num / den;
+}
+
+void DelayGradientEstimator::Detect(double sendDelta, double now)
+{
+    if (numDeltas < 2)
+        return;
+    modifiedTrend = std::min(numDeltas, (uint32_t)MAX_TREND_SAMPLES) * trend * TREND_GAIN;
+    if (modifiedTrend > threshold)
+    {
+        if (timeOverUsing < 0)
+            timeOverUsing = sendDelta / 2;
+        else
+            timeOverUsing += sendDelta;
+        overuseCounter++;
+        if (timeOverUsing > OVERUSE_TIME && overuseCounter > 1 && trend >= prevTrend)
+        {
+            timeOverUsing = 0;
+            overuseCounter = 0;
+            usage = Usage::Overusing;
+        }
+    }
+    else if (modifiedTrend < -threshold)
+    {
+        timeOverUsing = -1;
+        overuseCounter = 0;
+        usage = Usage::Underusing;
+    }
+    else
+    {
+        timeOverUsing = -1;
+        overuseCounter = 0;
+        usage = Usage::Normal;
+    }
+    UpdateThreshold(now);
+}
+
+void DelayGradientEstimator::UpdateThreshold(double now)
+{
+    if (lastThresholdUpdate == 0)
+        lastThresholdUpdate = now;
+    double absTrend = fabs(modifiedTrend);
+    // A single spike shouldn't drag the threshold along
+    if (absTrend > threshold + 15.0)
+    {
+        lastThresholdUpdate = now;
+        return;
+    }
+    double k = absTrend < threshold ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+    double dt = std::min((now - lastThresholdUpdate) * 1000.0, 100.0);
+    threshold += k * (absTrend - threshold) * dt;
+    threshold = std::min(std::max(threshold, MIN_THRESHOLD), MAX_THRESHOLD);
+    lastThresholdUpdate = now;
+}
+
+void DelayGradientEstimator::UpdateTargetBitrate(double now)
+{
+    if (lastRateUpdate == 0)
+        lastRateUpdate = now;
+    double dt = std::min(now - lastRateUpdate, 1.0);
+    lastRateUpdate = now;
+    switch (usage)
+    {
+    case Usage::Overusing:
+        if (now - lastDecrease >= MIN_DECREASE_INTERVAL)
+        {
+            targetBitrate *= DECREASE_FACTOR;
+            lastDecrease = now;
+        }
+        break;
+    case Usage::Normal:
+        targetBitrate += targetBitrate * INCREASE_RATE * dt;
+        break;
+    case Usage::Underusing:
+        // The queue is draining, hold until it's empty
+        break;
+    }
+    targetBitrate = std::min(std::max(targetBitrate, (double)minBitrate), (double)maxBitrate);
+}
+
+int64_t DelayGradientEstimator::UnwrapArrival(uint32_t recvTS)
+{
+    if (!hasGroup && !hasPrevGroup)
+        unwrappedRecvTS = recvTS;
+    else
+        unwrappedRecvTS += (int32_t)(recvTS - lastRecvTS);
+    lastRecvTS = recvTS;
+    return unwrappedRecvTS;
+}
+
+uint32_t DelayGradientEstimator::GetTargetBitrate() const
+{
+    return (uint32_t)targetBitrate;
+}
+
+DelayGradientEstimator::Usage DelayGradientEstimator::GetUsage() const
+{
+    return usage;
+}
+
+double DelayGradientEstimator::GetModifiedTrend() const
+{
+    return modifiedTrend;
+}
+
+double DelayGradientEstimator::GetThreshold() const
+{
+    return threshold;
+}
+
+bool DelayGradientEstimator::HasEstimate() const
+{
+    return historyCount == history.size();
+}
@@ -0,0 +1,109 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_DELAYGRADIENTESTIMATOR_H
+#define LIBTGVOIP_DELAYGRADIENTESTIMATOR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Packets sent this close together are treated as one burst
+#define TGVOIP_DGE_BURST_INTERVAL 0.005
+// Number of smoothed delay samples the trend is fitted over
+#define TGVOIP_DGE_WINDOW_SIZE 20
+
+namespace tgvoip
+{
+
+// Sender-side bandwidth estimator driven by the one-way delay gradient.
+// The peer echoes its arrival time of the packet it acks in Packet::recvTS, so for every new ack
+// we know when that packet left us and when it reached the other side, each by its own clock.
+// The difference between successive arrival and send deltas is how much the path queue grew;
+// a trendline filter over those tells whether the link is overused long before it starts dropping.
+// All times are passed in, the estimator never looks at the clock itself.
+class DelayGradientEstimator
+{
+public:
+    enum class Usage : uint8_t
+    {
+        Normal,
+        Underusing,
+        Overusing
+    };
+
+    DelayGradientEstimator();
+
+    // Forgets the path and starts over from the given bitrate, e.g. after a network change
+    void Reset(uint32_t bitrate);
+    void SetBitrateLimits(uint32_t minBitrate, uint32_t maxBitrate);
+    // Lets other controllers (loss, data saving) pull the target down without losing the delay history
+    void SetTargetBitrate(uint32_t bitrate);
+    // sendTime and now are local times in seconds, recvTS is the peer's arrival time of the same packet in microseconds
+    void PacketAcknowledged(double sendTime, uint32_t recvTS, double now);
+
+    uint32_t GetTargetBitrate() const;
+    Usage GetUsage() const;
+    // Trend scaled the same way as the threshold it's compared with, in milliseconds
+    double GetModifiedTrend() const;
+    double GetThreshold() const;
+    // Whether enough samples came in for the target to mean anything
+    bool HasEstimate() const;
+
+private:
+    struct PacketGroup
+    {
+        double firstSendTime;
+        double lastSendTime;
+        // Unwrapped peer arrival time, microseconds
+        int64_t lastArrival;
+    };
+
+    void ProcessGroupDelta(double sendDelta, double arrivalDelta, double arrivalTime, double now);
+    double FitTrend() const;
+    void Detect(double sendDelta, double now);
+    void UpdateThreshold(double now);
+    void UpdateTargetBitrate(double now);
+    int64_t UnwrapArrival(uint32_t recvTS);
+
+    uint32_t minBitrate = 8000;
+    uint32_t maxBitrate = 20000;
+    double targetBitrate = 20000;
+
+    bool hasGroup = false;
+    bool hasPrevGroup = false;
+    PacketGroup group;
+    PacketGroup prevGroup;
+    uint32_t lastRecvTS = 0;
+    int64_t unwrappedRecvTS = 0;
+
+    // Trendline filter state, all in milliseconds
+    uint32_t numDeltas = 0;
+    double accumulatedDelay = 0;
+    double smoothedDelay = 0;
+    double firstArrivalTime = -1;
+    std::array<std::pair<double, double>, TGVOIP_DGE_WINDOW_SIZE> history;
+    size_t historyPos = 0;
+    size_t historyCount = 0;
+    double trend = 0;
+    double prevTrend = 0;
+
+    // Overuse detector state
+    Usage usage = Usage::Normal;
+    double modifiedTrend = 0;
+    double threshold = 12.5;
+    double timeOverUsing = -1;
+    uint32_t overuseCounter = 0;
+    double lastThresholdUpdate = 0;
+
+    double lastRateUpdate = 0;
+    double lastDecrease = 0;
+};
+
+} // namespace tgvoip
+
+#endif //LIBTGVOIP_DELAYGRADIENTESTIMATOR_H
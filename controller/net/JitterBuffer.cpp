@@ -174,7 +174,7 @@ double JitterBuffer::GetTimeoutWindow()
     return (lossesToReset * step) / 1000.0;
 }
 
-void JitterBuffer::HandleInput(std::unique_ptr<Buffer> &&buf, uint32_t timestamp, bool isEC)
+void JitterBuffer::HandleInput(std::unique_ptr<Buffer> &&buf, uint32_t timestamp, bool isEC, double recvTime)
 {
     MutexGuard m(mutex);
 
@@ -199,7 +199,7 @@ void JitterBuffer::HandleInput(std::unique_ptr<Buffer> &&buf, uint32_t timestamp
     slotsEc.advance(nextFetchTimestamp - 1);
 
     // Time deviation check
-    double time = VoIPController::GetCurrentTime();
+    double time = recvTime > 0 ? recvTime : VoIPController::GetCurrentTime();
     if (expectNextAtTimeMs)
     {
         deviationHistory.Add(expectNextAtTimeMs - time);
@@ -70,7 +70,8 @@ public:
     unsigned int GetCurrentDelay();
     double GetAverageDelay();
     void Reset();
-    void HandleInput(std::unique_ptr<Buffer> &&buf, uint32_t timestamp, bool isEC);
+    // recvTime is the arrival time of the packet, 0 for now
+    void HandleInput(std::unique_ptr<Buffer> &&buf, uint32_t timestamp, bool isEC, double recvTime = 0);
     std::pair<std::unique_ptr<Buffer>, std::unique_ptr<Buffer>> HandleOutput(int &playbackScaledDuration);
 
     bool haveNext(bool ec);
@@ -12,6 +12,9 @@
 #else
 #include "os/posix/NetworkSocketPosix.h"
 #endif
+#if defined(__linux__) && defined(TGVOIP_USE_IO_URING)
+#include "os/linux/NetworkSocketIOUring.h"
+#endif
 #include "VoIPController.h"
 #include "VoIPServerConfig.h"
 #include "controller/net/NetworkSocket.h"
@@ -57,6 +60,15 @@ bool NetworkSocket::IsFailed()
 
 std::shared_ptr<NetworkSocket> NetworkSocket::Create(NetworkProtocol protocol)
 {
+#if defined(__linux__) && defined(TGVOIP_USE_IO_URING)
+    if (protocol == NetworkProtocol::UDP && ServerConfig::GetSharedInstance()->GetBoolean("use_io_uring", false))
+    {
+        auto socket = std::make_shared<NetworkSocketIOUring>(protocol);
+        if (socket->IsRingReady())
+            return socket;
+        LOGW("io_uring is not available, using regular sockets");
+    }
+#endif
 #ifndef _WIN32
     return std::make_shared<NetworkSocketPosix>(protocol);
 #else
@@ -97,6 +109,14 @@ void NetworkSocket::GenerateTCPO2States(unsigned char *buffer, TCPO2State *recvS
     memcpy(recvState->key, reversed, 32);
     memcpy(recvState->iv, reversed + 32, 16);
 
+    if (VoIPController::crypto.aes_set_encrypt_key && VoIPController::crypto.aes_ctr_encrypt_keyed)
+    {
+        VoIPController::crypto.aes_set_encrypt_key(sendState->keyContext, sendState->key);
+        sendState->keyContextReady = true;
+        VoIPController::crypto.aes_set_encrypt_key(recvState->keyContext, recvState->key);
+        recvState->keyContextReady = true;
+    }
+
     // write protocol identifier
     *reinterpret_cast<uint32_t *>(nonce + 56) = 0xefefefefU;
     memcpy(buffer, nonce, 56);
@@ -106,7 +126,10 @@ void NetworkSocket::GenerateTCPO2States(unsigned char *buffer, TCPO2State *recvS
 
 void NetworkSocket::EncryptForTCPO2(unsigned char *buffer, size_t len, TCPO2State *state)
 {
-    VoIPController::crypto.aes_ctr_encrypt(buffer, len, state->key, state->iv, state->ecount, &state->num);
+    if (state->keyContextReady)
+        VoIPController::crypto.aes_ctr_encrypt_keyed(buffer, len, state->keyContext, state->iv, state->ecount, &state->num);
+    else
+        VoIPController::crypto.aes_ctr_encrypt(buffer, len, state->key, state->iv, state->ecount, &state->num);
 }
 
 size_t NetworkSocket::Receive(unsigned char *buffer, size_t len)
@@ -119,6 +142,24 @@ size_t NetworkSocket::Receive(unsigned char *buffer, size_t len)
     return actualLen;
 }
 
+void NetworkSocket::SendBatch(std::vector<NetworkPacket> &packets)
+{
+    for (NetworkPacket &packet : packets)
+        Send(std::move(packet));
+    packets.clear();
+}
+
+size_t NetworkSocket::ReceiveBatch(std::vector<NetworkPacket> &packets, size_t max)
+{
+    if (max == 0)
+        return 0;
+    NetworkPacket pkt = Receive();
+    if (pkt.IsEmpty())
+        return 0;
+    packets.push_back(std::move(pkt));
+    return 1;
+}
+
 bool NetworkAddress::operator==(const NetworkAddress &other) const
 {
     if (isIPv6 != other.isIPv6)
@@ -261,6 +302,87 @@ std::unique_ptr<SocketSelectCanceller> SocketSelectCanceller::Create()
 #endif
 }
 
+SocketReactor::SocketReactor(const std::unique_ptr<SocketSelectCanceller> &canceller) : canceller(canceller)
+{
+}
+
+SocketReactor::~SocketReactor()
+{
+}
+
+std::unique_ptr<SocketReactor> SocketReactor::Create(const std::unique_ptr<SocketSelectCanceller> &canceller)
+{
+#ifdef __linux__
+    std::unique_ptr<SocketReactorEpoll> reactor = std::make_unique<SocketReactorEpoll>(canceller);
+    if (!reactor->IsFailed())
+        return reactor;
+    LOGW("Failed to create epoll reactor, falling back to select");
+#endif
+    return std::make_unique<SocketReactor>(canceller);
+}
+
+void SocketReactor::SetSockets(const std::vector<Registration> &sockets)
+{
+    std::vector<Entry> newEntries;
+    newEntries.reserve(sockets.size());
+    for (const Registration &reg : sockets)
+    {
+        std::shared_ptr<NetworkSocket> transport = reg.transport ? reg.transport : reg.socket;
+        auto existing = std::find_if(entries.begin(), entries.end(), [&](const Entry &e) {
+            return e.socket == reg.socket && e.transport == transport;
+        });
+        if (existing != entries.end())
+        {
+            newEntries.push_back(std::move(*existing));
+            entries.erase(existing);
+            continue;
+        }
+        newEntries.push_back(Entry{reg.socket, transport, dynamic_cast<NetworkSocketSOCKS5Proxy *>(transport.get()), -1, false, false});
+        OnEntryAdded(newEntries.back());
+    }
+    for (Entry &e : entries)
+    {
+        OnEntryRemoved(e);
+    }
+    entries = std::move(newEntries);
+}
+
+bool SocketReactor::Wait(std::vector<std::shared_ptr<NetworkSocket>> &readFds, std::vector<std::shared_ptr<NetworkSocket>> &writeFds, std::vector<std::shared_ptr<NetworkSocket>> &errorFds)
+{
+    readFds.clear();
+    writeFds.clear();
+    errorFds.clear();
+    for (const Entry &e : entries)
+    {
+        readFds.push_back(e.socket);
+        errorFds.push_back(e.transport);
+        if (NeedWriteReadiness(e))
+            writeFds.push_back(e.transport);
+    }
+    return NetworkSocket::Select(readFds, writeFds, errorFds, canceller);
+}
+
+bool SocketReactor::NeedWriteReadiness(const Entry &entry)
+{
+    return !entry.transport->IsReadyToSend() && (!entry.proxy || entry.proxy->NeedSelectForSending());
+}
+
+bool SocketReactor::CheckTimedOut(NetworkSocket *socket)
+{
+    if (socket->timeout > 0 && VoIPController::GetCurrentTime() - socket->lastSuccessfulOperationTime > socket->timeout)
+    {
+        LOGW("Socket timed out");
+        socket->failed = true;
+        return true;
+    }
+    return false;
+}
+
+void SocketReactor::SetLastSuccessfulOperationTime(NetworkSocket *socket)
+{
+    socket->lastSuccessfulOperationTime = VoIPController::GetCurrentTime();
+}
+
 NetworkSocketTCPObfuscated::NetworkSocketTCPObfuscated(const std::shared_ptr<NetworkSocket> &wrapped) : NetworkSocketWrapper(NetworkProtocol::TCP)
 {
     this->wrapped = wrapped;
@@ -476,7 +598,8 @@ NetworkPacket NetworkSocketSOCKS5Proxy::Receive(size_t maxLen)
                 std::move(copy),
                 address,
                 htons(in.ReadInt16()),
-                protocol};
+                protocol,
+                p.recvTime};
         }
     }
     return NetworkPacket::Empty();
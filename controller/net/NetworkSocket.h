@@ -40,6 +40,9 @@ struct TCPO2State
     unsigned char iv[16];
     unsigned char ecount[16];
     uint32_t num;
+    // Expanded key, valid when keyContextReady is set
+    alignas(16) unsigned char keyContext[TGVOIP_CRYPTO_CONTEXT_SIZE];
+    bool keyContextReady;
 };
 
 class NetworkAddress
@@ -77,6 +80,8 @@ struct NetworkPacket
     NetworkAddress address;
     uint16_t port;
     NetworkProtocol protocol;
+    // When the packet arrived, in VoIPController::GetCurrentTime() timebase. Taken from the kernel where possible, 0 if unknown.
+    double recvTime = 0.0;
 
     static NetworkPacket Empty()
     {
@@ -102,13 +107,20 @@ class NetworkSocket
 public:
     friend class NetworkSocketPosix;
     friend class NetworkSocketWinsock;
+    friend class SocketReactor;
+    friend class SocketReactorEpoll;
 
     TGVOIP_DISALLOW_COPY_AND_ASSIGN(NetworkSocket);
     NetworkSocket(NetworkProtocol protocol);
     virtual ~NetworkSocket();
     virtual void Send(NetworkPacket &&packet) = 0;
+    // Sends all packets and clears the vector. The default implementation sends them one by one.
+    virtual void SendBatch(std::vector<NetworkPacket> &packets);
     virtual NetworkPacket Receive(size_t maxLen = 0) = 0;
     size_t Receive(unsigned char *buffer, size_t len);
+    // Appends up to max packets that are ready to be read without blocking, returns the number appended.
+    // The default implementation reads a single packet.
+    virtual size_t ReceiveBatch(std::vector<NetworkPacket> &packets, size_t max);
     virtual void Open() = 0;
     virtual void Close() = 0;
     virtual uint16_t GetLocalPort() { return 0; };
@@ -120,6 +132,11 @@ public:
     virtual void SetTimeouts(int sendTimeout, int recvTimeout){};
 
     virtual bool IsFailed();
+    // Packets that were handed to Send or SendBatch but never made it to the kernel
+    uint64_t GetDroppedPacketCount()
+    {
+        return droppedPackets.load(std::memory_order_relaxed);
+    }
     virtual bool IsReadyToSend()
     {
         return readyToSend;
@@ -148,6 +165,7 @@ protected:
     double ipv6Timeout;
     unsigned char nat64Prefix[12];
     std::atomic<bool> failed;
+    std::atomic<uint64_t> droppedPackets{0};
     bool readyToSend = false;
     double lastSuccessfulOperationTime = 0.0;
     double timeout = 0.0;
@@ -230,6 +248,50 @@ private:
     ConnectionState state = ConnectionState::Initial;
 };
 
+// Keeps a persistent set of sockets to wait on, so that the caller doesn't have to rebuild it on every wakeup.
+// The base implementation is built on top of NetworkSocket::Select.
+class SocketReactor
+{
+public:
+    struct Registration
+    {
+        // Reported in readFds
+        std::shared_ptr<NetworkSocket> socket;
+        // Reported in writeFds and errorFds, same as socket if null (i.e. the real UDP socket behind a proxy)
+        std::shared_ptr<NetworkSocket> transport;
+    };
+
+    TGVOIP_DISALLOW_COPY_AND_ASSIGN(SocketReactor);
+    SocketReactor(const std::unique_ptr<SocketSelectCanceller> &canceller);
+    virtual ~SocketReactor();
+    // Replaces the registered set. Sockets that were already registered keep their registration.
+    virtual void SetSockets(const std::vector<Registration> &sockets);
+    // Same contract as NetworkSocket::Select, the vectors are filled with the sockets that are ready.
+    // Write readiness is only waited for on sockets that aren't ready to send.
+    virtual bool Wait(std::vector<std::shared_ptr<NetworkSocket>> &readFds, std::vector<std::shared_ptr<NetworkSocket>> &writeFds, std::vector<std::shared_ptr<NetworkSocket>> &errorFds);
+
+    static std::unique_ptr<SocketReactor> Create(const std::unique_ptr<SocketSelectCanceller> &canceller);
+
+protected:
+    struct Entry
+    {
+        std::shared_ptr<NetworkSocket> socket;
+        std::shared_ptr<NetworkSocket> transport;
+        NetworkSocketSOCKS5Proxy *proxy;
+        int fd;
+        bool writeArmed;
+        bool edgeTriggered;
+    };
+    virtual void OnEntryAdded(Entry &entry){};
+    virtual void OnEntryRemoved(Entry &entry){};
+    static bool NeedWriteReadiness(const Entry &entry);
+    static bool CheckTimedOut(NetworkSocket *socket);
+    static void SetLastSuccessfulOperationTime(NetworkSocket *socket);
+
+    std::vector<Entry> entries;
+    const std::unique_ptr<SocketSelectCanceller> &canceller;
+};
+
 } // namespace tgvoip
 
 #endif //LIBTGVOIP_NETWORKSOCKET_H
@@ -0,0 +1,180 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "PacketPacer.h"
+#include <algorithm>
+
+using namespace tgvoip;
+
+// Bytes a weighted queue may send per round for each unit of weight
+#define DRR_QUANTUM 1500
+
+PacketPacer::PacketPacer(size_t burstSize, double latencyBudget) : burstSize(burstSize), latencyBudget(latencyBudget)
+{
+    tokens = (double)burstSize;
+}
+
+void PacketPacer::ConfigureStream(uint8_t streamId, Scheduling scheduling, uint32_t weight, double maxAge)
+{
+    StreamQueue &q = GetQueue(streamId);
+    q.scheduling = scheduling;
+    q.weight = std::max(weight, 1U);
+    q.maxAge = maxAge;
+}
+
+void PacketPacer::SetRate(uint32_t rate)
+{
+    this->rate.store(rate, std::memory_order_relaxed);
+}
+
+void PacketPacer::Enqueue(NetworkPacket &&packet, std::shared_ptr<NetworkSocket> &&socket, uint8_t streamId, uint32_t seq, double enqueueTime)
+{
+    StreamQueue &q = GetQueue(streamId);
+    q.entries.push_back(Entry{std::move(packet), std::move(socket), seq, enqueueTime});
+    MutexGuard m(statsMutex);
+    StreamStats &s = GetStreamStats(streamId);
+    s.queued++;
+    s.maxQueued = std::max(s.maxQueued, s.queued);
+}
+
+bool PacketPacer::IsEmpty() const
+{
+    for (const StreamQueue &q : queues)
+    {
+        if (!q.entries.empty())
+            return false;
+    }
+    return true;
+}
+
+double PacketPacer::GetTimeUntilNextRelease(double now)
+{
+    double oldestWeighted = -1;
+    for (const StreamQueue &q : queues)
+    {
+        if (q.entries.empty())
+            continue;
+        if (q.scheduling == Scheduling::StrictPriority)
+            return 0;
+        if (oldestWeighted < 0 || q.entries.front().enqueueTime < oldestWeighted)
+            oldestWeighted = q.entries.front().enqueueTime;
+    }
+    if (oldestWeighted < 0)
+        return -1;
+    Refill(now);
+    if (!currentRate || tokens > 0)
+        return 0;
+    // Wait for a byte more than the debt so that rounding can't leave us at exactly zero tokens
+    double untilTokens = (1 - tokens) / currentRate;
+    double untilBudget = oldestWeighted + latencyBudget - now;
+    return std::max(0.0, std::min(untilTokens, untilBudget));
+}
+
+PacketPacer::StreamQueue &PacketPacer::GetQueue(uint8_t streamId)
+{
+    for (StreamQueue &q : queues)
+    {
+        if (q.streamId == streamId)
+            return q;
+    }
+    queues.push_back(StreamQueue{streamId, Scheduling::Weighted, 1, 0});
+    return queues.back();
+}
+
+PacketPacer::StreamQueue *PacketPacer::NextWeightedQueue()
+{
+    bool haveWeighted = false;
+    for (StreamQueue &q : queues)
+    {
+        if (q.scheduling == Scheduling::Weighted && !q.entries.empty())
+        {
+            haveWeighted = true;
+            break;
+        }
+    }
+    if (!haveWeighted)
+        return nullptr;
+    while (true)
+    {
+        StreamQueue &q = queues[roundRobinIndex];
+        if (q.scheduling == Scheduling::Weighted)
+        {
+            if (q.entries.empty())
+            {
+                // An idle queue doesn't get to save up
+                q.deficit = 0;
+            }
+            else if (q.deficit >= (int64_t)q.entries.front().packet.data->Length())
+            {
+                return &q;
+            }
+            else
+            {
+                q.deficit += (int64_t)DRR_QUANTUM * q.weight;
+            }
+        }
+        roundRobinIndex = (roundRobinIndex + 1) % queues.size();
+    }
+}
+
+PacketPacer::StreamQueue *PacketPacer::OldestOverBudgetQueue(double now)
+{
+    StreamQueue *oldest = nullptr;
+    for (StreamQueue &q : queues)
+    {
+        if (q.scheduling != Scheduling::Weighted || q.entries.empty() || now - q.entries.front().enqueueTime < latencyBudget)
+            continue;
+        if (!oldest || q.entries.front().enqueueTime < oldest->entries.front().enqueueTime)
+            oldest = &q;
+    }
+    return oldest;
+}
+
+void PacketPacer::Refill(double now)
+{
+    currentRate = rate.load(std::memory_order_relaxed) / 8.0;
+    if (lastRefill)
+        tokens = std::min((double)burstSize, tokens + (now - lastRefill) * currentRate);
+    lastRefill = now;
+}
+
+void PacketPacer::RecordSent(StreamQueue &queue, double delay)
+{
+    MutexGuard m(statsMutex);
+    StreamStats &s = GetStreamStats(queue.streamId);
+    s.queued--;
+    s.packets++;
+    s.totalDelay += delay;
+    s.maxDelay = std::max(s.maxDelay, delay);
+}
+
+void PacketPacer::RecordDropped(StreamQueue &queue)
+{
+    MutexGuard m(statsMutex);
+    StreamStats &s = GetStreamStats(queue.streamId);
+    s.queued--;
+    s.dropped++;
+}
+
+PacketPacer::StreamStats &PacketPacer::GetStreamStats(uint8_t streamId)
+{
+    for (StreamStats &s : stats.streams)
+    {
+        if (s.streamId == streamId)
+            return s;
+    }
+    stats.streams.emplace_back();
+    stats.streams.back().streamId = streamId;
+    return stats.streams.back();
+}
+
+PacketPacer::Stats PacketPacer::GetStats()
+{
+    MutexGuard m(statsMutex);
+    Stats s = stats;
+    s.rate = rate.load(std::memory_order_relaxed);
+    return s;
+}
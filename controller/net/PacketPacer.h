@@ -0,0 +1,171 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_PACKETPACER_H
+#define LIBTGVOIP_PACKETPACER_H
+
+#include "NetworkSocket.h"
+#include "tools/threading.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+namespace tgvoip
+{
+
+// Token bucket between the packet senders and the socket, owned by the send thread.
+// Every stream gets its own queue. Strict priority streams (audio) always go out right away and only use up tokens,
+// weighted ones (signaling, video) share the tokens by deficit round robin so that a keyframe doesn't leave at line rate.
+// A weighted packet that has waited for longer than the latency budget goes out regardless.
+class PacketPacer
+{
+public:
+    enum class Scheduling : uint8_t
+    {
+        StrictPriority,
+        Weighted
+    };
+
+    struct StreamStats
+    {
+        uint8_t streamId = 0;
+        size_t queued = 0;
+        size_t maxQueued = 0;
+        uint64_t packets = 0;
+        // Strict priority packets that were too old to be worth sending
+        uint64_t dropped = 0;
+        double totalDelay = 0;
+        double maxDelay = 0;
+    };
+
+    struct Stats
+    {
+        std::vector<StreamStats> streams;
+        // Weighted packets sent without tokens because they hit the latency budget
+        uint64_t budgetOverruns = 0;
+        uint32_t rate = 0;
+    };
+
+    PacketPacer(size_t burstSize, double latencyBudget);
+
+    // Has to be called before the send thread starts. Packets older than maxAge seconds are dropped instead of sent, 0 keeps them.
+    void ConfigureStream(uint8_t streamId, Scheduling scheduling, uint32_t weight, double maxAge);
+    // Bits per second, 0 sends everything as soon as it's queued. Safe to call from any thread.
+    void SetRate(uint32_t rate);
+    // enqueueTime is when the packet was handed to the send thread, it's what queue delays and max ages count from.
+    // seq is only handed back to Release so that the caller knows which packet went out.
+    void Enqueue(NetworkPacket &&packet, std::shared_ptr<NetworkSocket> &&socket, uint8_t streamId, uint32_t seq, double enqueueTime);
+    bool IsEmpty() const;
+    // Seconds until Release will have something to send, negative if the queues are empty
+    double GetTimeUntilNextRelease(double now);
+    // Calls f(NetworkPacket &&, std::shared_ptr<NetworkSocket> &&, uint8_t streamId, uint32_t seq) for every packet that may go out now, strict priority first,
+    // and dropped(uint8_t streamId, uint32_t seq) for every packet that got too old to be sent
+    template <typename F, typename D>
+    void Release(double now, F &&f, D &&dropped)
+    {
+        Refill(now);
+        for (StreamQueue &q : queues)
+        {
+            if (q.scheduling != Scheduling::StrictPriority)
+                continue;
+            while (!q.entries.empty())
+            {
+                Entry &e = q.entries.front();
+                if (q.maxAge && now - e.enqueueTime > q.maxAge)
+                {
+                    RecordDropped(q);
+                    dropped(q.streamId, e.seq);
+                }
+                else
+                {
+                    tokens -= (double)e.packet.data->Length();
+                    RecordSent(q, now - e.enqueueTime);
+                    f(std::move(e.packet), std::move(e.socket), q.streamId, e.seq);
+                }
+                q.entries.pop_front();
+            }
+        }
+        while (true)
+        {
+            StreamQueue *q;
+            bool hasTokens = !currentRate || tokens > 0;
+            if (hasTokens)
+            {
+                q = NextWeightedQueue();
+            }
+            else
+            {
+                q = OldestOverBudgetQueue(now);
+                if (q)
+                {
+                    MutexGuard m(statsMutex);
+                    stats.budgetOverruns++;
+                }
+            }
+            if (!q)
+                break;
+            Entry &e = q->entries.front();
+            size_t size = e.packet.data->Length();
+            tokens -= (double)size;
+            if (hasTokens)
+                q->deficit -= (int64_t)size;
+            RecordSent(*q, now - e.enqueueTime);
+            f(std::move(e.packet), std::move(e.socket), q->streamId, e.seq);
+            q->entries.pop_front();
+        }
+        // Don't let a burst forced out by the latency budget hold back everything after it
+        tokens = std::max(tokens, -(double)burstSize);
+    }
+    Stats GetStats();
+
+private:
+    struct Entry
+    {
+        NetworkPacket packet;
+        std::shared_ptr<NetworkSocket> socket;
+        uint32_t seq;
+        double enqueueTime;
+    };
+
+    struct StreamQueue
+    {
+        uint8_t streamId;
+        Scheduling scheduling;
+        uint32_t weight;
+        double maxAge;
+        int64_t deficit = 0;
+        std::deque<Entry> entries;
+    };
+
+    StreamQueue &GetQueue(uint8_t streamId);
+    StreamQueue *NextWeightedQueue();
+    StreamQueue *OldestOverBudgetQueue(double now);
+    void Refill(double now);
+    void RecordSent(StreamQueue &queue, double delay);
+    void RecordDropped(StreamQueue &queue);
+    StreamStats &GetStreamStats(uint8_t streamId);
+
+    // Few enough streams that a linear search beats anything smarter. A deque because the entries can't be copied when it grows.
+    std::deque<StreamQueue> queues;
+    size_t roundRobinIndex = 0;
+    size_t burstSize;
+    double latencyBudget;
+    std::atomic<uint32_t> rate{0};
+    // Rate the bucket is currently being filled at, bytes per second
+    double currentRate = 0;
+    double tokens = 0;
+    double lastRefill = 0;
+
+    Mutex statsMutex;
+    Stats stats;
+};
+
+} // namespace tgvoip
+
+#endif //LIBTGVOIP_PACKETPACER_H
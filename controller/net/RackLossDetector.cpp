@@ -0,0 +1,88 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "RackLossDetector.h"
+#include <algorithm>
+
+using namespace tgvoip;
+
+#define MAX_WINDOW_MULTIPLIER 8
+// After this many losses without a spurious one the window goes back to its base size
+#define LOSSES_BEFORE_WINDOW_RESET 16
+// Packets nothing was acked after are given up on after this long at the least, seconds
+#define MIN_TAIL_TIMEOUT 0.2
+
+RackLossDetector::RackLossDetector()
+{
+    Reset();
+}
+
+void RackLossDetector::Reset()
+{
+    xmitTime = rtt = advanceTime = 0;
+    minRtt = smoothedRtt = 0;
+    reorderingSeen = false;
+    reorderExtent = 0;
+    windowMultiplier = 1;
+    lossesSinceSpurious = 0;
+    spuriousLosses = 0;
+}
+
+void RackLossDetector::PacketAcknowledged(double sendTime, double ackTime, bool wasDeclaredLost)
+{
+    double sample = ackTime - sendTime;
+    minRtt = minRtt ? std::min(minRtt, sample) : sample;
+    smoothedRtt = smoothedRtt ? (smoothedRtt * 7 + sample) / 8 : sample;
+
+    if (wasDeclaredLost)
+    {
+        spuriousLosses++;
+        lossesSinceSpurious = 0;
+        windowMultiplier = std::min(windowMultiplier + 1, (uint32_t)MAX_WINDOW_MULTIPLIER);
+    }
+
+    if (sendTime < xmitTime)
+    {
+        // Overtaken by a packet sent after it
+        reorderingSeen = true;
+        double extent = ackTime - advanceTime;
+        reorderExtent = extent > reorderExtent ? extent : reorderExtent * 0.95 + extent * 0.05;
+        return;
+    }
+    xmitTime = sendTime;
+    rtt = sample;
+    advanceTime = ackTime;
+}
+
+bool RackLossDetector::IsLost(double sendTime, double now) const
+{
+    double window = GetReorderWindow();
+    if (xmitTime && sendTime < xmitTime)
+        return now - sendTime >= rtt + window;
+    // Nothing sent after it was acked yet, fall back to a timeout
+    return now - sendTime > std::max(smoothedRtt * 2 + window, MIN_TAIL_TIMEOUT);
+}
+
+void RackLossDetector::PacketLost()
+{
+    if (++lossesSinceSpurious >= LOSSES_BEFORE_WINDOW_RESET)
+    {
+        lossesSinceSpurious = 0;
+        windowMultiplier = 1;
+    }
+}
+
+double RackLossDetector::GetReorderWindow() const
+{
+    if (!reorderingSeen)
+        return 0;
+    return std::min(std::max(windowMultiplier * minRtt / 4, reorderExtent), smoothedRtt);
+}
+
+uint32_t RackLossDetector::GetSpuriousLossCount() const
+{
+    return spuriousLosses;
+}
@@ -0,0 +1,53 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_RACKLOSSDETECTOR_H
+#define LIBTGVOIP_RACKLOSSDETECTOR_H
+
+#include <stdint.h>
+
+namespace tgvoip
+{
+
+// Time-based loss detection along the lines of RACK (RFC 8985).
+// A packet only counts as lost once a packet sent after it was acked and a reorder window has passed since,
+// so packets that merely overtook each other on Wi-Fi or LTE aren't retransmitted or blamed on congestion.
+// The window stays at zero until reordering is actually seen, then follows how far packets were reordered
+// and grows every time a packet we had given up on turns out to have arrived after all.
+class RackLossDetector
+{
+public:
+    RackLossDetector();
+
+    // sendTime and ackTime in seconds. wasDeclaredLost is whether IsLost already returned true for this packet.
+    void PacketAcknowledged(double sendTime, double ackTime, bool wasDeclaredLost);
+    // Whether a packet sent at sendTime and still not acked should be given up on at now
+    bool IsLost(double sendTime, double now) const;
+    // Called for every packet IsLost returned true for
+    void PacketLost();
+    double GetReorderWindow() const;
+    uint32_t GetSpuriousLossCount() const;
+    void Reset();
+
+private:
+    // Send time, RTT and ack time of the most recently sent packet that was acked
+    double xmitTime;
+    double rtt;
+    double advanceTime;
+
+    double minRtt;
+    double smoothedRtt;
+    bool reorderingSeen;
+    // How long after a later packet's ack the reordered ones showed up, decays slowly
+    double reorderExtent;
+    uint32_t windowMultiplier;
+    uint32_t lossesSinceSpurious;
+    uint32_t spuriousLosses;
+};
+
+} // namespace tgvoip
+
+#endif //LIBTGVOIP_RACKLOSSDETECTOR_H
@@ -1,4 +1,5 @@
 #include "../../VoIPController.h"
+#include "../../video/VideoPacketSender.h"
 
 using namespace tgvoip;
 
@@ -16,14 +17,13 @@ double VoIPController::GetAverageRTT()
         {
             double res = 0;
             size_t count = 0;
-            for (const auto &packet : pm.getRecentOutgoingPackets())
-            {
+            pm.forEachRecentOutgoingPacket([&](const RecentOutgoingPacket &packet) {
                 if (packet.rttTime)
                 {
                     res += packet.rttTime;
                     count++;
                 }
-            }
+            });
             if (count)
                 res /= count;
             return res;
@@ -140,7 +140,65 @@ void VoIPController::UpdateAudioBitrateLimit()
         encoder->SetVadMode(dataSavingMode || dataSavingRequestedByPeer);
         if (echoCanceller)
             echoCanceller->SetVoiceDetectionEnabled(dataSavingMode || dataSavingRequestedByPeer);
+
+        // Whatever the delay estimator learned was about the old path or limits
+        uint32_t bitrate = encoder->GetBitrate();
+        uint32_t limit = maxBitrate;
+        messageThread.Post([this, bitrate, limit] {
+            delayEstimator.SetBitrateLimits(minAudioBitrate, limit);
+            delayEstimator.Reset(bitrate);
+        });
+    }
+}
+
+void VoIPController::UpdateDelayBasedBitrate()
+{
+    ENFORCE_MSG_THREAD;
+    if (!encoder || !delayEstimator.HasEstimate())
+        return;
+
+    video::VideoPacketSender *videoSender = GetOutgoingVideoSender();
+    // Audio gets served first, video gets whatever is left
+    delayEstimator.SetBitrateLimits(minAudioBitrate, maxBitrate + (videoSender ? maxVideoBitrate : 0));
+    uint32_t target = delayEstimator.GetTargetBitrate();
+    uint32_t audioBitrate = std::min(target, maxBitrate);
+    uint32_t currentBitrate = encoder->GetBitrate();
+    uint32_t diff = audioBitrate > currentBitrate ? audioBitrate - currentBitrate : currentBitrate - audioBitrate;
+    // Don't poke the encoder over every tiny wiggle of the estimate, but do let it reach the limits
+    if (diff >= 500 || (diff && (audioBitrate == maxBitrate || audioBitrate == minAudioBitrate)))
+        encoder->SetBitrate(audioBitrate);
+    if (videoSender)
+        videoSender->SetBitrateLimit(target - audioBitrate);
+    UpdatePacingRate();
+}
+
+void VoIPController::UpdatePacingRate()
+{
+    ENFORCE_MSG_THREAD;
+    if (!usePacer || !encoder)
+        return;
+
+    uint32_t target;
+    if (useDelayBasedBitrate && delayEstimator.HasEstimate())
+    {
+        target = delayEstimator.GetTargetBitrate();
     }
+    else
+    {
+        target = encoder->GetBitrate();
+        // Scream doesn't have a target until video starts flowing, don't choke the first frames
+        if (video::VideoPacketSender *videoSender = GetOutgoingVideoSender())
+            target += videoSender->GetBitrate() ? videoSender->GetBitrate() : maxVideoBitrate;
+    }
+    pacer.SetRate((uint32_t)(target * pacingRateFactor));
+}
+
+video::VideoPacketSender *VoIPController::GetOutgoingVideoSender()
+{
+    auto *videoStream = GetStreamByType<OutgoingVideoStream>();
+    if (!videoStream || !videoStream->enabled)
+        return nullptr;
+    return dynamic_cast<video::VideoPacketSender *>(videoStream->packetSender.get());
 }
 
 void VoIPController::UpdateDataSavingState()
@@ -19,51 +19,47 @@ void VoIPController::RunRecvThread()
     else
     {
         udpConnectivityState = UDP_PING_PENDING;
-        udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.0, 0.5);
+        udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.0, 0.5, "SendUdpPings");
     }
+    std::unique_ptr<SocketReactor> reactor = SocketReactor::Create(selectCanceller);
+    bool socketsChanged = true;
+    vector<std::shared_ptr<NetworkSocket>> readSockets;
+    vector<std::shared_ptr<NetworkSocket>> errorSockets;
+    vector<std::shared_ptr<NetworkSocket>> writeSockets;
+    // Reused across iterations so that receiving doesn't allocate once the packet buffers are pooled
+    vector<NetworkPacket> packets;
+    packets.reserve(RECV_BATCH_SIZE);
     while (runReceiver)
     {
         if (proxyProtocol == PROXY_SOCKS5 && needReInitUdpProxy)
         {
             InitUDPProxy();
             needReInitUdpProxy = false;
+            socketsChanged = true;
         }
 
-        vector<std::shared_ptr<NetworkSocket>> readSockets;
-        vector<std::shared_ptr<NetworkSocket>> errorSockets;
-        vector<std::shared_ptr<NetworkSocket>> writeSockets;
-        readSockets.push_back(udpSocket);
-        errorSockets.push_back(realUdpSocket);
-        if (!realUdpSocket->IsReadyToSend())
-            writeSockets.push_back(realUdpSocket);
-
+        // Anything that replaces a socket cancels the select, so the registered set only needs to be rebuilt then
+        if (socketsChanged)
         {
+            vector<SocketReactor::Registration> sockets;
+            sockets.push_back(SocketReactor::Registration{udpSocket, realUdpSocket});
             MutexGuard m(endpointsMutex);
             for (pair<const int64_t, Endpoint> &_e : endpoints)
             {
                 const Endpoint &e = _e.second;
-                if (e.type == Endpoint::Type::TCP_RELAY)
-                {
-                    if (e.socket)
-                    {
-                        readSockets.push_back(e.socket);
-                        errorSockets.push_back(e.socket);
-                        if (!e.socket->IsReadyToSend())
-                        {
-                            NetworkSocketSOCKS5Proxy *proxy = dynamic_cast<NetworkSocketSOCKS5Proxy *>(&*e.socket);
-                            if (!proxy || proxy->NeedSelectForSending())
-                                writeSockets.push_back(e.socket);
-                        }
-                    }
-                }
+                if (e.type == Endpoint::Type::TCP_RELAY && e.socket)
+                    sockets.push_back(SocketReactor::Registration{e.socket, nullptr});
             }
+            reactor->SetSockets(sockets);
+            socketsChanged = false;
         }
 
         {
-            bool selRes = NetworkSocket::Select(readSockets, writeSockets, errorSockets, selectCanceller);
+            bool selRes = reactor->Wait(readSockets, writeSockets, errorSockets);
             if (!selRes)
             {
                 LOGV("Select canceled");
+                socketsChanged = true;
                 continue;
             }
         }
@@ -92,30 +88,50 @@ void VoIPController::RunRecvThread()
                     }
                 }
             }
+            socketsChanged = true;
             continue;
         }
 
+        bool anyPacketsQueued = false;
         for (std::shared_ptr<NetworkSocket> &socket : readSockets)
         {
-            //while(packet.length){
-            NetworkPacket packet = socket->Receive();
-            if (packet.address.IsEmpty())
+            // Drain everything that's already queued on the socket before going back to select
+            size_t received;
+            do
             {
-                LOGE("Packet has null address. This shouldn't happen.");
-                continue;
-            }
-            if (packet.data->IsEmpty())
-            {
-                LOGE("Packet has zero length.");
-                continue;
-            }
-            //LOGV("Received %d bytes from %s:%d at %.5lf", len, packet.address->ToString().c_str(), packet.port, GetCurrentTime());
-            messageThread.Post(bind(&VoIPController::NetworkPacketReceived, this, std::make_shared<NetworkPacket>(move(packet))));
+                packets.clear();
+                received = socket->ReceiveBatch(packets, RECV_BATCH_SIZE);
+                for (NetworkPacket &packet : packets)
+                {
+                    if (packet.address.IsEmpty())
+                    {
+                        LOGE("Packet has null address. This shouldn't happen.");
+                        continue;
+                    }
+                    if (packet.data->IsEmpty())
+                    {
+                        LOGE("Packet has zero length.");
+                        continue;
+                    }
+                    //LOGV("Received %d bytes from %s:%d at %.5lf", len, packet.address->ToString().c_str(), packet.port, GetCurrentTime());
+                    if (!incomingPackets.Push(move(packet)))
+                    {
+                        LOGW("Incoming packet queue is full, dropping packet");
+                        continue;
+                    }
+                    anyPacketsQueued = true;
+                }
+            } while (received == RECV_BATCH_SIZE && runReceiver);
+        }
+        // One task drains everything that's queued, so only post it if there isn't one pending already
+        if (anyPacketsQueued && !incomingPacketsDrainPosted.exchange(true))
+        {
+            messageThread.Post(bind(&VoIPController::ProcessIncomingNetworkPackets, this), 0.0, 0.0, "ProcessIncomingNetworkPackets");
         }
 
         if (!writeSockets.empty())
         {
-            messageThread.Post(bind(&VoIPController::TrySendOutgoingPackets, this));
+            messageThread.Post(bind(&VoIPController::TrySendOutgoingPackets, this), 0.0, 0.0, "TrySendOutgoingPackets");
         }
     }
     LOGI("=== recv thread exiting ===");
@@ -125,84 +141,221 @@ void VoIPController::RunSendThread()
 {
     InitializeAudio();
     InitializeTimers();
-    messageThread.Post(bind(&VoIPController::SendInit, this));
+    messageThread.Post(bind(&VoIPController::SendInit, this), 0.0, 0.0, "SendInit");
 
-    while (true)
+    vector<NetworkPacket> udpPackets;
+    bool running = true;
+    while (running)
     {
-        RawPendingOutgoingPacket pkt = rawSendQueue.GetBlocking();
-        if (pkt.packet.IsEmpty())
-            break;
-
-        if (IS_MOBILE_NETWORK(networkType))
-            stats.bytesSentMobile += static_cast<uint64_t>(pkt.packet.data->Length());
+        RawPendingOutgoingPacket pkt{NetworkPacket::Empty(), nullptr};
+        // Sleep until either something new is queued or the pacer lets the next packet go
+        double wait = pacer.GetTimeUntilNextRelease(GetCurrentTime());
+        bool havePacket = true;
+        if (wait < 0)
+            rawSendQueue.PopBlocking(pkt);
+        else if (wait > 0)
+            havePacket = rawSendQueue.PopBlocking(pkt, wait);
         else
-            stats.bytesSentWifi += static_cast<uint64_t>(pkt.packet.data->Length());
-
-        if (pkt.packet.protocol == NetworkProtocol::TCP)
+            havePacket = rawSendQueue.TryPop(pkt);
+        // Move everything else that's already queued into the pacer so that UDP packets go out in as few syscalls as possible
+        while (havePacket)
         {
-            if (pkt.socket && !pkt.socket->IsFailed())
+            if (pkt.packet.IsEmpty())
             {
-                pkt.socket->Send(std::move(pkt.packet));
+                running = false;
+                break;
             }
+            pacer.Enqueue(std::move(pkt.packet), std::move(pkt.socket), pkt.streamId, pkt.seq, pkt.enqueueTime);
+            havePacket = rawSendQueue.TryPop(pkt);
         }
-        else
+
+        double now = GetCurrentTime();
+        pacer.Release(
+            now,
+            [&](NetworkPacket &&packet, std::shared_ptr<NetworkSocket> &&socket, uint8_t streamId, uint32_t seq) {
+                // Reported before the packet goes out so that the message thread can't see its ack first
+                ReportSentPacket(SentPacketReport{streamId, seq, static_cast<uint32_t>(packet.data->Length()), now, false});
+
+                if (IS_MOBILE_NETWORK(networkType))
+                    stats.bytesSentMobile += static_cast<uint64_t>(packet.data->Length());
+                else
+                    stats.bytesSentWifi += static_cast<uint64_t>(packet.data->Length());
+
+                if (packet.protocol == NetworkProtocol::TCP)
+                {
+                    if (socket && !socket->IsFailed())
+                    {
+                        socket->Send(std::move(packet));
+                    }
+                }
+                else
+                {
+                    udpPackets.push_back(std::move(packet));
+                }
+            },
+            [&](uint8_t streamId, uint32_t seq) {
+                ReportSentPacket(SentPacketReport{streamId, seq, 0, now, true});
+            });
+
+        if (!udpPackets.empty())
+            udpSocket->SendBatch(udpPackets);
+    }
+
+    LOGI("=== send thread exiting ===");
+}
+
+void VoIPController::ProcessIncomingNetworkPackets()
+{
+    ENFORCE_MSG_THREAD;
+
+    // Reset before draining so that packets pushed after this point get a new task
+    incomingPacketsDrainPosted = false;
+    // Acks in these packets may be for packets the send thread has only just reported
+    ProcessSentPacketReports();
+    NetworkPacket packet = NetworkPacket::Empty();
+    if (!cryptoPool)
+    {
+        while (incomingPackets.Pop(packet))
         {
-            udpSocket->Send(std::move(pkt.packet));
+            NetworkPacketReceived(packet);
         }
+        return;
     }
 
-    LOGI("=== send thread exiting ===");
+    while (true)
+    {
+        incomingBatch.clear();
+        while (incomingBatch.size() < incomingPackets.Capacity() && incomingPackets.Pop(packet))
+            incomingBatch.push_back(std::move(packet));
+        if (incomingBatch.empty())
+            break;
+        PreDecryptIncomingPackets();
+        // Workers are done by now, handle the packets in the order they arrived
+        for (size_t i = 0; i < incomingBatch.size(); i++)
+        {
+            currentPreDecrypted = &incomingBatchDecrypted[i];
+            NetworkPacketReceived(incomingBatch[i]);
+        }
+        currentPreDecrypted = nullptr;
+    }
 }
 
-void VoIPController::NetworkPacketReceived(shared_ptr<NetworkPacket> _packet)
+void VoIPController::ReportSentPacket(const SentPacketReport &report)
+{
+    if (sentPacketReports.Push(SentPacketReport(report)))
+    {
+        if (!sentPacketReportsDrainPosted.exchange(true))
+            messageThread.Post(bind(&VoIPController::ProcessSentPacketReports, this), 0.0, 0.0, "ProcessSentPacketReports");
+        return;
+    }
+    // The message thread is way behind, whatever is in the ring still goes first
+    messageThread.Post(
+        [this, report] {
+            ProcessSentPacketReports();
+            HandleSentPacketReport(report);
+        },
+        0.0, 0.0, "HandleSentPacketReport");
+}
+
+void VoIPController::ProcessSentPacketReports()
 {
     ENFORCE_MSG_THREAD;
 
-    NetworkPacket &packet = *_packet;
+    sentPacketReportsDrainPosted = false;
+    SentPacketReport report;
+    while (sentPacketReports.Pop(report))
+    {
+        HandleSentPacketReport(report);
+    }
+}
 
-    int64_t srcEndpointID = 0;
+void VoIPController::HandleSentPacketReport(const SentPacketReport &report)
+{
+    if (report.streamId >= outgoingStreams.size())
+        return;
+    RecentOutgoingPacket *recent = outgoingStreams[report.streamId]->packetManager.getRecentOutgoingPacket(report.seq);
+    if (report.dropped)
+    {
+        // Never made it to the network, so it can't be lost there either. Clearing the send time takes it out of the ring.
+        if (recent && recent->queued)
+            *recent = RecentOutgoingPacket();
+        return;
+    }
+    // Everything that measures delays has to count from when the packet left, not from how long it waited in the pacer
+    conctl.PacketSent(CongestionControlPacket(report.seq, report.streamId), report.size, report.sendTime);
+    // A resent packet keeps the send time of its first transmission
+    if (recent && recent->queued)
+    {
+        recent->sendTime = report.sendTime;
+        recent->queued = false;
+    }
+}
 
-    if (!packet.address.isIPv6)
+void VoIPController::PreDecryptIncomingPackets()
+{
+    size_t count = incomingBatch.size();
+    incomingBatchDecrypted.assign(count, PreDecryptedPacket());
+    // Waking the workers isn't worth it for the few packets a voice call gets at a time
+    if (count < cryptoPoolMinBatch || !CanPreDecryptPackets())
+        return;
+    incomingBatchSources.resize(count);
+    for (size_t i = 0; i < count; i++)
+        incomingBatchSources[i] = FindPacketSource(incomingBatch[i]);
+    cryptoPool->Run(count, [this](size_t i) {
+        if (incomingBatchSources[i])
+            PreDecryptPacket(incomingBatch[i], *incomingBatchSources[i], incomingBatchDecrypted[i]);
+    });
+}
+
+bool VoIPController::CanPreDecryptPackets()
+{
+    // Until the call is established decryption may switch to MTProto2 halfway through a batch
+    return state == STATE_ESTABLISHED && useMTProto2;
+}
+
+Endpoint *VoIPController::FindPacketSource(const NetworkPacket &packet)
+{
+    for (pair<const int64_t, Endpoint> &_e : endpoints)
     {
-        for (pair<const int64_t, Endpoint> &_e : endpoints)
+        Endpoint &e = _e.second;
+        if (!packet.address.isIPv6)
         {
-            const Endpoint &e = _e.second;
             if (e.address == packet.address && e.port == packet.port && CHECK_ENDPOINT_PROTOCOL(e.type, packet.protocol))
-            {
-                srcEndpointID = e.id;
-                break;
-            }
+                return &e;
         }
-        if (!srcEndpointID && packet.protocol == NetworkProtocol::UDP)
+        else if (e.v6address == packet.address && e.port == packet.port && e.IsIPv6Only())
         {
-            try
-            {
-                Endpoint &p2p = GetEndpointByType(Endpoint::Type::UDP_P2P_INET);
-                if (p2p.rtts[0] == 0.0 && p2p.address.PrefixMatches(24, packet.address))
-                {
-                    LOGD("Packet source matches p2p endpoint partially: %s:%u", packet.address.ToString().c_str(), packet.port);
-                    srcEndpointID = p2p.id;
-                }
-            }
-            catch (out_of_range &ex)
-            {
-            }
+            if ((e.type != Endpoint::Type::TCP_RELAY && packet.protocol == NetworkProtocol::UDP) || (e.type == Endpoint::Type::TCP_RELAY && packet.protocol == NetworkProtocol::TCP))
+                return &e;
         }
     }
-    else
+    return nullptr;
+}
+
+void VoIPController::NetworkPacketReceived(NetworkPacket &packet)
+{
+    ENFORCE_MSG_THREAD;
+
+    int64_t srcEndpointID = 0;
+
+    if (Endpoint *src = FindPacketSource(packet))
     {
-        for (pair<const int64_t, Endpoint> &_e : endpoints)
+        srcEndpointID = src->id;
+    }
+    else if (!packet.address.isIPv6 && packet.protocol == NetworkProtocol::UDP)
+    {
+        try
         {
-            const Endpoint &e = _e.second;
-            if (e.v6address == packet.address && e.port == packet.port && e.IsIPv6Only())
+            Endpoint &p2p = GetEndpointByType(Endpoint::Type::UDP_P2P_INET);
+            if (p2p.rtts[0] == 0.0 && p2p.address.PrefixMatches(24, packet.address))
             {
-                if ((e.type != Endpoint::Type::TCP_RELAY && packet.protocol == NetworkProtocol::UDP) || (e.type == Endpoint::Type::TCP_RELAY && packet.protocol == NetworkProtocol::TCP))
-                {
-                    srcEndpointID = e.id;
-                    break;
-                }
+                LOGD("Packet source matches p2p endpoint partially: %s:%u", packet.address.ToString().c_str(), packet.port);
+                srcEndpointID = p2p.id;
             }
         }
+        catch (out_of_range &ex)
+        {
+        }
     }
 
     if (!srcEndpointID)
@@ -8,24 +8,48 @@ using namespace tgvoip;
 //std::mt19937 rng(dev());
 //std::uniform_int_distribution<std::mt19937::result_type> dist6(0, 9); // distribution in range [1, 6]
 
+SendBuffer VoIPController::GetSendBuffer(const Endpoint &ep, size_t payloadLength)
+{
+    // msg_key and the inner length, plus the key fingerprint in the long format and the peer tag or call ID
+    bool shortFormat = useMTProto2 && !ver.isLegacyLegacy();
+    size_t headroom = 16 + (shortFormat ? 2 : 4 + 8);
+    if (ep.IsReflector() || ver.peerVersion < 9)
+        headroom += 16;
+
+    std::shared_ptr<Buffer> buf;
+    size_t size = headroom + payloadLength + SEND_BUFFER_TAILROOM;
+    if (size <= SEND_BUFFER_SIZE)
+        buf = outgoingPacketPool.Get(SEND_BUFFER_SIZE);
+    if (!buf)
+        buf = std::make_shared<Buffer>(std::max(size, (size_t)SEND_BUFFER_SIZE));
+    return SendBuffer(std::move(buf), headroom);
+}
+
 PendingOutgoingPacket VoIPController::PreparePacket(unsigned char *data, size_t len, Endpoint &ep, CongestionControlPacket &&pkt)
+{
+    SendBuffer buf = GetSendBuffer(ep, len);
+    if (len > 0)
+        memcpy(buf.Put(len), data, len);
+    return PreparePacket(std::move(buf), ep, std::move(pkt));
+}
+
+PendingOutgoingPacket VoIPController::PreparePacket(SendBuffer &&buf, Endpoint &ep, CongestionControlPacket &&pkt)
 {
 #ifdef LOG_PACKETS
-    LOGV("Preparing packet of length=%u, seq=%u, streamId=%hhu", (unsigned int)len, pkt.seq, pkt.streamId);
+    LOGV("Preparing packet of length=%u, seq=%u, streamId=%hhu", (unsigned int)buf.Length(), pkt.seq, pkt.streamId);
 #endif
 
-    BufferOutputStream out(len + 128);
-    if (ep.IsReflector())
-        out.WriteBytes((unsigned char *)ep.peerTag, 16);
-    else if (ver.peerVersion < 9)
-        out.WriteBytes(callID, 16);
-
-    if (len > 0)
+    if (buf.Length() > 0)
     {
-        encryptPacket(data, len, out);
+        encryptPacket(buf);
     }
 
-    return PendingOutgoingPacket(std::make_shared<Buffer>(std::move(out)), std::move(pkt), ep.id);
+    if (ep.IsReflector())
+        memcpy(buf.Push(16), ep.peerTag, 16);
+    else if (ver.peerVersion < 9)
+        memcpy(buf.Push(16), callID, 16);
+
+    return PendingOutgoingPacket(buf.Finish(), std::move(pkt), ep.id);
 }
 void VoIPController::SendPacket(OutgoingPacket &&pkt, double retryInterval, double timeout, uint8_t tries)
 {
@@ -38,15 +62,33 @@ void VoIPController::SendPacket(OutgoingPacket &&pkt, double retryInterval, doub
     if (ver.isNew())
     {
         packet.prepare(pm, currentExtras, endpoint.id);
+        if (peerSupportsSelectiveAck && pm.shouldSendSelectiveAck())
+        {
+            auto sack = std::make_shared<ExtraSelectiveAck>();
+            pm.getRemoteSelectiveAck(*sack);
+            packet.extraSignaling.v.push_back(Wrapped<Extra>(std::move(sack)));
+        }
 #ifdef LOG_PACKETS
         LOGW("Sending outgoing packet: %s", packet.print().c_str());
 #endif
 
-        //BufferOutputStream out(packet.getSize()); // Can precalc, should check if it's worth it
-        BufferOutputStream out(1500);
-        packet.serialize(out, ver);
+        // Serialize straight into the buffer the packet will be sent from
+        SendBuffer buf = GetSendBuffer(endpoint);
+        try
+        {
+            BufferOutputStream out(buf.Data() + buf.Length(), buf.Tailroom() - SEND_BUFFER_TAILROOM);
+            packet.serialize(out, ver);
+            buf.Put(out.GetLength());
+        }
+        catch (std::out_of_range &)
+        {
+            BufferOutputStream out(SEND_BUFFER_SIZE * 2);
+            packet.serialize(out, ver);
+            buf = GetSendBuffer(endpoint, out.GetLength());
+            memcpy(buf.Put(out.GetLength()), out.GetBuffer(), out.GetLength());
+        }
 
-        auto res = PreparePacket(out.GetBuffer(), out.GetLength(), endpoint, CongestionControlPacket(packet));
+        auto res = PreparePacket(std::move(buf), endpoint, CongestionControlPacket(packet));
         if (isReliable)
         {
             SendPacketReliably(res, retryInterval, timeout, tries);
@@ -131,19 +173,34 @@ void VoIPController::SendOrEnqueuePacket(PendingOutgoingPacket &pkt, bool enqueu
         if (endpoint.type == Endpoint::Type::TCP_RELAY && !useTCP)
             return;
 
-        conctl.PacketSent(pkt.pktInfo, pkt.packet->Length());
-
-        rawSendQueue.Put(
+        // Congestion control only hears about the packet once the pacer has let it go, see HandleSentPacketReport
+        bool evictedStop = false;
+        rawSendQueue.Push(
             RawPendingOutgoingPacket{
                 NetworkPacket{
                     pkt.packet,
                     endpoint.GetAddress(),
                     endpoint.port,
                     endpoint.type == Endpoint::Type::TCP_RELAY ? NetworkProtocol::TCP : NetworkProtocol::UDP},
-                endpoint.type == Endpoint::Type::TCP_RELAY ? endpoint.socket : nullptr});
+                endpoint.type == Endpoint::Type::TCP_RELAY ? endpoint.socket : nullptr,
+                pkt.pktInfo.streamId,
+                pkt.pktInfo.seq,
+                GetCurrentTime()},
+            [&](RawPendingOutgoingPacket &&evicted) {
+                // The send thread is too far behind, the oldest packet never reaches the pacer
+                if (evicted.packet.IsEmpty())
+                    evictedStop = true;
+                else
+                    HandleSentPacketReport(SentPacketReport{evicted.streamId, evicted.seq, 0, 0, true});
+            });
+        // Stop() raced us, the send thread still has to see the sentinel to exit
+        if (evictedStop)
+            rawSendQueue.Push(RawPendingOutgoingPacket{NetworkPacket::Empty(), nullptr});
 
         unacknowledgedIncomingPacketCount = 0;
-        outgoingStreams[pkt.pktInfo.streamId]->packetManager.addRecentOutgoingPacket(pkt);
+        RecentOutgoingPacket recent(pkt, GetCurrentTime());
+        recent.queued = true;
+        outgoingStreams[pkt.pktInfo.streamId]->packetManager.addRecentOutgoingPacket(std::move(recent));
 
         //LOGV("Sending: to=%s:%u, seq=%u, length=%u, streamId=%hhu", endpoint.GetAddress().ToString().c_str(), endpoint.port, pkt.pktInfo.seq, (unsigned int)pkt.packet->Length(), pkt.pktInfo.streamId);
 
@@ -172,6 +229,8 @@ void VoIPController::SendInit()
         init->flags |= ExtraInit::Flags::VideoSendSupported;
     if (dataSavingMode)
         init->flags |= ExtraInit::Flags::DataSavingEnabled;
+    if (useSelectiveAck)
+        init->flags |= ExtraInit::Flags::SelectiveAckSupported;
 
     init->audioCodecs.v.push_back(Codec::Opus);
     if (config.enableVideoReceive)
@@ -227,7 +286,7 @@ void VoIPController::InitUDPProxy()
     if (proxyHostPort == lastTestedProxyServer && !proxySupportsUDP)
     {
         LOGI("Proxy does not support UDP - using UDP directly instead");
-        messageThread.Post(bind(&VoIPController::ResetUdpAvailability, this));
+        messageThread.Post(bind(&VoIPController::ResetUdpAvailability, this), 0.0, 0.0, "ResetUdpAvailability");
         return;
     }
 
@@ -276,7 +335,7 @@ void VoIPController::InitUDPProxy()
     {
         udpSocket = udpProxy;
     }
-    messageThread.Post(bind(&VoIPController::ResetUdpAvailability, this));
+    messageThread.Post(bind(&VoIPController::ResetUdpAvailability, this), 0.0, 0.0, "ResetUdpAvailability");
 }
 
 void VoIPController::TrySendOutgoingPackets()
@@ -531,7 +590,7 @@ void VoIPController::ResetUdpAvailability()
     }
     udpPingCount = 0;
     udpConnectivityState = UDP_PING_PENDING;
-    udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.0, 0.5);
+    udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.0, 0.5, "SendUdpPings");
 }
 
 void VoIPController::ResetEndpointPingStats()
@@ -15,6 +15,8 @@ void VoIPController::ProcessIncomingPacket(NetworkPacket &npacket, Endpoint &src
 {
     ENFORCE_MSG_THREAD;
 
+    currentPacketRecvTime = npacket.recvTime > 0 ? npacket.recvTime : GetCurrentTime();
+
     // Initial packet decryption and recognition
 
     unsigned char *buffer = **npacket.data;
@@ -44,13 +46,29 @@ void VoIPController::ProcessIncomingPacket(NetworkPacket &npacket, Endpoint &src
         return;
     }
 
-    size_t innerLen = decryptPacket(buffer, in);
+    size_t innerLen;
+    if (currentPreDecrypted && currentPreDecrypted->attempted)
+    {
+        // The crypto worker pool has already decrypted this one in place
+        if (currentPreDecrypted->offset != in.GetOffset())
+        {
+            LOGW("Source endpoint of a decrypted packet has changed, dropping it");
+            return;
+        }
+        innerLen = currentPreDecrypted->innerLen;
+        if (innerLen)
+            in = BufferInputStream(currentPreDecrypted->inner, innerLen);
+    }
+    else
+    {
+        innerLen = decryptPacket(buffer, in);
+    }
     if (!innerLen) // Decryption failed
     {
         return;
     }
 
-    lastRecvPacketTime = GetCurrentTime();
+    lastRecvPacketTime = currentPacketRecvTime;
 
     if (state == STATE_RECONNECTING)
     {
@@ -125,9 +143,18 @@ void VoIPController::ProcessIncomingPacket(Packet &packet, Endpoint &srcEndpoint
     {
         return;
     }
+    if (!packet.legacy && packet.seq == manager.getLastRemoteSeq())
+        manager.setLastRemoteSeqRecvTS((uint32_t)(uint64_t)(currentPacketRecvTime * 1000000.0));
 
+    const ExtraSelectiveAck *sack = nullptr;
     for (auto &extra : packet.extraSignaling)
     {
+        // Describes the same stream as the acks in the header and is handled along with them
+        if (extra.getID() == ExtraSelectiveAck::ID)
+        {
+            sack = &extra.get<ExtraSelectiveAck>();
+            continue;
+        }
         ProcessExtraData(extra, srcEndpoint);
     }
 
@@ -146,31 +173,32 @@ void VoIPController::ProcessIncomingPacket(Packet &packet, Endpoint &srcEndpoint
                 1.0);
             LOGI("resuming sending");
         }
-        conctl.PacketAcknowledged(CongestionControlPacket(packet));
-        manager.ackLocal(packet.ackSeq, packet.ackMask);
+        conctl.PacketAcknowledged(CongestionControlPacket(packet), currentPacketRecvTime);
+        newlyAckedSeqs.clear();
+        manager.ackLocal(packet.ackSeq, packet.ackMask, newlyAckedSeqs);
 
-        for (auto &opkt : manager.getRecentOutgoingPackets())
+        // The peer tells us when the packet it acks reached it, which is all the delay gradient needs
+        if (useDelayBasedBitrate && !packet.legacy && packet.recvTS)
         {
-            if (!opkt.ackTime && manager.wasLocalAcked(opkt.pkt.seq))
+            if (RecentOutgoingPacket *acked = manager.getRecentOutgoingPacket(packet.ackSeq))
             {
-                opkt.ackTime = GetCurrentTime();
-                opkt.rttTime = opkt.ackTime - opkt.sendTime;
-                if (opkt.lost)
-                {
-                    LOGW("acknowledged lost packet %u (streamId %hhu)", opkt.pkt.seq, packet.streamId);
-                    sendLosses--;
-                }
-                else // Don't report lost packets as acked?
-                {
-                    sender->PacketAcknowledged(opkt);
-                }
-
-                conctl.PacketAcknowledged(opkt.pkt);
+                delayEstimator.PacketAcknowledged(acked->sendTime, packet.recvTS, currentPacketRecvTime);
+                UpdateDelayBasedBitrate();
             }
         }
 
-        HandleReliablePackets(manager);
+        for (uint32_t seq : newlyAckedSeqs)
+        {
+            RecentOutgoingPacket *recent = manager.getRecentOutgoingPacket(seq);
+            if (recent && !recent->ackTime)
+                HandleAckedPacket(manager, *recent, *sender);
+        }
+
+        HandleReliablePackets(manager, newlyAckedSeqs);
+        DetectLostPackets();
     }
+    if (sack)
+        HandleSelectiveAck(manager, *sack);
 
     Endpoint &_currentEndpoint = endpoints.at(currentEndpoint);
     if (srcEndpoint.id != currentEndpoint && srcEndpoint.IsReflector() && (_currentEndpoint.IsP2P() || _currentEndpoint.averageRTT == 0))
@@ -250,14 +278,14 @@ void VoIPController::ProcessIncomingPacket(Packet &packet, Endpoint &srcEndpoint
             uint32_t seq = packet.seq - 1; // Account for seq starting at 1
             if (stm->jitterBuffer)
             {
-                stm->jitterBuffer->HandleInput(std::move(packet.data), seq, false);
+                stm->jitterBuffer->HandleInput(std::move(packet.data), seq, false, currentPacketRecvTime);
                 if (packet.extraEC)
                 {
                     for (uint8_t i = 0; i < 8; i++)
                     {
                         if (packet.extraEC.v[i])
                         {
-                            stm->jitterBuffer->HandleInput(std::move(packet.extraEC.v[i].get<OutputBytes>().data), seq - (8 - i), true);
+                            stm->jitterBuffer->HandleInput(std::move(packet.extraEC.v[i].get<OutputBytes>().data), seq - (8 - i), true, currentPacketRecvTime);
                         }
                     }
                 }
@@ -304,6 +332,46 @@ void VoIPController::ProcessIncomingPacket(Packet &packet, Endpoint &srcEndpoint
     }
 }
 
+void VoIPController::HandleAckedPacket(PacketManager &pm, RecentOutgoingPacket &opkt, PacketSender &sender)
+{
+    opkt.ackTime = currentPacketRecvTime;
+    opkt.rttTime = opkt.ackTime - opkt.sendTime;
+    pm.lossDetector.PacketAcknowledged(opkt.sendTime, opkt.ackTime, opkt.lost);
+    if (opkt.lost)
+    {
+        LOGW("acknowledged lost packet %u (streamId %hhu)", opkt.pkt.seq, opkt.pkt.streamId);
+        sendLosses--;
+        // A selective ack can get here long after the loss was confirmed, it mustn't keep counting towards the loss rate
+        if (opkt.lossConfirmed)
+        {
+            opkt.lossConfirmed = false;
+            confirmedSendLosses--;
+        }
+    }
+    else // Don't report lost packets as acked?
+    {
+        sender.PacketAcknowledged(opkt);
+    }
+
+    conctl.PacketAcknowledged(opkt.pkt, currentPacketRecvTime);
+}
+
+void VoIPController::HandleSelectiveAck(PacketManager &pm, const ExtraSelectiveAck &sack)
+{
+    newlyAckedSeqs.clear();
+    pm.ackLocalSelective(sack, newlyAckedSeqs);
+    if (newlyAckedSeqs.empty())
+        return;
+    PacketSender &sender = *outgoingStreams[pm.transportId]->packetSender;
+    for (uint32_t seq : newlyAckedSeqs)
+    {
+        RecentOutgoingPacket *recent = pm.getRecentOutgoingPacket(seq);
+        if (recent && !recent->ackTime)
+            HandleAckedPacket(pm, *recent, sender);
+    }
+    HandleReliablePackets(pm, newlyAckedSeqs);
+}
+
 void VoIPController::ProcessExtraData(const Wrapped<Extra> &_data, Endpoint &srcEndpoint)
 {
     auto type = _data.getID();
@@ -354,6 +422,11 @@ void VoIPController::ProcessExtraData(const Wrapped<Extra> &_data, Endpoint &src
             {
                 peerCapabilities |= TGVOIP_PEER_CAP_VIDEO_CAPTURE;
             }
+            if (data.flags & ExtraInit::Flags::SelectiveAckSupported && useSelectiveAck)
+            {
+                LOGI("Peer supports selective acks");
+                peerSupportsSelectiveAck = true;
+            }
         }
 
         if (!receivedInit && ((data.flags & ExtraInit::Flags::VideoSendSupported && config.enableVideoReceive) || (data.flags & ExtraInit::Flags::VideoRecvSupported && config.enableVideoSend)))
@@ -662,7 +735,7 @@ void VoIPController::ProcessExtraData(const Wrapped<Extra> &_data, Endpoint &src
 #endif
             if (data.seq == srcEndpoint.lastPingSeq)
             {
-                srcEndpoint.rtts.Add(GetCurrentTime() - srcEndpoint.lastPingTime);
+                srcEndpoint.rtts.Add(currentPacketRecvTime - srcEndpoint.lastPingTime);
                 srcEndpoint.averageRTT = srcEndpoint.rtts.NonZeroAverage();
                 LOGD("Current RTT via %s: %.3f, average: %.3f", srcEndpoint.address.ToString().c_str(), srcEndpoint.rtts[0], srcEndpoint.averageRTT);
                 if (srcEndpoint.averageRTT > rateMaxAcceptableRTT)
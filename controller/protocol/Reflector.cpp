@@ -34,7 +34,7 @@ bool VoIPController::parseRelayPacket(const BufferInputStream &in, Endpoint &src
             {
                 double sendTime = srcEndpoint.udpPingTimes[queryID];
                 srcEndpoint.udpPingTimes.erase(queryID);
-                srcEndpoint.selfRtts.Add(selfRTT = GetCurrentTime() - sendTime);
+                srcEndpoint.selfRtts.Add(selfRTT = currentPacketRecvTime - sendTime);
             }
             LOGV("Received UDP ping reply from %s:%d: date=%d, queryID=%ld, my IP=%s, my port=%d, selfRTT=%f", srcEndpoint.address.ToString().c_str(), srcEndpoint.port, date, (long int)queryID, NetworkAddress::IPv4(*reinterpret_cast<uint32_t *>(myIP + 12)).ToString().c_str(), myPort, selfRTT);
             if (srcEndpoint.IsIPv6Only() && !didSendIPv6Endpoint)
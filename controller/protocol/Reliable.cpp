@@ -8,68 +8,120 @@ void VoIPController::SendPacketReliably(PendingOutgoingPacket &pkt, double retry
 #ifdef LOG_PACKETS
     LOGV("Send reliably, seqNo=%hhu, streamId=%u, len=%u, retry=%.3f, timeout=%.3f, tries=%hhu", pkt.pktInfo.seq, pkt.pktInfo.streamId, unsigned(pkt.packet->Length()), retryInterval, timeout, tries);
 #endif
-    reliablePackets.push_back(ReliableOutgoingPacket{std::move(pkt),
-                                                     retryInterval,
-                                                     timeout,
-                                                     tries});
-    messageThread.Post(std::bind(&VoIPController::UpdateReliablePackets, this));
-    if (timeout > 0.0)
+    uint64_t key = ReliableOutgoingPacket::Key(pkt.pktInfo.streamId, pkt.pktInfo.seq);
+    double now = GetCurrentTime();
+    reliablePackets.erase(key);
+    reliablePackets.emplace(key, ReliableOutgoingPacket{std::move(pkt),
+                                                        retryInterval,
+                                                        timeout,
+                                                        tries,
+                                                        0,
+                                                        0,
+                                                        now});
+    reliablePacketDeadlines.push(ReliablePacketDeadline{now, key});
+    ArmReliablePacketsTimer();
+}
+
+void VoIPController::ArmReliablePacketsTimer()
+{
+    while (!reliablePacketDeadlines.empty())
+    {
+        const ReliablePacketDeadline &next = reliablePacketDeadlines.top();
+        auto qp = reliablePackets.find(next.key);
+        if (qp != reliablePackets.end() && qp->second.deadline == next.deadline)
+            break;
+        reliablePacketDeadlines.pop();
+    }
+    if (reliablePacketDeadlines.empty())
+    {
+        if (reliablePacketsTimerID != MessageThread::INVALID_ID)
+        {
+            messageThread.Cancel(reliablePacketsTimerID);
+            reliablePacketsTimerID = MessageThread::INVALID_ID;
+        }
+        return;
+    }
+
+    double deadline = reliablePacketDeadlines.top().deadline;
+    if (reliablePacketsTimerID != MessageThread::INVALID_ID)
     {
-        messageThread.Post(std::bind(&VoIPController::UpdateReliablePackets, this), timeout);
+        // A timer that fires too early just finds nothing to do and re-arms itself
+        if (reliablePacketsTimerDeadline <= deadline)
+            return;
+        messageThread.Cancel(reliablePacketsTimerID);
     }
+    reliablePacketsTimerDeadline = deadline;
+    reliablePacketsTimerID = messageThread.Post(std::bind(&VoIPController::UpdateReliablePackets, this), std::max(deadline - GetCurrentTime(), 0.0), 0.0, "UpdateReliablePackets");
 }
 
 void VoIPController::UpdateReliablePackets()
 {
+    reliablePacketsTimerID = MessageThread::INVALID_ID;
+    double now = GetCurrentTime();
     vector<PendingOutgoingPacket> packetsToSend;
-    for (auto qp = reliablePackets.begin(); qp != reliablePackets.end();)
+    vector<ReliablePacketDeadline> rescheduled;
+    while (!reliablePacketDeadlines.empty() && reliablePacketDeadlines.top().deadline <= now)
     {
-        if (qp->timeout > 0 && qp->firstSentTime > 0 && GetCurrentTime() - qp->firstSentTime >= qp->timeout)
+        ReliablePacketDeadline due = reliablePacketDeadlines.top();
+        reliablePacketDeadlines.pop();
+        auto it = reliablePackets.find(due.key);
+        if (it == reliablePackets.end() || it->second.deadline != due.deadline)
+            continue;
+
+        ReliableOutgoingPacket &qp = it->second;
+        if (qp.timeout > 0 && qp.firstSentTime > 0 && now - qp.firstSentTime >= qp.timeout)
         {
 #ifdef LOG_PACKETS
             LOGD("Removing reliable queued packet because of timeout");
 #endif
-            qp = reliablePackets.erase(qp);
+            reliablePackets.erase(it);
             continue;
         }
-        if (!qp->tries--)
+        if (!qp.tries--)
         {
 #ifdef LOG_PACKETS
             LOGD("Removing reliable queued packet because of no more tries");
 #endif
-            qp = reliablePackets.erase(qp);
+            reliablePackets.erase(it);
             continue;
         }
-        if (GetCurrentTime() - qp->lastSentTime >= qp->retryInterval)
-        {
-            messageThread.Post(std::bind(&VoIPController::UpdateReliablePackets, this), qp->retryInterval);
-            qp->lastSentTime = GetCurrentTime();
+        qp.lastSentTime = now;
 #ifdef LOG_PACKETS
-            LOGD("Sending reliable queued packet, seq=%u, len=%lu", qp->pkt.pktInfo.seq, qp->pkt.packet->Length());
+        LOGD("Sending reliable queued packet, seq=%u, len=%lu", qp.pkt.pktInfo.seq, qp.pkt.packet->Length());
 #endif
-            if (qp->firstSentTime == 0)
-                qp->firstSentTime = qp->lastSentTime;
+        if (qp.firstSentTime == 0)
+            qp.firstSentTime = now;
+        packetsToSend.push_back(qp.pkt);
 
-            packetsToSend.push_back(qp->pkt);
-        }
-        ++qp;
+        qp.deadline = now + qp.retryInterval;
+        if (qp.timeout > 0)
+            qp.deadline = std::min(qp.deadline, qp.firstSentTime + qp.timeout);
+        // Pushed after the loop so that a zero retry interval can't keep it spinning
+        rescheduled.push_back(ReliablePacketDeadline{qp.deadline, due.key});
+    }
+    for (const ReliablePacketDeadline &d : rescheduled)
+    {
+        reliablePacketDeadlines.push(d);
     }
     for (auto &pkt : packetsToSend)
     {
         SendOrEnqueuePacket(pkt);
     }
+    ArmReliablePacketsTimer();
 }
-void VoIPController::HandleReliablePackets(const PacketManager &pm)
+void VoIPController::HandleReliablePackets(const PacketManager &pm, const std::vector<uint32_t> &newlyAcked)
 {
-    for (auto it = reliablePackets.begin(); it != reliablePackets.end();)
+    if (!reliablePackets.empty())
     {
-        if (pm.wasLocalAcked(it->pkt.pktInfo.seq))
+        for (uint32_t seq : newlyAcked)
         {
-            LOGV("Acked queued packet with %hhu tries left", it->tries);
-            it = reliablePackets.erase(it);
-            continue;
+            auto it = reliablePackets.find(ReliableOutgoingPacket::Key(pm.transportId, seq));
+            if (it != reliablePackets.end())
+            {
+                LOGV("Acked queued packet with %hhu tries left", it->second.tries);
+                reliablePackets.erase(it);
+            }
         }
-        ++it;
     }
 
     for (auto it = currentExtras.begin(); it != currentExtras.end();)
@@ -18,11 +18,11 @@ void VoIPController::SetState(int state)
         if (!wasEstablished)
         {
             wasEstablished = true;
-            messageThread.Post(std::bind(&VoIPController::UpdateRTT, this), 0.1, 0.5);
-            messageThread.Post(std::bind(&VoIPController::UpdateAudioBitrate, this), 0.0, 0.3);
-            messageThread.Post(std::bind(&VoIPController::UpdateCongestion, this), 0.0, 1.0);
-            messageThread.Post(std::bind(&VoIPController::UpdateSignalBars, this), 1.0, 1.0);
-            messageThread.Post(std::bind(&VoIPController::TickJitterBufferAndCongestionControl, this), 0.0, 0.1);
+            messageThread.Post(std::bind(&VoIPController::UpdateRTT, this), 0.1, 0.5, "UpdateRTT");
+            messageThread.Post(std::bind(&VoIPController::UpdateAudioBitrate, this), 0.0, 0.3, "UpdateAudioBitrate");
+            messageThread.Post(std::bind(&VoIPController::UpdateCongestion, this), 0.0, 1.0, "UpdateCongestion");
+            messageThread.Post(std::bind(&VoIPController::UpdateSignalBars, this), 1.0, 1.0, "UpdateSignalBars");
+            messageThread.Post(std::bind(&VoIPController::TickJitterBufferAndCongestionControl, this), 0.0, 0.1, "TickJitterBufferAndCongestionControl");
         }
     }
 }
@@ -47,7 +47,7 @@ void VoIPController::SendUdpPings()
     if (udpPingCount == 4 || udpPingCount == 10)
     {
         messageThread.CancelSelf();
-        udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::EvaluateUdpPingResults, this), 1.0);
+        udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::EvaluateUdpPingResults, this), 1.0, 0.0, "EvaluateUdpPingResults");
     }
 }
 
@@ -106,7 +106,7 @@ void VoIPController::EvaluateUdpPingResults()
             useTCP = true;
             setCurrentEndpointToTCP = true;
             AddTCPRelays();
-            udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.5, 0.5);
+            udpPingTimeoutID = messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.5, 0.5, "SendUdpPings");
         }
         else
         {
@@ -133,27 +133,42 @@ void VoIPController::TickJitterBufferAndCongestionControl()
         }
     }
     conctl.Tick();
+    DetectLostPackets();
+}
 
-    //MutexGuard m(queuedPacketsMutex);
+void VoIPController::DetectLostPackets()
+{
     double currentTime = GetCurrentTime();
-    double rtt = GetAverageRTT();
-    double packetLossTimeout = std::max(rtt * 2.0, 0.1);
     for (auto &stm : outgoingStreams)
     {
-        for (RecentOutgoingPacket &pkt : stm->packetManager.getRecentOutgoingPackets())
-        {
-            if (pkt.ackTime || pkt.lost)
-                continue;
-            if (currentTime - pkt.sendTime > packetLossTimeout)
+        PacketManager &pm = stm->packetManager;
+        pm.forEachRecentOutgoingPacket([&](RecentOutgoingPacket &pkt) {
+            // Nothing to time out while it's still waiting in the pacer
+            if (pkt.ackTime || pkt.queued)
+                return;
+            if (pkt.lost)
+            {
+                // Acks only reach 32 seqs back, anything older that's still missing really didn't make it.
+                // A selective ack can still ack it later, so wait for one to report it missing unless they stopped coming.
+                if (!pkt.lossConfirmed && seqgt(pm.getLastAckedSeq() - 32, pkt.pkt.seq) &&
+                    (!peerSupportsSelectiveAck || pm.wasCoveredBySelectiveAck(pkt.pkt.seq) || seqgt(pm.getLastAckedSeq() - MAX_RECENT_PACKETS / 2, pkt.pkt.seq)))
+                {
+                    pkt.lossConfirmed = true;
+                    confirmedSendLosses++;
+                }
+                return;
+            }
+            if (pm.lossDetector.IsLost(pkt.sendTime, currentTime))
             {
                 pkt.lost = true;
                 sendLosses++;
-                LOGW("Outgoing packet lost: seq=%u, streamId=%hhu, size=%u", pkt.pkt.seq, pkt.pkt.streamId, (unsigned int)pkt.size);
+                pm.lossDetector.PacketLost();
+                LOGW("Outgoing packet lost: seq=%u, streamId=%hhu, size=%u, reorder window=%.3f", pkt.pkt.seq, pkt.pkt.streamId, (unsigned int)pkt.size, pm.lossDetector.GetReorderWindow());
 
                 conctl.PacketLost(pkt.pkt);
                 stm->packetSender->PacketLost(pkt);
             }
-        }
+        });
     }
 }
 
@@ -189,8 +204,9 @@ void VoIPController::UpdateCongestion()
 {
     if (encoder)
     {
-        uint32_t sendLossCount = conctl.GetSendLossCount();
-        sendLossCountHistory.Add(sendLossCount - prevSendLossCount);
+        uint32_t sendLossCount = confirmedSendLosses;
+        // Confirmed losses that were acked after all are taken back, which can leave the count below the last one
+        sendLossCountHistory.Add(sendLossCount > prevSendLossCount ? sendLossCount - prevSendLossCount : 0);
         prevSendLossCount = sendLossCount;
 
         uint32_t lastSentSeq = getBestPacketManager().getLastSentSeq();
@@ -288,11 +304,20 @@ void VoIPController::UpdateAudioBitrate()
             multiple *= resendCount;
         }
 
+        // Once the delay estimator has a target it owns the increases, loss and inflight can still push it down
+        bool delayBased = useDelayBasedBitrate && delayEstimator.HasEstimate();
         auto act = conctl.GetBandwidthControlAction(sender->getShittyInternetMode(), multiple);
         if (act == CongestionControl::Min)
         {
             //encoder->SetBitrate(8000);
         }
+        else if (act == CongestionControl::Decrease && delayBased)
+        {
+            LOGE("=============== DECREASING BITRATE ===============");
+            uint32_t target = delayEstimator.GetTargetBitrate();
+            delayEstimator.SetTargetBitrate(target - std::min(target, audioBitrateStepDecr));
+            UpdateDelayBasedBitrate();
+        }
         else if (act == CongestionControl::Decrease)
         {
             LOGE("=============== DECREASING BITRATE ===============");
@@ -300,7 +325,7 @@ void VoIPController::UpdateAudioBitrate()
             if (bitrate > 8000)
                 encoder->SetBitrate(bitrate < (minAudioBitrate + audioBitrateStepDecr) ? minAudioBitrate : (bitrate - audioBitrateStepDecr));
         }
-        else if (act == CongestionControl::Increase)
+        else if (act == CongestionControl::Increase && !delayBased)
         {
             LOGE("=============== INCREASING BITRATE ===============");
             uint32_t bitrate = encoder->GetBitrate();
@@ -308,6 +333,7 @@ void VoIPController::UpdateAudioBitrate()
                 encoder->SetBitrate(bitrate + audioBitrateStepIncr);
         }
         LOGE("========= CURRENT BITRATE=%u =========", encoder->GetBitrate())
+        UpdatePacingRate();
 
         if (state == STATE_ESTABLISHED && time - lastRecvPacketTime >= reconnectingTimeout)
         {
@@ -2,34 +2,85 @@
 #include "PacketStructs.h"
 #include "../../../tools/logging.h"
 #include "../../../VoIPController.h"
+#include <algorithm>
 
 using namespace tgvoip;
 
+// Remote seqs that have to come in before another selective ack is attached, short enough for every seq
+// that falls out of the ack mask to be reported a few times over before it falls out of the history too
+#define SELECTIVE_ACK_INTERVAL 16
+#define MAX_SELECTIVE_ACK_RANGES 16
 
 PacketManager::PacketManager(uint8_t transportId) : transportId(transportId)
 {
-    recentOutgoingPackets.reserve(MAX_RECENT_PACKETS);
+    static_assert((MAX_RECENT_PACKETS & (MAX_RECENT_PACKETS - 1)) == 0, "MAX_RECENT_PACKETS must be a power of two");
+    recentOutgoingPackets.resize(MAX_RECENT_PACKETS);
 }
 
-void PacketManager::ackLocal(uint32_t ackId, uint32_t mask)
+void PacketManager::ackLocal(uint32_t ackId, uint32_t mask, std::vector<uint32_t> &newlyAcked)
 {
+    for (uint32_t distance = 32; distance > 0; distance--)
+    {
+        uint32_t seq = ackId - distance;
+        if (((mask >> (32 - distance)) & 1) && !wasLocalAcked(seq))
+            newlyAcked.push_back(seq);
+    }
+    if (!wasLocalAcked(ackId))
+        newlyAcked.push_back(ackId);
+
+    uint32_t shift = ackId - lastAckedSeq;
+    if (shift >= MAX_RECENT_PACKETS)
+        localAckHistory.reset();
+    else
+        localAckHistory <<= shift;
+    localAckHistory.set(0);
+    for (uint32_t distance = 1; distance <= 32; distance++)
+    {
+        if ((mask >> (32 - distance)) & 1)
+            localAckHistory.set(distance);
+    }
     lastAckedSeq = ackId;
     lastAckedSeqsMask = mask;
 }
+void PacketManager::ackLocalSelective(const ExtraSelectiveAck &sack, std::vector<uint32_t> &newlyAcked)
+{
+    size_t first = newlyAcked.size();
+    uint32_t seq = sack.baseSeq;
+    for (const ExtraSelectiveAck::Range &r : sack.ranges)
+    {
+        seq -= r.gap;
+        for (uint8_t i = 0; i < r.length; i++, seq--)
+        {
+            // Anything newer than the last ack will get acked by the packet that acks it
+            uint32_t distance = lastAckedSeq - seq;
+            if (seqgt(seq, lastAckedSeq) || distance >= MAX_RECENT_PACKETS || localAckHistory.test(distance))
+                continue;
+            localAckHistory.set(distance);
+            newlyAcked.push_back(seq);
+        }
+    }
+    // The ranges go from the newest seq back
+    std::reverse(newlyAcked.begin() + first, newlyAcked.end());
+    // A reordered selective ack is still good for acks, but not for telling what's missing
+    if (!selectiveAckBaseSeq || seqgte(sack.baseSeq, selectiveAckBaseSeq))
+    {
+        selectiveAckBaseSeq = sack.baseSeq;
+        selectiveAckLowSeq = seq + 1;
+    }
+}
+bool PacketManager::wasCoveredBySelectiveAck(uint32_t seq) const
+{
+    return selectiveAckBaseSeq && seqgte(seq, selectiveAckLowSeq) && seqgte(selectiveAckBaseSeq, seq);
+}
 bool PacketManager::wasLocalAcked(uint32_t seq) const
 {
     if (seq == lastAckedSeq)
         return true;
-    if (seq > lastAckedSeq)
+    if (seqgt(seq, lastAckedSeq))
         return false;
 
     uint32_t distance = lastAckedSeq - seq;
-    if (distance > 0 && distance <= 32)
-    {
-        return (lastAckedSeqsMask >> (32 - distance)) & 1;
-    }
-
-    return false;
+    return distance < MAX_RECENT_PACKETS && localAckHistory.test(distance);
 }
 
 bool PacketManager::ackRemoteSeq(const Packet &pkt)
@@ -53,21 +104,28 @@ bool PacketManager::ackRemoteSeq(const uint32_t ackId)
             //LOGW("Received duplicated packet for seq %u, streamId=%hhu", ackId, transportId);
             return false;
         }
-        else if (ackId > lastRemoteSeq)
+        else if (seqgt(ackId, lastRemoteSeq))
         {
-            lastRemoteSeqsMask = (lastRemoteSeqsMask << 1) | 1;
-            lastRemoteSeqsMask <<= (ackId - lastRemoteSeq) - 1;
+            uint32_t shift = ackId - lastRemoteSeq;
+            lastRemoteSeqsMask = shift > 32 ? 0 : ((shift == 32 ? 0 : lastRemoteSeqsMask >> shift) | (1U << (32 - shift)));
+            if (shift >= MAX_RECENT_PACKETS)
+                remoteSeqHistory.reset();
+            else
+                remoteSeqHistory <<= shift;
+            remoteSeqHistory.set(0);
             lastRemoteSeq = ackId;
         }
         else
         {
-            uint32_t pos = 1 << ((lastRemoteSeq - ackId) - 1);
-            if (lastRemoteSeqsMask & pos)
+            uint32_t distance = lastRemoteSeq - ackId;
+            if (remoteSeqHistory.test(distance))
             {
                 LOGW("Received duplicated packet for seq %u, streamId=%hhu", ackId, transportId);
                 return false;
             }
-            lastRemoteSeqsMask |= pos;
+            remoteSeqHistory.set(distance);
+            if (distance <= 32)
+                lastRemoteSeqsMask |= 1U << (32 - distance);
         }
     }
     else
@@ -78,9 +136,41 @@ bool PacketManager::ackRemoteSeq(const uint32_t ackId)
     return true;
 }
 
-std::vector<RecentOutgoingPacket> &PacketManager::getRecentOutgoingPackets()
+bool PacketManager::shouldSendSelectiveAck() const
+{
+    return lastRemoteSeq - lastSelectiveAckSeq >= SELECTIVE_ACK_INTERVAL;
+}
+
+void PacketManager::getRemoteSelectiveAck(ExtraSelectiveAck &sack)
 {
-    return recentOutgoingPackets;
+    sack.baseSeq = lastRemoteSeq;
+    sack.ranges.clear();
+    // Seqs start at 1, there's nothing to report before that
+    uint32_t historySize = std::min(lastRemoteSeq, (uint32_t)MAX_RECENT_PACKETS);
+    uint32_t distance = 0;
+    while (distance < historySize && sack.ranges.size() < MAX_SELECTIVE_ACK_RANGES)
+    {
+        uint8_t gap = 0, length = 0;
+        for (; distance < historySize && !remoteSeqHistory.test(distance); distance++)
+            gap++;
+        for (; distance < historySize && remoteSeqHistory.test(distance); distance++)
+            length++;
+        // Nothing older arrived, so the missing seqs at the end are left for the peer to treat as unknown
+        if (!length)
+            break;
+        sack.ranges.push_back(ExtraSelectiveAck::Range{gap, length});
+    }
+    lastSelectiveAckSeq = lastRemoteSeq;
+}
+
+RecentOutgoingPacket *PacketManager::getRecentOutgoingPacket(uint32_t seq)
+{
+    if (newestRecentSeq - seq >= MAX_RECENT_PACKETS)
+        return nullptr;
+    RecentOutgoingPacket &pkt = recentOutgoingPackets[seq & (MAX_RECENT_PACKETS - 1)];
+    if (pkt.sendTime == 0 || pkt.pkt.seq != seq)
+        return nullptr;
+    return &pkt;
 }
 void PacketManager::addRecentOutgoingPacket(const PendingOutgoingPacket &pkt)
 {
@@ -88,10 +178,14 @@ void PacketManager::addRecentOutgoingPacket(const PendingOutgoingPacket &pkt)
 }
 void PacketManager::addRecentOutgoingPacket(RecentOutgoingPacket &&pkt)
 {
-    recentOutgoingPackets.push_back(std::move(pkt));
-    while (recentOutgoingPackets.size() > MAX_RECENT_PACKETS)
-    {
-        recentOutgoingPackets.erase(recentOutgoingPackets.begin());
-    }
-    lastSentSeq = pkt.pkt.seq;
+    uint32_t seq = pkt.pkt.seq;
+    lastSentSeq = seq;
+    // A resent packet keeps the entry of its first transmission
+    if (getRecentOutgoingPacket(seq))
+        return;
+    if (seqgt(seq, newestRecentSeq))
+        newestRecentSeq = seq;
+    else if (newestRecentSeq - seq >= MAX_RECENT_PACKETS)
+        return;
+    recentOutgoingPackets[seq & (MAX_RECENT_PACKETS - 1)] = std::move(pkt);
 }
@@ -1,4 +1,6 @@
 #pragma once
+#include "../../Constants.h"
+#include "../../net/RackLossDetector.h"
 #include <atomic>
 #include <bitset>
 #include <vector>
@@ -22,6 +24,7 @@ inline bool seqgte(uint32_t s1, uint32_t s2)
 struct RecentOutgoingPacket;
 struct PendingOutgoingPacket;
 struct Packet;
+struct ExtraSelectiveAck;
 // Local and remote packet history management
 class PacketManager final
 {
@@ -40,6 +43,9 @@ public:
     // Transport ID for multiplexing
     uint8_t transportId;
 
+    // Every stream gets its own RTT and reordering, audio shouldn't be held to the timing of video
+    RackLossDetector lossDetector;
+
 public:
     /* Local seqno generation */
 
@@ -85,8 +91,15 @@ public:
         return lastAckedSeq;
     }
 
-    // Ack specified local seq + up to 32 seqs ago, specified by mask
-    void ackLocal(uint32_t ackId, uint32_t mask);
+    // Ack specified local seq + up to 32 seqs ago, specified by mask.
+    // Appends the seqs that weren't acked before to newlyAcked, oldest first.
+    void ackLocal(uint32_t ackId, uint32_t mask, std::vector<uint32_t> &newlyAcked);
+
+    // Ack the local seqs in the ranges of a selective ack, appends the ones that weren't acked before to newlyAcked, oldest first
+    void ackLocalSelective(const ExtraSelectiveAck &sack, std::vector<uint32_t> &newlyAcked);
+
+    // Whether the newest selective ack from the peer says anything about seq, acked or not
+    bool wasCoveredBySelectiveAck(uint32_t seq) const;
 
     // Check if local seq was acked
     bool wasLocalAcked(uint32_t seq) const;
@@ -104,6 +117,13 @@ private:
     // Status list of acked local seqnos, excluding the seq explicitly present in the packet, up to 32 seqs ago
     uint32_t lastAckedSeqsMask = 0;
 
+    // Every local seq acked so far by masks and selective acks, bit i is lastAckedSeq - i
+    std::bitset<MAX_RECENT_PACKETS> localAckHistory;
+
+    // Seqs covered by the newest selective ack from the peer
+    uint32_t selectiveAckBaseSeq = 0;
+    uint32_t selectiveAckLowSeq = 0;
+
 public:
     /* Remote seqno ack */
     // Ack specified remote packet, returns false if too old or dupe
@@ -115,7 +135,10 @@ public:
     // Ack remote seqs older than the specified seq
     inline void ackRemoteSeqsOlderThan(uint32_t seq)
     {
-        lastRemoteSeqsMask |= 0xFFFFFFFF << (lastRemoteSeq - seq);
+        if (lastRemoteSeq - seq < 32)
+            lastRemoteSeqsMask |= 0xFFFFFFFF >> (lastRemoteSeq - seq + 1);
+        for (uint32_t distance = lastRemoteSeq - seq + 1; distance < MAX_RECENT_PACKETS; distance++)
+            remoteSeqHistory.set(distance);
     }
 
     // Get ack mask for remote packets
@@ -130,20 +153,63 @@ public:
         return lastRemoteSeq;
     }
 
+    // Local arrival time of the last remote seqno in microseconds, echoed to the peer as Packet::recvTS
+    inline uint32_t getLastRemoteSeqRecvTS() const
+    {
+        return lastRemoteSeqRecvTS;
+    }
+
+    inline void setLastRemoteSeqRecvTS(uint32_t recvTS)
+    {
+        // Zero means there's no timestamp in the packet
+        lastRemoteSeqRecvTS = recvTS ? recvTS : 1;
+    }
+
 private:
     // Seqno of last received remote packet
     uint32_t lastRemoteSeq = 0;
 
-    // Recent incoming remote packets
-    uint32_t lastRemoteSeqsMask;
+    uint32_t lastRemoteSeqRecvTS = 0;
+
+    // Recent incoming remote packets, the most significant bit is lastRemoteSeq - 1 like wasLocalAcked expects
+    uint32_t lastRemoteSeqsMask = 0;
+
+    // Remote seqs received over a longer window than the mask, bit i is lastRemoteSeq - i
+    std::bitset<MAX_RECENT_PACKETS> remoteSeqHistory;
+
+    // lastRemoteSeq when the last selective ack was generated
+    uint32_t lastSelectiveAckSeq = 0;
+
+public:
+    // Whether enough remote packets arrived since the last selective ack to attach another one
+    bool shouldSendSelectiveAck() const;
+
+    // Describe the received remote seqs in sack and remember that it was sent
+    void getRemoteSelectiveAck(ExtraSelectiveAck &sack);
 
 public: // Recent outgoing packet list
-    std::vector<RecentOutgoingPacket> &getRecentOutgoingPackets();
+    // Get the recent outgoing packet with the specified seq, null if it wasn't sent or is older than the last MAX_RECENT_PACKETS seqs
+    RecentOutgoingPacket *getRecentOutgoingPacket(uint32_t seq);
+
+    // Call f for every recent outgoing packet, oldest first
+    template <typename F>
+    void forEachRecentOutgoingPacket(F &&f)
+    {
+        uint32_t first = newestRecentSeq - (MAX_RECENT_PACKETS - 1);
+        for (uint32_t i = 0; i < MAX_RECENT_PACKETS; i++)
+        {
+            if (RecentOutgoingPacket *pkt = getRecentOutgoingPacket(first + i))
+                f(*pkt);
+        }
+    }
+
     void addRecentOutgoingPacket(const PendingOutgoingPacket &pkt);
     void addRecentOutgoingPacket(RecentOutgoingPacket &&pkt);
 
 private:
-    // Recent ougoing packets
+    // Ring of recent outgoing packets, the packet with a given seq lives at seq & (MAX_RECENT_PACKETS - 1)
     std::vector<RecentOutgoingPacket> recentOutgoingPackets;
+    // Highest seq in the ring
+    uint32_t newestRecentSeq = 0;
 };
 } // namespace tgvoip
\ No newline at end of file
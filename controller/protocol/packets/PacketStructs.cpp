@@ -107,6 +107,7 @@ void Packet::prepare(PacketManager &pm)
         seq = pm.nextLocalSeq();
         ackSeq = pm.getLastRemoteSeq();
         ackMask = pm.getRemoteAckMask();
+        recvTS = pm.getLastRemoteSeqRecvTS();
         streamId = pm.transportId;
     }
 }
@@ -126,6 +127,8 @@ void Packet::prepare(PacketManager &pm, std::vector<UnacknowledgedExtraData> &cu
 void Packet::prepare(PacketManager &pm, std::vector<UnacknowledgedExtraData> &currentExtras, const int64_t &endpointId, PacketManager &legacyPm, const int peerVersion)
 {
     prepare(pm);
+    // Older peers don't know what to do with arrival times
+    recvTS = 0;
     if (!legacySeq)
     {
         if (pm != legacyPm)
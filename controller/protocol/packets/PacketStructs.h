@@ -31,10 +31,33 @@ struct ReliableOutgoingPacket
 
     double firstSentTime;
     double lastSentTime;
+    // When the packet has to be resent or dropped next
+    double deadline;
+
+    // Reliable packets are looked up by the stream and seq an ack refers to
+    static inline uint64_t Key(uint8_t streamId, uint32_t seq)
+    {
+        return ((uint64_t)streamId << 32) | seq;
+    }
+};
+struct ReliablePacketDeadline
+{
+    double deadline;
+    uint64_t key;
+
+    bool operator>(const ReliablePacketDeadline &other) const
+    {
+        return deadline > other.deadline;
+    }
 };
 
 struct RecentOutgoingPacket
 {
+    // Empty slot in PacketManager's ring
+    RecentOutgoingPacket() : pkt(0, 0),
+                             size(0),
+                             endpoint(0),
+                             sendTime(0){};
     RecentOutgoingPacket(const PendingOutgoingPacket &_pkt, double _sendTime) : pkt(_pkt.pktInfo),
                                                                                 size(_pkt.packet->Length()),
                                                                                 endpoint(_pkt.endpoint),
@@ -49,7 +72,11 @@ struct RecentOutgoingPacket
     double sendTime;
     double ackTime = 0.0;
     double rttTime = 0.0;
+    // Still waiting in the pacer, sendTime is when it was handed to the send thread until the send thread reports it released
+    bool queued = false;
     bool lost = false;
+    // Lost and already out of the range an ack mask can cover
+    bool lossConfirmed = false;
 };
 struct UnacknowledgedExtraData
 {
@@ -75,6 +75,9 @@ std::shared_ptr<Extra> Extra::choose(const BufferInputStream &in, const VersionI
     case ExtraPong::ID:
         res = std::make_shared<ExtraPong>();
         break;
+    case ExtraSelectiveAck::ID:
+        res = std::make_shared<ExtraSelectiveAck>();
+        break;
     }
     if (res)
         res->hash = *reinterpret_cast<uint64_t *>(fullHash);
@@ -158,6 +161,8 @@ std::string Extra::print() const
         return "ExtraPing";
     case ExtraPong::ID:
         return "ExtraPong";
+    case ExtraSelectiveAck::ID:
+        return "ExtraSelectiveAck";
     }
     return "???";
 }
@@ -328,3 +333,27 @@ void ExtraNetworkChanged::serialize(BufferOutputStream &out, const VersionInfo &
 {
     ver.isNew() ? out.WriteByte(flags) : out.WriteUInt32(flags);
 }
+
+bool ExtraSelectiveAck::parse(const BufferInputStream &in, const VersionInfo &ver)
+{
+    uint8_t count;
+    if (!in.TryRead(baseSeq) || !in.TryRead(count))
+        return false;
+    ranges.resize(count);
+    for (Range &r : ranges)
+    {
+        if (!in.TryRead(r.gap) || !in.TryRead(r.length))
+            return false;
+    }
+    return true;
+}
+void ExtraSelectiveAck::serialize(BufferOutputStream &out, const VersionInfo &ver) const
+{
+    out.WriteUInt32(baseSeq);
+    out.WriteByte((uint8_t)ranges.size());
+    for (const Range &r : ranges)
+    {
+        out.WriteByte(r.gap);
+        out.WriteByte(r.length);
+    }
+}
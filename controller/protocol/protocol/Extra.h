@@ -284,7 +284,8 @@ struct ExtraInit : public Extra
         DataSavingEnabled = 1,
         GroupCallSupported = 2,
         VideoSendSupported = 4,
-        VideoRecvSupported = 8
+        VideoRecvSupported = 8,
+        SelectiveAckSupported = 16
     };
 
     uint32_t peerVersion = 0;
@@ -378,4 +379,43 @@ struct ExtraPong : public Extra
     }
     virtual ~ExtraPong() = default;
 };
+
+// Received seqs of the stream the packet it's attached to belongs to, reaching further back than the 32-seq ack mask.
+// Starting at baseSeq and going back, every range skips gap seqs that haven't arrived and then covers length seqs that have.
+// Seqs older than the last range are unknown rather than missing.
+struct ExtraSelectiveAck : public Extra
+{
+    bool parse(const BufferInputStream &in, const VersionInfo &ver) override;
+    void serialize(BufferOutputStream &out, const VersionInfo &ver) const override;
+
+    struct Range
+    {
+        uint8_t gap;
+        uint8_t length;
+    };
+
+    uint32_t baseSeq = 0;
+    std::vector<Range> ranges;
+
+    uint8_t getID() const override
+    {
+        return ID;
+    }
+    static const uint8_t ID = 12;
+
+    std::string print() const override
+    {
+        std::ostringstream ss;
+        ss << "ExtraSelectiveAck (baseSeq=" << baseSeq << ", ranges:";
+        for (const Range &r : ranges)
+            ss << " -" << (int)r.gap << "+" << (int)r.length;
+        ss << ")";
+        return ss.str();
+    }
+    size_t getConstructorSize(const VersionInfo &ver) const override
+    {
+        return sizeof(baseSeq) + 1 + ranges.size() * 2;
+    }
+    virtual ~ExtraSelectiveAck() = default;
+};
 } // namespace tgvoip
@@ -31,12 +31,22 @@
           '<(tgvoip_src_loc)/tools/BlockingQueue.h',
           '<(tgvoip_src_loc)/tools/Buffers.cpp',
           '<(tgvoip_src_loc)/tools/Buffers.h',
+          '<(tgvoip_src_loc)/tools/CryptoWorkerPool.cpp',
+          '<(tgvoip_src_loc)/tools/CryptoWorkerPool.h',
+          '<(tgvoip_src_loc)/tools/HardwareCrypto.cpp',
+          '<(tgvoip_src_loc)/tools/HardwareCrypto.h',
           '<(tgvoip_src_loc)/controller/net/CongestionControl.cpp',
           '<(tgvoip_src_loc)/controller/net/CongestionControl.h',
+          '<(tgvoip_src_loc)/controller/net/DelayGradientEstimator.cpp',
+          '<(tgvoip_src_loc)/controller/net/DelayGradientEstimator.h',
           '<(tgvoip_src_loc)/controller/audio/EchoCanceller.cpp',
           '<(tgvoip_src_loc)/controller/audio/EchoCanceller.h',
           '<(tgvoip_src_loc)/controller/net/JitterBuffer.cpp',
           '<(tgvoip_src_loc)/controller/net/JitterBuffer.h',
+          '<(tgvoip_src_loc)/controller/net/PacketPacer.cpp',
+          '<(tgvoip_src_loc)/controller/net/PacketPacer.h',
+          '<(tgvoip_src_loc)/controller/net/RackLossDetector.cpp',
+          '<(tgvoip_src_loc)/controller/net/RackLossDetector.h',
           '<(tgvoip_src_loc)/tools/logging.cpp',
           '<(tgvoip_src_loc)/tools/logging.h',
           '<(tgvoip_src_loc)/controller/MediaStreamItf.cpp',
@@ -64,6 +74,8 @@
           '<(tgvoip_src_loc)/controller/PacketReassembler.h',
           '<(tgvoip_src_loc)/tools/MessageThread.cpp',
           '<(tgvoip_src_loc)/tools/MessageThread.h',
+          '<(tgvoip_src_loc)/tools/MPSCQueue.h',
+          '<(tgvoip_src_loc)/tools/SPSCQueue.h',
           '<(tgvoip_src_loc)/audio/AudioIO.cpp',
           '<(tgvoip_src_loc)/audio/AudioIO.h',
           '<(tgvoip_src_loc)/audio/AudioIOCallback.cpp',
@@ -120,6 +132,8 @@
           '<(tgvoip_src_loc)/os/linux/AudioInputPulse.h',
           '<(tgvoip_src_loc)/os/linux/AudioPulse.cpp',
           '<(tgvoip_src_loc)/os/linux/AudioPulse.h',
+          '<(tgvoip_src_loc)/os/linux/NetworkSocketIOUring.cpp',
+          '<(tgvoip_src_loc)/os/linux/NetworkSocketIOUring.h',
 
           # POSIX
           '<(tgvoip_src_loc)/os/posix/NetworkSocketPosix.cpp',
@@ -0,0 +1,560 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#if defined(__linux__) && defined(TGVOIP_USE_IO_URING)
+
+#include "NetworkSocketIOUring.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "../../tools/logging.h"
+
+using namespace tgvoip;
+
+namespace
+{
+constexpr unsigned int ringEntries = 64;
+// Must be a power of two
+constexpr unsigned int recvBufferCount = 64;
+constexpr size_t recvBufferSize = 4096;
+constexpr unsigned short recvBufferGroup = 0;
+constexpr uint64_t recvUserData = UINT64_MAX;
+constexpr uint64_t cancelUserData = UINT64_MAX - 1;
+} // namespace
+
+NetworkSocketIOUring::Ring::Ring()
+{
+	fd = -1;
+	sqMap = MAP_FAILED;
+	sqMapSize = 0;
+	cqMap = MAP_FAILED;
+	cqMapSize = 0;
+	sqes = (io_uring_sqe *)MAP_FAILED;
+	sqesSize = 0;
+	sqeTail = 0;
+}
+
+NetworkSocketIOUring::Ring::~Ring()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqesSize);
+	if (cqMap != MAP_FAILED && cqMap != sqMap)
+		munmap(cqMap, cqMapSize);
+	if (sqMap != MAP_FAILED)
+		munmap(sqMap, sqMapSize);
+	if (fd >= 0)
+		close(fd);
+}
+
+bool NetworkSocketIOUring::Ring::Init(unsigned int entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+	{
+		LOGW("io_uring_setup failed: %d / %s", errno, strerror(errno));
+		return false;
+	}
+
+	sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMap)
+		sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+	sqMap = mmap(NULL, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sqMap == MAP_FAILED)
+	{
+		LOGE("error mapping io_uring submission queue: %d / %s", errno, strerror(errno));
+		return false;
+	}
+	if (singleMap)
+	{
+		cqMap = sqMap;
+	}
+	else
+	{
+		cqMap = mmap(NULL, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqMap == MAP_FAILED)
+		{
+			LOGE("error mapping io_uring completion queue: %d / %s", errno, strerror(errno));
+			return false;
+		}
+	}
+	sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		LOGE("error mapping io_uring sqes: %d / %s", errno, strerror(errno));
+		return false;
+	}
+
+	unsigned char *sq = (unsigned char *)sqMap;
+	unsigned char *cq = (unsigned char *)cqMap;
+	sqHead = (unsigned int *)(sq + params.sq_off.head);
+	sqTail = (unsigned int *)(sq + params.sq_off.tail);
+	sqMask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	sqArray = (unsigned int *)(sq + params.sq_off.array);
+	cqHead = (unsigned int *)(cq + params.cq_off.head);
+	cqTail = (unsigned int *)(cq + params.cq_off.tail);
+	cqMask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	sqeTail = *sqTail;
+	return true;
+}
+
+io_uring_sqe *NetworkSocketIOUring::Ring::GetSqe()
+{
+	unsigned int head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (sqeTail - head > sqMask)
+		return NULL;
+	unsigned int index = sqeTail & sqMask;
+	sqArray[index] = index;
+	sqeTail++;
+	io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	return sqe;
+}
+
+int NetworkSocketIOUring::Ring::Submit(unsigned int minComplete)
+{
+	__atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+	unsigned int toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (toSubmit == 0 && minComplete == 0)
+		return 0;
+	unsigned int flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+	int res;
+	do
+	{
+		res = (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+	} while (res < 0 && errno == EINTR);
+	return res < 0 ? -errno : res;
+}
+
+io_uring_cqe *NetworkSocketIOUring::Ring::PeekCqe()
+{
+	unsigned int head = *cqHead;
+	if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &cqes[head & cqMask];
+}
+
+void NetworkSocketIOUring::Ring::AdvanceCq()
+{
+	__atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+int NetworkSocketIOUring::Ring::Register(unsigned int opcode, void *arg, unsigned int nrArgs)
+{
+	int res = (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+	return res < 0 ? -errno : res;
+}
+
+NetworkSocketIOUring::NetworkSocketIOUring(NetworkProtocol protocol) : NetworkSocketPosix(protocol)
+{
+	memset(&recvMsgTemplate, 0, sizeof(recvMsgTemplate));
+	if (protocol != NetworkProtocol::UDP)
+		return;
+	if (!recvRing.Init(ringEntries) || !sendRing.Init(ringEntries))
+		return;
+	eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventFd < 0)
+	{
+		LOGE("error creating eventfd: %d / %s", errno, strerror(errno));
+		return;
+	}
+	int res = recvRing.Register(IORING_REGISTER_EVENTFD, &eventFd, 1);
+	if (res < 0)
+	{
+		LOGW("error registering eventfd with io_uring: %d / %s", -res, strerror(-res));
+		return;
+	}
+	if (!InitRecvBuffers())
+		return;
+	sendSlots.resize(ringEntries);
+	ready = true;
+}
+
+NetworkSocketIOUring::~NetworkSocketIOUring()
+{
+	// The kernel must be done with our buffers before they are unmapped
+	Close();
+	CancelRecvAndWait();
+	{
+		std::lock_guard<std::mutex> lock(sendMutex);
+		while (sendsInFlight > 0)
+		{
+			if (!ReapSendCompletions(true))
+				break;
+		}
+	}
+	if (bufMemory)
+		munmap(bufMemory, bufMemorySize);
+	if (bufRing)
+		munmap(bufRing, bufRingSize);
+	if (eventFd >= 0)
+		close(eventFd);
+}
+
+bool NetworkSocketIOUring::IsRingReady()
+{
+	return ready;
+}
+
+int NetworkSocketIOUring::GetPollDescriptor()
+{
+	if (ready)
+		return eventFd;
+	return NetworkSocketPosix::GetPollDescriptor();
+}
+
+bool NetworkSocketIOUring::InitRecvBuffers()
+{
+	bufRingSize = recvBufferCount * sizeof(io_uring_buf);
+	void *ringMem = mmap(NULL, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ringMem == MAP_FAILED)
+	{
+		LOGE("error allocating buffer ring: %d / %s", errno, strerror(errno));
+		return false;
+	}
+	bufRing = (io_uring_buf_ring *)ringMem;
+	bufMemorySize = recvBufferCount * recvBufferSize;
+	void *bufMem = mmap(NULL, bufMemorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufMem == MAP_FAILED)
+	{
+		LOGE("error allocating receive buffers: %d / %s", errno, strerror(errno));
+		return false;
+	}
+	bufMemory = (unsigned char *)bufMem;
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+	reg.ring_entries = recvBufferCount;
+	reg.bgid = recvBufferGroup;
+	int res = recvRing.Register(IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (res < 0)
+	{
+		LOGW("error registering provided buffer ring: %d / %s", -res, strerror(-res));
+		return false;
+	}
+	for (unsigned int i = 0; i < recvBufferCount; i++)
+		RecycleBuffer(i);
+	return true;
+}
+
+void NetworkSocketIOUring::RecycleBuffer(unsigned int bid)
+{
+	unsigned short tail = bufRing->tail;
+	// Not bufRing->bufs: C++ gives the empty struct in front of that flexible array a nonzero size
+	io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(bufRing) + (tail & (recvBufferCount - 1));
+	buf->addr = (uint64_t)(uintptr_t)(bufMemory + bid * recvBufferSize);
+	buf->len = (unsigned int)recvBufferSize;
+	buf->bid = (unsigned short)bid;
+	__atomic_store_n(&bufRing->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void NetworkSocketIOUring::Open()
+{
+	NetworkSocketPosix::Open();
+	if (ready && !failed)
+		ArmRecv();
+}
+
+void NetworkSocketIOUring::ArmRecv()
+{
+	// A single-shot recvmsg writes the lengths back, so the template has to be refreshed every time
+	memset(&recvMsgTemplate, 0, sizeof(recvMsgTemplate));
+	recvMsgTemplate.msg_name = &recvAddr;
+	recvMsgTemplate.msg_namelen = sizeof(sockaddr_in6);
+	recvMsgTemplate.msg_control = &recvControl;
+	recvMsgTemplate.msg_controllen = sizeof(RecvControlBuffer);
+
+	io_uring_sqe *sqe = recvRing.GetSqe();
+	if (!sqe)
+	{
+		LOGE("io_uring submission queue is full");
+		return;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&recvMsgTemplate;
+	sqe->len = 1;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = recvBufferGroup;
+	sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = recvUserData;
+	int res = recvRing.Submit(0);
+	if (res < 0)
+	{
+		LOGE("error submitting recvmsg: %d / %s", -res, strerror(-res));
+		return;
+	}
+	recvArmed = true;
+}
+
+bool NetworkSocketIOUring::ProcessRecvCompletion(const io_uring_cqe &cqe, std::vector<NetworkPacket> &packets)
+{
+	if (cqe.user_data != recvUserData)
+		return false;
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+		recvArmed = false;
+	if (cqe.res < 0)
+	{
+		if (cqe.res == -EINVAL && multishot)
+		{
+			LOGW("Multishot recvmsg is not supported by this kernel, falling back to one receive per submission");
+			multishot = false;
+		}
+		else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+		{
+			LOGE("error receiving %d / %s", -cqe.res, strerror(-cqe.res));
+		}
+		return false;
+	}
+	if (!(cqe.flags & IORING_CQE_F_BUFFER))
+		return false;
+
+	unsigned int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+	unsigned char *buf = bufMemory + bid * recvBufferSize;
+	const unsigned char *payload;
+	size_t len;
+	sockaddr_in6 srcAddr;
+	RecvControlBuffer control;
+	msghdr msg = {0};
+	if (multishot)
+	{
+		// Multishot completions lay out the header, the address and the control data in front of the payload
+		io_uring_recvmsg_out out;
+		size_t headerLen = sizeof(out) + sizeof(sockaddr_in6) + sizeof(RecvControlBuffer);
+		if ((size_t)cqe.res < headerLen)
+		{
+			RecycleBuffer(bid);
+			return false;
+		}
+		memcpy(&out, buf, sizeof(out));
+		if (out.flags & MSG_TRUNC)
+		{
+			LOGW("Dropping truncated %u-byte datagram", out.payloadlen);
+			RecycleBuffer(bid);
+			return false;
+		}
+		memset(&srcAddr, 0, sizeof(srcAddr));
+		memcpy(&srcAddr, buf + sizeof(out), std::min((size_t)out.namelen, sizeof(sockaddr_in6)));
+		// Copied out because the control data in the buffer isn't aligned for cmsghdr
+		memcpy(&control, buf + sizeof(out) + sizeof(sockaddr_in6), sizeof(RecvControlBuffer));
+		msg.msg_control = &control;
+		msg.msg_controllen = std::min((size_t)out.controllen, sizeof(RecvControlBuffer));
+		payload = buf + headerLen;
+		len = out.payloadlen;
+	}
+	else
+	{
+		srcAddr = recvAddr;
+		msg = recvMsgTemplate;
+		payload = buf;
+		len = (size_t)cqe.res;
+	}
+
+	std::shared_ptr<Buffer> packetBuf = GetReceiveBuffer(len);
+	if (len)
+		packetBuf->CopyFrom(payload, 0, len);
+	RecycleBuffer(bid);
+	packets.push_back(NetworkPacket{
+		std::move(packetBuf),
+		AddressFromSockaddr(srcAddr),
+		ntohs(srcAddr.sin6_port),
+		NetworkProtocol::UDP,
+		GetReceiveTime(msg)});
+	return true;
+}
+
+size_t NetworkSocketIOUring::ReceiveBatch(std::vector<NetworkPacket> &packets, size_t max)
+{
+	if (!ready)
+		return NetworkSocketPosix::ReceiveBatch(packets, max);
+	if (failed)
+		return 0;
+
+	uint64_t counter;
+	if (read(eventFd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+		LOGW("error reading eventfd: %d / %s", errno, strerror(errno));
+
+	size_t received = 0;
+	while (received < max)
+	{
+		io_uring_cqe *cqePtr = recvRing.PeekCqe();
+		if (!cqePtr)
+			break;
+		io_uring_cqe cqe = *cqePtr;
+		recvRing.AdvanceCq();
+		if (ProcessRecvCompletion(cqe, packets))
+			received++;
+	}
+	if (!recvArmed && !failed && fd >= 0)
+		ArmRecv();
+	// Keep the descriptor readable while completions are left in the queue so that level-triggered waiters don't miss them
+	if (recvRing.PeekCqe())
+	{
+		counter = 1;
+		if (write(eventFd, &counter, sizeof(counter)) < 0)
+			LOGW("error writing eventfd: %d / %s", errno, strerror(errno));
+	}
+	return received;
+}
+
+NetworkPacket NetworkSocketIOUring::Receive(size_t maxLen)
+{
+	if (!ready)
+		return NetworkSocketPosix::Receive(maxLen);
+	std::vector<NetworkPacket> packets;
+	if (ReceiveBatch(packets, 1) == 0)
+		return NetworkPacket::Empty();
+	return std::move(packets[0]);
+}
+
+void NetworkSocketIOUring::CancelRecvAndWait()
+{
+	if (!recvArmed)
+		return;
+	io_uring_sqe *sqe = recvRing.GetSqe();
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = recvUserData;
+		sqe->user_data = cancelUserData;
+	}
+	while (recvArmed)
+	{
+		if (recvRing.Submit(1) < 0)
+		{
+			LOGE("error waiting for the receive to be cancelled");
+			break;
+		}
+		while (io_uring_cqe *cqe = recvRing.PeekCqe())
+		{
+			if (cqe->user_data == recvUserData && !(cqe->flags & IORING_CQE_F_MORE))
+				recvArmed = false;
+			recvRing.AdvanceCq();
+		}
+	}
+}
+
+void NetworkSocketIOUring::Send(NetworkPacket &&packet)
+{
+	if (!ready)
+	{
+		NetworkSocketPosix::Send(std::move(packet));
+		return;
+	}
+	std::vector<NetworkPacket> packets;
+	packets.push_back(std::move(packet));
+	SendBatch(packets);
+}
+
+void NetworkSocketIOUring::SendBatch(std::vector<NetworkPacket> &packets)
+{
+	if (!ready)
+	{
+		NetworkSocketPosix::SendBatch(packets);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(sendMutex);
+	ReapSendCompletions(false);
+	size_t slotIndex = 0;
+	size_t i = 0;
+	for (; i < packets.size(); i++)
+	{
+		NetworkPacket &packet = packets[i];
+		if (packet.IsEmpty() || packet.port == 0)
+		{
+			LOGW("tried to send null packet");
+			continue;
+		}
+		while (slotIndex < sendSlots.size() && sendSlots[slotIndex].inUse)
+			slotIndex++;
+		if (slotIndex == sendSlots.size())
+		{
+			// Every slot is waiting for the kernel, submit what we have and wait for some to complete
+			if (!ReapSendCompletions(true))
+				break;
+			slotIndex = 0;
+			while (slotIndex < sendSlots.size() && sendSlots[slotIndex].inUse)
+				slotIndex++;
+			if (slotIndex == sendSlots.size())
+				break;
+		}
+
+		SendSlot &slot = sendSlots[slotIndex];
+		slot.packet = std::move(packet);
+		PrepareDestinationAddress(slot.packet, slot.addr);
+		slot.iov.iov_base = **slot.packet.data;
+		slot.iov.iov_len = slot.packet.data->Length();
+		memset(&slot.msg, 0, sizeof(msghdr));
+		slot.msg.msg_name = &slot.addr;
+		slot.msg.msg_namelen = sizeof(sockaddr_in6);
+		slot.msg.msg_iov = &slot.iov;
+		slot.msg.msg_iovlen = 1;
+
+		io_uring_sqe *sqe = sendRing.GetSqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)&slot.msg;
+		sqe->len = 1;
+		sqe->user_data = slotIndex;
+		slot.inUse = true;
+		sendsInFlight++;
+	}
+	if (i < packets.size())
+	{
+		// No send slot freed up, the rest would otherwise look like network loss
+		size_t dropped = packets.size() - i;
+		droppedPackets.fetch_add(dropped, std::memory_order_relaxed);
+		LOGW("Socket %d send ring is full, dropping %u packets", (int)fd, (unsigned int)dropped);
+	}
+	int res = sendRing.Submit(0);
+	if (res < 0)
+		LOGE("error submitting sends: %d / %s", -res, strerror(-res));
+	packets.clear();
+}
+
+bool NetworkSocketIOUring::ReapSendCompletions(bool wait)
+{
+	if (wait && sendsInFlight > 0)
+	{
+		int res = sendRing.Submit(1);
+		if (res < 0)
+		{
+			LOGE("error waiting for send completions: %d / %s", -res, strerror(-res));
+			return false;
+		}
+	}
+	while (io_uring_cqe *cqe = sendRing.PeekCqe())
+	{
+		uint64_t index = cqe->user_data;
+		int res = cqe->res;
+		sendRing.AdvanceCq();
+		if (index >= sendSlots.size() || !sendSlots[index].inUse)
+			continue;
+		SendSlot &slot = sendSlots[index];
+		if (res < 0)
+		{
+			errno = -res;
+			HandleSendError(std::move(slot.packet));
+		}
+		slot.packet = NetworkPacket::Empty();
+		slot.inUse = false;
+		sendsInFlight--;
+	}
+	return true;
+}
+
+#endif
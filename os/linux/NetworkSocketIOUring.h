@@ -0,0 +1,113 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_NETWORKSOCKETIOURING_H
+#define LIBTGVOIP_NETWORKSOCKETIOURING_H
+
+#if defined(__linux__) && defined(TGVOIP_USE_IO_URING)
+
+#include "../posix/NetworkSocketPosix.h"
+#include <linux/io_uring.h>
+#include <mutex>
+#include <vector>
+
+namespace tgvoip
+{
+
+// UDP socket that receives through a multishot recvmsg with kernel-provided buffers
+// and submits whole send batches with a single io_uring_enter call.
+class NetworkSocketIOUring : public NetworkSocketPosix
+{
+public:
+	NetworkSocketIOUring(NetworkProtocol protocol);
+	virtual ~NetworkSocketIOUring() override;
+	virtual void Send(NetworkPacket &&packet) override;
+	virtual void SendBatch(std::vector<NetworkPacket> &packets) override;
+	virtual NetworkPacket Receive(size_t maxLen) override;
+	virtual size_t ReceiveBatch(std::vector<NetworkPacket> &packets, size_t max) override;
+	virtual void Open() override;
+	// False if the kernel lacks the features we need, the caller should use NetworkSocketPosix instead
+	bool IsRingReady();
+
+protected:
+	virtual int GetPollDescriptor() override;
+
+private:
+	class Ring
+	{
+	public:
+		Ring();
+		~Ring();
+		bool Init(unsigned int entries);
+		io_uring_sqe *GetSqe();
+		// Submits everything queued so far, optionally waiting until at least minComplete completions are available
+		int Submit(unsigned int minComplete);
+		io_uring_cqe *PeekCqe();
+		void AdvanceCq();
+		int Register(unsigned int opcode, void *arg, unsigned int nrArgs);
+
+		int fd;
+
+	private:
+		void *sqMap;
+		size_t sqMapSize;
+		void *cqMap;
+		size_t cqMapSize;
+		io_uring_sqe *sqes;
+		size_t sqesSize;
+		unsigned int *sqHead;
+		unsigned int *sqTail;
+		unsigned int sqMask;
+		unsigned int *sqArray;
+		unsigned int *cqHead;
+		unsigned int *cqTail;
+		unsigned int cqMask;
+		io_uring_cqe *cqes;
+		// Next free entry, published to the kernel on Submit
+		unsigned int sqeTail;
+	};
+
+	struct SendSlot
+	{
+		NetworkPacket packet = NetworkPacket::Empty();
+		sockaddr_in6 addr;
+		iovec iov;
+		msghdr msg;
+		bool inUse = false;
+	};
+
+	bool InitRecvBuffers();
+	void ArmRecv();
+	bool ProcessRecvCompletion(const io_uring_cqe &cqe, std::vector<NetworkPacket> &packets);
+	void RecycleBuffer(unsigned int bid);
+	// Called with sendMutex held
+	bool ReapSendCompletions(bool wait);
+	void CancelRecvAndWait();
+
+	Ring recvRing;
+	Ring sendRing;
+	std::mutex sendMutex;
+	std::vector<SendSlot> sendSlots;
+	unsigned int sendsInFlight = 0;
+	int eventFd = -1;
+	bool ready = false;
+	bool recvArmed = false;
+	bool multishot = true;
+	msghdr recvMsgTemplate;
+	sockaddr_in6 recvAddr;
+	io_uring_buf_ring *bufRing = nullptr;
+	size_t bufRingSize = 0;
+	unsigned char *bufMemory = nullptr;
+	size_t bufMemorySize = 0;
+	// Has to stay last, cmsghdr ends in a flexible array
+	RecvControlBuffer recvControl;
+};
+
+} // namespace tgvoip
+
+#endif
+
+#endif //LIBTGVOIP_NETWORKSOCKETIOURING_H
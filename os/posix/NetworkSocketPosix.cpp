@@ -14,6 +14,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include "../../tools/logging.h"
 #include "../../VoIPController.h"
 #include "../../tools/Buffers.h"
@@ -93,119 +98,278 @@ void NetworkSocketPosix::Send(NetworkPacket &&packet)
 	if (protocol == NetworkProtocol::UDP)
 	{
 		sockaddr_in6 addr;
-		if (!packet.address.isIPv6)
+		PrepareDestinationAddress(packet, addr);
+		std::lock_guard<std::mutex> lock(m_fd);
+		res = (int)sendto(fd, **packet.data, packet.data->Length(), 0, (const sockaddr *)&addr, sizeof(addr));
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_fd);
+		res = (int)send(fd, **packet.data, packet.data->Length(), 0);
+	}
+	if (res <= 0)
+	{
+		HandleSendError(std::move(packet));
+	}
+	else if ((size_t)res != packet.data->Length() && packet.protocol == NetworkProtocol::TCP)
+	{
+		if (!pendingOutgoingPacket.IsEmpty())
 		{
-			if (needUpdateNat64Prefix && !isV4Available && VoIPController::GetCurrentTime() > switchToV6at && switchToV6at != 0)
+			LOGE("send returned less than packet length but there's already a pending packet");
+			failed = true;
+		}
+		else
+		{
+			LOGV("Socket %d not ready to send", (int)fd);
+			pendingOutgoingPacket = std::move(packet);
+			readyToSend = false;
+		}
+	}
+}
+
+void NetworkSocketPosix::PrepareDestinationAddress(const NetworkPacket &packet, sockaddr_in6 &addr)
+{
+	if (!packet.address.isIPv6)
+	{
+		if (needUpdateNat64Prefix && !isV4Available && VoIPController::GetCurrentTime() > switchToV6at && switchToV6at != 0)
+		{
+			LOGV("Updating NAT64 prefix");
+			nat64Present = false;
+			addrinfo *addr0;
+			int res = getaddrinfo("ipv4only.arpa", NULL, NULL, &addr0);
+			if (res != 0)
 			{
-				LOGV("Updating NAT64 prefix");
-				nat64Present = false;
-				addrinfo *addr0;
-				int res = getaddrinfo("ipv4only.arpa", NULL, NULL, &addr0);
-				if (res != 0)
-				{
-					LOGW("Error updating NAT64 prefix: %d / %s", res, gai_strerror(res));
-				}
-				else
+				LOGW("Error updating NAT64 prefix: %d / %s", res, gai_strerror(res));
+			}
+			else
+			{
+				addrinfo *addrPtr;
+				unsigned char *addr170 = NULL;
+				unsigned char *addr171 = NULL;
+				for (addrPtr = addr0; addrPtr; addrPtr = addrPtr->ai_next)
 				{
-					addrinfo *addrPtr;
-					unsigned char *addr170 = NULL;
-					unsigned char *addr171 = NULL;
-					for (addrPtr = addr0; addrPtr; addrPtr = addrPtr->ai_next)
+					if (addrPtr->ai_family == AF_INET6)
 					{
-						if (addrPtr->ai_family == AF_INET6)
+						sockaddr_in6 *translatedAddr = (sockaddr_in6 *)addrPtr->ai_addr;
+						uint32_t v4part = *((uint32_t *)&translatedAddr->sin6_addr.s6_addr[12]);
+						if (v4part == 0xAA0000C0 && !addr170)
 						{
-							sockaddr_in6 *translatedAddr = (sockaddr_in6 *)addrPtr->ai_addr;
-							uint32_t v4part = *((uint32_t *)&translatedAddr->sin6_addr.s6_addr[12]);
-							if (v4part == 0xAA0000C0 && !addr170)
-							{
-								addr170 = translatedAddr->sin6_addr.s6_addr;
-							}
-							if (v4part == 0xAB0000C0 && !addr171)
-							{
-								addr171 = translatedAddr->sin6_addr.s6_addr;
-							}
-							char buf[INET6_ADDRSTRLEN];
-							LOGV("Got translated address: %s", inet_ntop(AF_INET6, &translatedAddr->sin6_addr, buf, sizeof(buf)));
+							addr170 = translatedAddr->sin6_addr.s6_addr;
+						}
+						if (v4part == 0xAB0000C0 && !addr171)
+						{
+							addr171 = translatedAddr->sin6_addr.s6_addr;
 						}
-					}
-					if (addr170 && addr171 && memcmp(addr170, addr171, 12) == 0)
-					{
-						nat64Present = true;
-						memcpy(nat64Prefix, addr170, 12);
 						char buf[INET6_ADDRSTRLEN];
-						LOGV("Found nat64 prefix from %s", inet_ntop(AF_INET6, addr170, buf, sizeof(buf)));
-					}
-					else
-					{
-						LOGV("Didn't find nat64");
+						LOGV("Got translated address: %s", inet_ntop(AF_INET6, &translatedAddr->sin6_addr, buf, sizeof(buf)));
 					}
-					freeaddrinfo(addr0);
 				}
-				needUpdateNat64Prefix = false;
+				if (addr170 && addr171 && memcmp(addr170, addr171, 12) == 0)
+				{
+					nat64Present = true;
+					memcpy(nat64Prefix, addr170, 12);
+					char buf[INET6_ADDRSTRLEN];
+					LOGV("Found nat64 prefix from %s", inet_ntop(AF_INET6, addr170, buf, sizeof(buf)));
+				}
+				else
+				{
+					LOGV("Didn't find nat64");
+				}
+				freeaddrinfo(addr0);
 			}
-			memset(&addr, 0, sizeof(sockaddr_in6));
-			addr.sin6_family = AF_INET6;
-			*((uint32_t *)&addr.sin6_addr.s6_addr[12]) = packet.address.addr.ipv4;
-			if (nat64Present)
-				memcpy(addr.sin6_addr.s6_addr, nat64Prefix, 12);
-			else
-				addr.sin6_addr.s6_addr[11] = addr.sin6_addr.s6_addr[10] = 0xFF;
+			needUpdateNat64Prefix = false;
 		}
+		memset(&addr, 0, sizeof(sockaddr_in6));
+		addr.sin6_family = AF_INET6;
+		*((uint32_t *)&addr.sin6_addr.s6_addr[12]) = packet.address.addr.ipv4;
+		if (nat64Present)
+			memcpy(addr.sin6_addr.s6_addr, nat64Prefix, 12);
 		else
+			addr.sin6_addr.s6_addr[11] = addr.sin6_addr.s6_addr[10] = 0xFF;
+	}
+	else
+	{
+		memcpy(addr.sin6_addr.s6_addr, packet.address.addr.ipv6, 16);
+		addr.sin6_family = AF_INET6;
+	}
+	addr.sin6_port = htons(packet.port);
+}
+
+void NetworkSocketPosix::HandleSendError(NetworkPacket &&packet)
+{
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	{
+		if (!pendingOutgoingPacket.IsEmpty())
 		{
-			memcpy(addr.sin6_addr.s6_addr, packet.address.addr.ipv6, 16);
-			addr.sin6_family = AF_INET6;
+			LOGE("Got EAGAIN but there's already a pending packet");
+			failed = true;
+		}
+		else
+		{
+			LOGV("Socket %d not ready to send", (int)fd);
+			pendingOutgoingPacket = std::move(packet);
+			readyToSend = false;
 		}
-		addr.sin6_port = htons(packet.port);
-		std::lock_guard<std::mutex> lock(m_fd);
-		res = (int)sendto(fd, **packet.data, packet.data->Length(), 0, (const sockaddr *)&addr, sizeof(addr));
 	}
 	else
 	{
-		std::lock_guard<std::mutex> lock(m_fd);
-		res = (int)send(fd, **packet.data, packet.data->Length(), 0);
+		droppedPackets.fetch_add(1, std::memory_order_relaxed);
+		LOGE("error sending: %d / %s", errno, strerror(errno));
+		if (errno == ENETUNREACH && !isV4Available && VoIPController::GetCurrentTime() < switchToV6at)
+		{
+			switchToV6at = VoIPController::GetCurrentTime();
+			LOGI("Network unreachable, trying NAT64");
+		}
 	}
-	if (res <= 0)
+}
+
+void NetworkSocketPosix::SendBatch(std::vector<NetworkPacket> &packets)
+{
+#ifdef __linux__
+	if (protocol != NetworkProtocol::UDP)
 	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		NetworkSocket::SendBatch(packets);
+		return;
+	}
+
+	auto isNull = [](NetworkPacket &packet) {
+		if (packet.IsEmpty() || packet.port == 0)
 		{
-			if (!pendingOutgoingPacket.IsEmpty())
+			LOGW("tried to send null packet");
+			return true;
+		}
+		return false;
+	};
+	packets.erase(std::remove_if(packets.begin(), packets.end(), isNull), packets.end());
+
+	constexpr size_t maxBatch = 64;
+	mmsghdr msgs[maxBatch];
+	iovec iovecs[maxBatch];
+	sockaddr_in6 dstAddrs[maxBatch];
+	SegmentControlBuffer controls[maxBatch];
+	// Index of the first packet of each message within the current round, plus one past the end
+	size_t firstPackets[maxBatch + 1];
+	for (size_t offset = 0; offset < packets.size();)
+	{
+		size_t packetCount = std::min(maxBatch, packets.size() - offset);
+		size_t msgCount = 0;
+		memset(msgs, 0, sizeof(mmsghdr) * packetCount);
+		for (size_t i = 0; i < packetCount;)
+		{
+			size_t segmentCount = gsoEnabled ? CountSegments(packets, offset + i, packetCount - i) : 1;
+			NetworkPacket &packet = packets[offset + i];
+			PrepareDestinationAddress(packet, dstAddrs[msgCount]);
+			for (size_t j = 0; j < segmentCount; j++)
 			{
-				LOGE("Got EAGAIN but there's already a pending packet");
-				failed = true;
+				iovecs[i + j].iov_base = **packets[offset + i + j].data;
+				iovecs[i + j].iov_len = packets[offset + i + j].data->Length();
 			}
-			else
+			msghdr &hdr = msgs[msgCount].msg_hdr;
+			hdr.msg_iov = &iovecs[i];
+			hdr.msg_iovlen = segmentCount;
+			hdr.msg_name = &dstAddrs[msgCount];
+			hdr.msg_namelen = sizeof(sockaddr_in6);
+#ifdef UDP_SEGMENT
+			if (segmentCount > 1)
 			{
-				LOGV("Socket %d not ready to send", (int)fd);
-				pendingOutgoingPacket = std::move(packet);
-				readyToSend = false;
+				// The kernel splits the concatenated payload back into datagrams of this size, the last one may be shorter
+				hdr.msg_control = &controls[msgCount];
+				hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t segmentSize = (uint16_t)packet.data->Length();
+				memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
 			}
+#endif
+			firstPackets[msgCount++] = i;
+			i += segmentCount;
 		}
-		else
+		firstPackets[msgCount] = packetCount;
+
+		size_t sent = 0;
+		while (sent < msgCount)
 		{
-			LOGE("error sending: %d / %s", errno, strerror(errno));
-			if (errno == ENETUNREACH && !isV4Available && VoIPController::GetCurrentTime() < switchToV6at)
+			int res;
+			{
+				std::lock_guard<std::mutex> lock(m_fd);
+				res = sendmmsg(fd, msgs + sent, (unsigned int)(msgCount - sent), 0);
+			}
+			if (res > 0)
 			{
-				switchToV6at = VoIPController::GetCurrentTime();
-				LOGI("Network unreachable, trying NAT64");
+				sent += (size_t)res;
+				continue;
+			}
+			size_t failedPacket = offset + firstPackets[sent];
+			if (firstPackets[sent + 1] - firstPackets[sent] > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+			{
+				// EIO means the outgoing device can't checksum the segments, send them one by one from now on
+				LOGW("UDP segmentation offload failed: %d / %s, disabling", errno, strerror(errno));
+				gsoEnabled = false;
+				break;
 			}
+			// sendmmsg only reports the error for the first message it couldn't send
+			int err = errno;
+			bool wouldBlock = err == EAGAIN || err == EWOULDBLOCK;
+			if (wouldBlock)
+			{
+				HandleSendError(std::move(packets[failedPacket]));
+				size_t dropped = packets.size() - failedPacket - 1;
+				if (dropped)
+				{
+					droppedPackets.fetch_add(dropped, std::memory_order_relaxed);
+					LOGW("Socket %d not ready to send, dropping %u packets", (int)fd, (unsigned int)dropped);
+				}
+				packets.clear();
+				return;
+			}
+			// Every segment coalesced into the failed message is lost with it
+			for (size_t i = firstPackets[sent]; i < firstPackets[sent + 1]; i++)
+			{
+				errno = err;
+				HandleSendError(std::move(packets[offset + i]));
+			}
+			sent++;
 		}
+		offset += firstPackets[sent];
 	}
-	else if ((size_t)res != packet.data->Length() && packet.protocol == NetworkProtocol::TCP)
+	packets.clear();
+#else
+	NetworkSocket::SendBatch(packets);
+#endif
+}
+
+#ifdef __linux__
+size_t NetworkSocketPosix::CountSegments(std::vector<NetworkPacket> &packets, size_t start, size_t max)
+{
+#ifdef UDP_SEGMENT
+	// Limits of the kernel's UDP GSO implementation
+	constexpr size_t maxSegments = 64;
+	constexpr size_t maxTotalLength = 65000;
+	const NetworkPacket &first = packets[start];
+	size_t segmentSize = first.data->Length();
+	if (segmentSize == 0)
+		return 1;
+	size_t count = 1;
+	size_t totalLength = segmentSize;
+	while (count < max && count < maxSegments)
 	{
-		if (!pendingOutgoingPacket.IsEmpty())
-		{
-			LOGE("send returned less than packet length but there's already a pending packet");
-			failed = true;
-		}
-		else
-		{
-			LOGV("Socket %d not ready to send", (int)fd);
-			pendingOutgoingPacket = std::move(packet);
-			readyToSend = false;
-		}
+		const NetworkPacket &next = packets[start + count];
+		size_t len = next.data->Length();
+		if (!(next.address == first.address) || next.port != first.port || len == 0 || len > segmentSize || totalLength + len > maxTotalLength)
+			break;
+		count++;
+		totalLength += len;
+		if (len < segmentSize)
+			break;
 	}
+	return count;
+#else
+	return 1;
+#endif
 }
+#endif
 
 bool NetworkSocketPosix::OnReadyToSend()
 {
@@ -229,33 +393,46 @@ NetworkPacket NetworkSocketPosix::Receive(size_t maxLen)
 	}
 	if (protocol == NetworkProtocol::UDP)
 	{
-		int addrLen = sizeof(sockaddr_in6);
 		sockaddr_in6 srcAddr;
-		ssize_t len = recvfrom(fd, *recvBuffer, std::min(recvBuffer.Length(), maxLen), 0, (sockaddr *)&srcAddr, (socklen_t *)&addrLen);
+		iovec iov;
+		// Receive straight into a pooled buffer when there's one to spare
+		std::shared_ptr<Buffer> buf = recvBufferPool->Get(std::min(recvBuffer.Length(), maxLen));
+		if (buf)
+		{
+			iov.iov_base = **buf;
+			iov.iov_len = buf->Length();
+		}
+		else
+		{
+			iov.iov_base = *recvBuffer;
+			iov.iov_len = std::min(recvBuffer.Length(), maxLen);
+		}
+		RecvControlBuffer control;
+		msghdr msg = {0};
+		msg.msg_name = &srcAddr;
+		msg.msg_namelen = sizeof(sockaddr_in6);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t len = recvmsg(fd, &msg, 0);
 		if (len > 0)
 		{
-			if (!isV4Available && IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr))
-			{
-				isV4Available = true;
-				LOGI("Detected IPv4 connectivity, will not try IPv6");
-			}
-			NetworkAddress addr = NetworkAddress::Empty();
-			if (IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr) || (nat64Present && memcmp(nat64Prefix, srcAddr.sin6_addr.s6_addr, 12) == 0))
+			if (buf)
 			{
-				in_addr v4addr = *((in_addr *)&srcAddr.sin6_addr.s6_addr[12]);
-				addr = NetworkAddress::IPv4(v4addr.s_addr);
+				buf->Resize(len);
 			}
 			else
 			{
-				addr = NetworkAddress::IPv6(srcAddr.sin6_addr.s6_addr);
+				buf = std::make_shared<Buffer>(len);
+				buf->CopyFromOtherBuffer(recvBuffer, len);
 			}
-			auto buf = std::make_shared<Buffer>(len);
-			buf->CopyFromOtherBuffer(recvBuffer, len);
 			return NetworkPacket{
 				std::move(buf),
-				addr,
+				AddressFromSockaddr(srcAddr),
 				ntohs(srcAddr.sin6_port),
-				NetworkProtocol::UDP};
+				NetworkProtocol::UDP,
+				GetReceiveTime(msg)};
 		}
 		else
 		{
@@ -281,16 +458,138 @@ NetworkPacket NetworkSocketPosix::Receive(size_t maxLen)
 				std::move(buf),
 				tcpConnectedAddress,
 				tcpConnectedPort,
-				NetworkProtocol::TCP};
+				NetworkProtocol::TCP,
+				VoIPController::GetCurrentTime()};
 		}
 	}
 	return NetworkPacket::Empty();
 }
 
+size_t NetworkSocketPosix::ReceiveBatch(std::vector<NetworkPacket> &packets, size_t max)
+{
+#ifdef __linux__
+	if (protocol != NetworkProtocol::UDP || failed)
+		return NetworkSocket::ReceiveBatch(packets, max);
+
+	constexpr size_t maxBatch = 32;
+	constexpr size_t slotSize = 2048;
+	if (max > maxBatch)
+		max = maxBatch;
+	if (max == 0)
+		return 0;
+	if (recvBatchBuffer.IsEmpty())
+		recvBatchBuffer = Buffer(maxBatch * slotSize);
+
+	mmsghdr msgs[maxBatch];
+	iovec iovecs[maxBatch];
+	sockaddr_in6 srcAddrs[maxBatch];
+	RecvControlBuffer controls[maxBatch];
+	// Datagrams land directly in pooled buffers, the batch buffer only backs slots the pool couldn't fill.
+	// Whatever isn't used goes back to the pool when this array goes out of scope.
+	std::shared_ptr<Buffer> slotBuffers[maxBatch];
+	memset(msgs, 0, sizeof(mmsghdr) * max);
+	for (size_t i = 0; i < max; i++)
+	{
+		slotBuffers[i] = recvBufferPool->Get(slotSize);
+		iovecs[i].iov_base = slotBuffers[i] ? **slotBuffers[i] : *recvBatchBuffer + i * slotSize;
+		iovecs[i].iov_len = slotSize;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &srcAddrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+		msgs[i].msg_hdr.msg_control = &controls[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(RecvControlBuffer);
+	}
+
+	int count = recvmmsg(fd, msgs, (unsigned int)max, MSG_DONTWAIT, NULL);
+	if (count < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			LOGE("error receiving %d / %s", errno, strerror(errno));
+		return 0;
+	}
+
+	size_t received = 0;
+	for (int i = 0; i < count; i++)
+	{
+		// Empty datagrams are passed on as well so that the caller can tell whether the batch was full
+		size_t len = msgs[i].msg_len;
+		std::shared_ptr<Buffer> buf = std::move(slotBuffers[i]);
+		if (buf)
+		{
+			buf->Resize(len);
+		}
+		else
+		{
+			buf = std::make_shared<Buffer>(len);
+			buf->CopyFromOtherBuffer(recvBatchBuffer, len, i * slotSize);
+		}
+		packets.push_back(NetworkPacket{
+			std::move(buf),
+			AddressFromSockaddr(srcAddrs[i]),
+			ntohs(srcAddrs[i].sin6_port),
+			NetworkProtocol::UDP,
+			GetReceiveTime(msgs[i].msg_hdr)});
+		received++;
+	}
+	return received;
+#else
+	return NetworkSocket::ReceiveBatch(packets, max);
+#endif
+}
+
+std::shared_ptr<Buffer> NetworkSocketPosix::GetReceiveBuffer(size_t length)
+{
+	std::shared_ptr<Buffer> buf = recvBufferPool->Get(length);
+	if (!buf)
+		buf = std::make_shared<Buffer>(length);
+	return buf;
+}
+
+double NetworkSocketPosix::GetReceiveTime(msghdr &msg)
+{
+	double now = VoIPController::GetCurrentTime();
+#ifdef SO_TIMESTAMPNS
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+		// The kernel timestamp is in CLOCK_REALTIME, translate it by how long ago it was taken
+		timespec kernelTime;
+		memcpy(&kernelTime, CMSG_DATA(cmsg), sizeof(timespec));
+		timespec realNow;
+		clock_gettime(CLOCK_REALTIME, &realNow);
+		double age = (double)(realNow.tv_sec - kernelTime.tv_sec) + (double)(realNow.tv_nsec - kernelTime.tv_nsec) / 1000000000.0;
+		// Wall clock jumped, don't trust it
+		if (age < 0.0 || age > 1.0)
+			return now;
+		return now - age;
+	}
+#endif
+	return now;
+}
+
+NetworkAddress NetworkSocketPosix::AddressFromSockaddr(const sockaddr_in6 &srcAddr)
+{
+	if (!isV4Available && IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr))
+	{
+		isV4Available = true;
+		LOGI("Detected IPv4 connectivity, will not try IPv6");
+	}
+	if (IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr) || (nat64Present && memcmp(nat64Prefix, srcAddr.sin6_addr.s6_addr, 12) == 0))
+	{
+		in_addr v4addr = *((in_addr *)&srcAddr.sin6_addr.s6_addr[12]);
+		return NetworkAddress::IPv4(v4addr.s_addr);
+	}
+	return NetworkAddress::IPv6(srcAddr.sin6_addr.s6_addr);
+}
+
 void NetworkSocketPosix::Open()
 {
 	if (protocol != NetworkProtocol::UDP)
 		return;
+	if (!recvBufferPool)
+		recvBufferPool.reset(new SharedBufferPool<2048, 128>());
 	fd = socket(PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
 	if (fd < 0)
 	{
@@ -308,6 +607,22 @@ void NetworkSocketPosix::Open()
 	}
 
 	SetMaxPriority();
+#ifdef SO_TIMESTAMPNS
+	flag = 1;
+	res = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &flag, sizeof(flag));
+	if (res < 0)
+	{
+		LOGW("error enabling receive timestamps: %d / %s", errno, strerror(errno));
+	}
+#endif
+#if defined(__linux__) && defined(UDP_SEGMENT)
+	// Probe for UDP GSO (Linux 4.18+), SendBatch falls back to one datagram per packet without it
+	int gsoSize = 0;
+	socklen_t gsoSizeLen = sizeof(gsoSize);
+	gsoEnabled = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &gsoSize, &gsoSizeLen) == 0;
+	if (gsoEnabled)
+		LOGD("UDP segmentation offload is available");
+#endif
 	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
 	{
 		LOGE("error setting nonblock flag on socket: %d / %s", errno, strerror(errno));
@@ -765,11 +1080,177 @@ void SocketSelectCancellerPosix::CancelSelect()
 	(void)write(pipeWrite, &c, 1);
 }
 
+#ifdef __linux__
+SocketReactorEpoll::SocketReactorEpoll(const std::unique_ptr<SocketSelectCanceller> &canceller) : SocketReactor(canceller)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+	{
+		LOGE("error creating epoll instance: %d / %s", errno, strerror(errno));
+		return;
+	}
+	SocketSelectCancellerPosix *c = dynamic_cast<SocketSelectCancellerPosix *>(canceller.get());
+	if (c)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = c->pipeRead;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->pipeRead, &ev) < 0)
+		{
+			LOGE("error adding canceller to epoll: %d / %s", errno, strerror(errno));
+			close(epfd);
+			epfd = -1;
+		}
+	}
+}
+
+SocketReactorEpoll::~SocketReactorEpoll()
+{
+	if (epfd >= 0)
+		close(epfd);
+}
+
+bool SocketReactorEpoll::IsFailed()
+{
+	return epfd < 0;
+}
+
+void SocketReactorEpoll::OnEntryAdded(Entry &entry)
+{
+	entry.fd = NetworkSocketPosix::GetDescriptorFromSocket(entry.transport);
+	if (entry.fd <= 0)
+	{
+		entry.fd = -1;
+		return;
+	}
+	// UDP sockets are drained with recvmmsg until EAGAIN, so they only need to be woken up on new data.
+	// Everything else (TCP, proxies) consumes one packet per Receive() and stays level-triggered.
+	entry.edgeTriggered = dynamic_cast<NetworkSocketPosix *>(entry.socket.get()) && entry.socket->protocol == NetworkProtocol::UDP;
+	entry.writeArmed = NeedWriteReadiness(entry);
+	UpdateRegistration(entry, EPOLL_CTL_ADD);
+}
+
+void SocketReactorEpoll::OnEntryRemoved(Entry &entry)
+{
+	// A closed descriptor is removed from the epoll set by the kernel, and its number may have been reused since
+	if (entry.fd > 0 && NetworkSocketPosix::GetDescriptorFromSocket(entry.transport) == entry.fd)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, entry.fd, NULL);
+}
+
+void SocketReactorEpoll::UpdateRegistration(Entry &entry, int op)
+{
+	epoll_event ev = {};
+	ev.events = EPOLLIN | (entry.writeArmed ? EPOLLOUT : 0) | (entry.edgeTriggered ? EPOLLET : 0);
+	ev.data.fd = entry.fd;
+	if (epoll_ctl(epfd, op, entry.fd, &ev) < 0)
+	{
+		LOGE("error updating epoll registration for socket %d: %d / %s", entry.fd, errno, strerror(errno));
+	}
+}
+
+bool SocketReactorEpoll::Wait(std::vector<std::shared_ptr<NetworkSocket>> &readFds, std::vector<std::shared_ptr<NetworkSocket>> &writeFds, std::vector<std::shared_ptr<NetworkSocket>> &errorFds)
+{
+	readFds.clear();
+	writeFds.clear();
+	errorFds.clear();
+
+	for (Entry &e : entries)
+	{
+		CheckTimedOut(e.transport.get());
+		if (e.transport->IsFailed())
+		{
+			errorFds.push_back(e.transport);
+			continue;
+		}
+		if (e.fd < 0)
+			continue;
+		bool needWrite = NeedWriteReadiness(e);
+		if (needWrite != e.writeArmed)
+		{
+			e.writeArmed = needWrite;
+			UpdateRegistration(e, EPOLL_CTL_MOD);
+		}
+	}
+	if (!errorFds.empty())
+	{
+		LOGE("Select failed, zeroing out");
+		return true;
+	}
+
+	epoll_event events[16];
+	int count = epoll_wait(epfd, events, sizeof(events) / sizeof(epoll_event), -1);
+	if (count < 0)
+	{
+		if (errno != EINTR)
+			LOGE("epoll_wait failed: %d / %s", errno, strerror(errno));
+		return false;
+	}
+
+	SocketSelectCancellerPosix *c = dynamic_cast<SocketSelectCancellerPosix *>(canceller.get());
+	bool cancelled = false;
+	for (int i = 0; i < count; i++)
+	{
+		if (c && events[i].data.fd == c->pipeRead)
+		{
+			char b;
+			(void)read(c->pipeRead, &b, 1);
+			cancelled = true;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		int fd = events[i].data.fd;
+		uint32_t ev = events[i].events;
+		auto e = std::find_if(entries.begin(), entries.end(), [fd](const Entry &entry) { return entry.fd == fd; });
+		if (e == entries.end())
+			continue;
+		if (cancelled)
+		{
+			// The caller won't look at this round, re-arm so that the edge isn't lost
+			if (e->edgeTriggered)
+				UpdateRegistration(*e, EPOLL_CTL_MOD);
+			continue;
+		}
+		if (ev & (EPOLLERR | EPOLLHUP))
+		{
+			if (e->transport->protocol != NetworkProtocol::UDP)
+			{
+				errorFds.push_back(e->transport);
+				continue;
+			}
+			// ICMP errors are reported on UDP sockets too, clear them and carry on
+			int err = 0;
+			socklen_t errLen = sizeof(err);
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+			LOGW("UDP socket %d error: %d / %s", fd, err, strerror(err));
+		}
+		if (ev & EPOLLIN)
+		{
+			SetLastSuccessfulOperationTime(e->socket.get());
+			if (e->socket->OnReadyToReceive())
+				readFds.push_back(e->socket);
+		}
+		if ((ev & EPOLLOUT) && e->writeArmed)
+		{
+			LOGV("Socket %d is ready to send", fd);
+			SetLastSuccessfulOperationTime(e->transport.get());
+			if (e->transport->OnReadyToSend())
+				writeFds.push_back(e->transport);
+		}
+	}
+	if (cancelled)
+		return false;
+
+	return readFds.size() > 0 || errorFds.size() > 0 || writeFds.size() > 0;
+}
+#endif
+
 int NetworkSocketPosix::GetDescriptorFromSocket(NetworkSocket *socket)
 {
 	NetworkSocketPosix *sp = dynamic_cast<NetworkSocketPosix *>(socket);
 	if (sp)
-		return sp->fd;
+		return sp->GetPollDescriptor();
 	NetworkSocketWrapper *sw = dynamic_cast<NetworkSocketWrapper *>(socket);
 	if (sw)
 		return GetDescriptorFromSocket(sw->GetWrapped());
@@ -12,6 +12,9 @@
 #include <vector>
 #include <mutex>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <netinet/in.h>
 #include <pthread.h>
 
 namespace tgvoip
@@ -20,6 +23,7 @@ namespace tgvoip
 class SocketSelectCancellerPosix : public SocketSelectCanceller
 {
 	friend class NetworkSocketPosix;
+	friend class SocketReactorEpoll;
 
 public:
 	SocketSelectCancellerPosix();
@@ -33,11 +37,15 @@ private:
 
 class NetworkSocketPosix : public NetworkSocket
 {
+	friend class SocketReactorEpoll;
+
 public:
 	NetworkSocketPosix(NetworkProtocol protocol);
 	virtual ~NetworkSocketPosix() override;
 	virtual void Send(NetworkPacket &&packet) override;
+	virtual void SendBatch(std::vector<NetworkPacket> &packets) override;
 	virtual NetworkPacket Receive(size_t maxLen) override;
+	virtual size_t ReceiveBatch(std::vector<NetworkPacket> &packets, size_t max) override;
 	virtual void Open() override;
 	virtual void Close() override;
 	virtual void Connect(const NetworkAddress address, uint16_t port) override;
@@ -61,11 +69,39 @@ public:
 
 protected:
 	virtual void SetMaxPriority() override;
+	// The descriptor to wait on for readiness
+	virtual int GetPollDescriptor()
+	{
+		return fd;
+	}
+
+	// Room for the SCM_TIMESTAMPNS control message
+	union RecvControlBuffer {
+		char buf[CMSG_SPACE(sizeof(timespec))];
+		cmsghdr align;
+	};
+
+	NetworkAddress AddressFromSockaddr(const sockaddr_in6 &srcAddr);
+	static double GetReceiveTime(msghdr &msg);
+	void PrepareDestinationAddress(const NetworkPacket &packet, sockaddr_in6 &addr);
+	void HandleSendError(NetworkPacket &&packet);
+	// A recycled buffer for a received packet, only falls back to allocating when the pool is exhausted
+	std::shared_ptr<Buffer> GetReceiveBuffer(size_t length);
+	std::atomic<int> fd;
 
 private:
+	// Room for the UDP_SEGMENT control message
+	union SegmentControlBuffer {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		cmsghdr align;
+	};
+
 	static int GetDescriptorFromSocket(NetworkSocket *socket);
 	static int GetDescriptorFromSocket(const std::shared_ptr<NetworkSocket> &socket);
-	std::atomic<int> fd;
+#ifdef __linux__
+	// How many packets starting at start can go out as one UDP GSO send
+	static size_t CountSegments(std::vector<NetworkPacket> &packets, size_t start, size_t max);
+#endif
 	std::mutex m_fd;
 	bool needUpdateNat64Prefix;
 	bool nat64Present;
@@ -76,7 +112,32 @@ private:
 	uint16_t tcpConnectedPort;
 	NetworkPacket pendingOutgoingPacket = NetworkPacket::Empty();
 	Buffer recvBuffer = Buffer(2048);
+	// Created by Open() for UDP sockets, only used by the receiving thread after that
+	std::unique_ptr<SharedBufferPool<2048, 128>> recvBufferPool;
+#ifdef __linux__
+	Buffer recvBatchBuffer = Buffer(0);
+	bool gsoEnabled = false;
+#endif
+};
+
+#ifdef __linux__
+class SocketReactorEpoll : public SocketReactor
+{
+public:
+	SocketReactorEpoll(const std::unique_ptr<SocketSelectCanceller> &canceller);
+	virtual ~SocketReactorEpoll() override;
+	virtual bool Wait(std::vector<std::shared_ptr<NetworkSocket>> &readFds, std::vector<std::shared_ptr<NetworkSocket>> &writeFds, std::vector<std::shared_ptr<NetworkSocket>> &errorFds) override;
+	bool IsFailed();
+
+protected:
+	virtual void OnEntryAdded(Entry &entry) override;
+	virtual void OnEntryRemoved(Entry &entry) override;
+
+private:
+	void UpdateRegistration(Entry &entry, int op);
+	int epfd;
 };
+#endif
 
 } // namespace tgvoip
 
@@ -0,0 +1,97 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#import <XCTest/XCTest.h>
+
+#include "../tools/MessageThread.h"
+#include <atomic>
+#include <functional>
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+// Replacing operator new and delete affects the whole test bundle, so it lives next to the one test that needs it
+// rather than in the shared test file. Nothing is counted unless a thread opts in.
+
+@interface MessageThreadTests : XCTestCase
+
+@end
+
+using namespace tgvoip;
+
+static std::atomic<unsigned int> allocationCount{0};
+static thread_local bool countAllocations=false;
+
+void* operator new(size_t size){
+	if(countAllocations)
+		allocationCount++;
+	void* ptr=malloc(size ? size : 1);
+	if(!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept{
+	free(ptr);
+}
+
+struct SimulatedCall{
+	MessageThread thread;
+	std::atomic<unsigned int> ticks{0};
+	std::atomic<unsigned int> packets{0};
+	void Tick(){
+		ticks++;
+	}
+	void ProcessIncomingNetworkPackets(){
+		packets++;
+	}
+};
+
+@implementation MessageThreadTests
+
+- (void)testMessageThreadPostDoesntAllocate{
+	// One minute of a call at 20x speed: the controller's periodic timers plus 50 packets per second,
+	// each of which posts the packet processing and a delayed reliable packet check
+	const double timeScale=1.0/20.0;
+	SimulatedCall call;
+	// The slot table grows once it's half full. Grow it now, way past what the call keeps queued at once,
+	// so that how fast the message thread keeps up can't make it grow while allocations are counted.
+	std::vector<uint32_t> warmup;
+	for(int i=0;i<256;i++)
+		warmup.push_back(call.thread.Post([]{}, 3600.0));
+	for(uint32_t id:warmup)
+		call.thread.Cancel(id);
+	call.thread.Start();
+	call.thread.Post([]{
+		countAllocations=true;
+	});
+	call.thread.Post(std::bind(&SimulatedCall::Tick, &call), 0.1*timeScale, 0.5*timeScale);
+	call.thread.Post(std::bind(&SimulatedCall::Tick, &call), 0.0, 0.3*timeScale);
+	call.thread.Post(std::bind(&SimulatedCall::Tick, &call), 0.0, 1.0*timeScale);
+	call.thread.Post(std::bind(&SimulatedCall::Tick, &call), 1.0*timeScale, 1.0*timeScale);
+	call.thread.Post(std::bind(&SimulatedCall::Tick, &call), 0.0, 0.1*timeScale);
+	countAllocations=true;
+	SimulatedCall* simulatedCall=&call;
+	for(unsigned int i=0;i<60*50;i++){
+		call.thread.Post(std::bind(&SimulatedCall::ProcessIncomingNetworkPackets, simulatedCall));
+		call.thread.Post([simulatedCall, i]{
+			if(i%2)
+				simulatedCall->Tick();
+		}, 0.2*timeScale);
+		Thread::Sleep(0.02*timeScale);
+	}
+	countAllocations=false;
+	Thread::Sleep(0.1);
+	call.thread.Post([]{
+		countAllocations=false;
+	});
+	call.thread.Stop();
+	XCTAssertEqual(call.packets.load(), 60u*50u);
+	XCTAssertGreaterThan(call.ticks.load(), 0u);
+	XCTAssertEqual(allocationCount.load(), 0u);
+}
+
+@end
@@ -8,7 +8,16 @@
 
 #import "MockReflector.h"
 #include "../VoIPController.h"
+#include "../controller/net/DelayGradientEstimator.h"
+#include "../controller/net/RackLossDetector.h"
+#include "../controller/protocol/packets/PacketManager.h"
+#include "../controller/protocol/protocol/Extra.h"
+#include "../tools/CryptoWorkerPool.h"
+#include "../tools/HardwareCrypto.h"
 #include <openssl/rand.h>
+#include <algorithm>
+#include <set>
+#include <thread>
 #include "../webrtc_dsp/common_audio/wav_file.h"
 
 @interface libtgvoipTests : XCTestCase
@@ -17,6 +26,43 @@
 
 using namespace tgvoip;
 
+static std::vector<uint8_t> HexToBytes(const char* hex){
+	std::vector<uint8_t> bytes;
+	for(size_t i=0;hex[i] && hex[i+1];i+=2){
+		unsigned int byte;
+		sscanf(hex+i, "%2x", &byte);
+		bytes.push_back((uint8_t)byte);
+	}
+	return bytes;
+}
+
+// Plays a scripted one-way delay trace through the estimator: a 20 ms packet every tick,
+// acked 30 ms after it arrives, with the peer's clock far off ours and about to wrap
+struct DelayTraceResult{
+	uint32_t bitrateAtRampStart=0;
+	uint32_t finalBitrate=0;
+	unsigned int overuseSamples=0;
+};
+
+static DelayTraceResult RunDelayTrace(const std::function<double(double)>& delay, double duration, double rampStart){
+	DelayGradientEstimator estimator;
+	estimator.SetBitrateLimits(8000, 100000);
+	estimator.Reset(20000);
+	DelayTraceResult result;
+	uint32_t peerClockOffset=0xFFFFF000u-3000000u;
+	for(int i=0;i*0.02<duration;i++){
+		double sendTime=i*0.02;
+		double arrivalTime=sendTime+delay(sendTime);
+		estimator.PacketAcknowledged(sendTime, peerClockOffset+(uint32_t)llround(arrivalTime*1000000.0), arrivalTime+0.03);
+		if(estimator.GetUsage()==DelayGradientEstimator::Usage::Overusing)
+			result.overuseSamples++;
+		if(i==(int)llround(rampStart/0.02))
+			result.bitrateAtRampStart=estimator.GetTargetBitrate();
+	}
+	result.finalBitrate=estimator.GetTargetBitrate();
+	return result;
+}
+
 @implementation libtgvoipTests{
 	VoIPController* controller1;
 	VoIPController* controller2;
@@ -189,4 +235,288 @@ using namespace tgvoip;
 	reflector.Stop();
 }
 
+- (void)testHardwareCryptoKnownAnswers{
+	CryptoFunctions hw=VoIPController::crypto;
+	if(!HardwareCrypto::Install(hw)){
+		NSLog(@"No AES-NI/SHA extensions on this CPU, skipping");
+		return;
+	}
+	uint8_t out[64];
+	
+	uint8_t abc[]={'a', 'b', 'c'};
+	hw.sha1(abc, sizeof(abc), out);
+	XCTAssertTrue(memcmp(out, HexToBytes("a9993e364706816aba3e25717850c26c9cd0d89d").data(), 20)==0);
+	hw.sha256(abc, sizeof(abc), out);
+	XCTAssertTrue(memcmp(out, HexToBytes("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad").data(), 32)==0);
+	
+	// 56 bytes, the padding spills into a second block
+	const char* twoBlocks="abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	hw.sha256((uint8_t*)twoBlocks, strlen(twoBlocks), out);
+	XCTAssertTrue(memcmp(out, HexToBytes("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1").data(), 32)==0);
+	alignas(16) uint8_t ctx[TGVOIP_CRYPTO_CONTEXT_SIZE];
+	hw.sha256_init(ctx);
+	hw.sha256_update(ctx, (uint8_t*)twoBlocks, 5);
+	hw.sha256_update(ctx, (uint8_t*)twoBlocks+5, strlen(twoBlocks)-5);
+	memset(out, 0, sizeof(out));
+	hw.sha256_final(ctx, out);
+	XCTAssertTrue(memcmp(out, HexToBytes("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1").data(), 32)==0);
+	
+	// NIST SP 800-38A F.5.5 and F.2.5
+	std::vector<uint8_t> key=HexToBytes("603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4");
+	std::vector<uint8_t> plaintext=HexToBytes("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710");
+	std::vector<uint8_t> counter=HexToBytes("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+	uint8_t ecount[16];
+	uint32_t num=0;
+	memcpy(out, plaintext.data(), 64);
+	// Odd chunk sizes go through the partial keystream block
+	hw.aes_ctr_encrypt(out, 7, key.data(), counter.data(), ecount, &num);
+	hw.aes_ctr_encrypt(out+7, 57, key.data(), counter.data(), ecount, &num);
+	XCTAssertTrue(memcmp(out, HexToBytes("601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c52b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6").data(), 64)==0);
+	
+	std::vector<uint8_t> iv=HexToBytes("000102030405060708090a0b0c0d0e0f");
+	hw.aes_cbc_encrypt(plaintext.data(), out, 64, key.data(), iv.data());
+	XCTAssertTrue(memcmp(out, HexToBytes("f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b").data(), 64)==0);
+	
+	// IGE has no NIST vectors, this one comes from OpenSSL's AES_ige_encrypt
+	uint8_t igeKey[32], igeIv[32], igePlaintext[64];
+	for(int i=0;i<32;i++){
+		igeKey[i]=(uint8_t)i;
+		igeIv[i]=(uint8_t)(0x20+i);
+	}
+	for(int i=0;i<64;i++)
+		igePlaintext[i]=(uint8_t)(0x40+i);
+	uint8_t ivCopy[32];
+	memcpy(ivCopy, igeIv, 32);
+	hw.aes_ige_encrypt(igePlaintext, out, 64, igeKey, ivCopy);
+	XCTAssertTrue(memcmp(out, HexToBytes("b6b23cb46d2f43de2c67fc9a3a9e35104fad6ed15177969c1cebc616bcfa482cb220e4d159bedfd570df191a805e9d9d13b6d62f0ea1e40541bd31ebe72f51c6").data(), 64)==0);
+	memcpy(ivCopy, igeIv, 32);
+	hw.aes_ige_decrypt(out, out, 64, igeKey, ivCopy);
+	XCTAssertTrue(memcmp(out, igePlaintext, 64)==0);
+}
+
+- (void)testHardwareCryptoMatchesCallbacks{
+	CryptoFunctions hw=VoIPController::crypto;
+	if(!HardwareCrypto::Install(hw)){
+		NSLog(@"No AES-NI/SHA extensions on this CPU, skipping");
+		return;
+	}
+	CryptoFunctions& sw=VoIPController::crypto;
+	uint8_t data[1504], a[1504], b[1504], key[32], iv[32], ivA[32], ivB[32], hashA[32], hashB[32];
+	for(size_t len=0;len<=sizeof(data);len+=47){
+		RAND_bytes(data, sizeof(data));
+		RAND_bytes(key, sizeof(key));
+		RAND_bytes(iv, sizeof(iv));
+		sw.sha256(data, len, hashA);
+		hw.sha256(data, len, hashB);
+		XCTAssertTrue(memcmp(hashA, hashB, 32)==0);
+		sw.sha1(data, len, hashA);
+		hw.sha1(data, len, hashB);
+		XCTAssertTrue(memcmp(hashA, hashB, 20)==0);
+		
+		size_t blocks=len & ~15;
+		memcpy(ivA, iv, 32);
+		memcpy(ivB, iv, 32);
+		sw.aes_ige_encrypt(data, a, blocks, key, ivA);
+		hw.aes_ige_encrypt(data, b, blocks, key, ivB);
+		XCTAssertTrue(memcmp(a, b, blocks)==0);
+		
+		uint8_t ecountA[16], ecountB[16];
+		uint32_t numA=0, numB=0;
+		memcpy(ivA, iv, 16);
+		memcpy(ivB, iv, 16);
+		memcpy(a, data, len);
+		memcpy(b, data, len);
+		sw.aes_ctr_encrypt(a, len, key, ivA, ecountA, &numA);
+		hw.aes_ctr_encrypt(b, len, key, ivB, ecountB, &numB);
+		XCTAssertTrue(memcmp(a, b, len)==0);
+		XCTAssertEqual(numA, numB);
+	}
+}
+
+- (void)measureCrypto:(CryptoFunctions)functions{
+	// Roughly what one second of a busy video call puts through the crypto functions, one packet at a time.
+	// Static because blocks can't capture arrays.
+	static uint8_t packets[1000][1024], key[32], iv[32], hash[32];
+	RAND_bytes(packets[0], sizeof(packets[0]));
+	RAND_bytes(key, sizeof(key));
+	RAND_bytes(iv, sizeof(iv));
+	[self measureBlock:^{
+		for(int i=0;i<1000;i++){
+			functions.sha256(packets[i], sizeof(packets[i]), hash);
+			functions.aes_ige_encrypt(packets[i], packets[i], sizeof(packets[i]), key, iv);
+		}
+	}];
+}
+
+- (void)testCallbackCryptoThroughput{
+	[self measureCrypto:VoIPController::crypto];
+}
+
+- (void)testHardwareCryptoThroughput{
+	CryptoFunctions hw=VoIPController::crypto;
+	if(!HardwareCrypto::Install(hw)){
+		NSLog(@"No AES-NI/SHA extensions on this CPU, skipping");
+		return;
+	}
+	[self measureCrypto:hw];
+}
+
+- (void)testDelayGradientHoldsOnStableDelay{
+	// 50 ms with a millisecond of jitter either way
+	DelayTraceResult result=RunDelayTrace([](double t){
+		return 0.05+((int)(t*50)%3-1)*0.001;
+	}, 10.0, 5.0);
+	XCTAssertEqual(result.overuseSamples, 0u);
+	XCTAssertGreaterThan(result.finalBitrate, 20000u);
+	XCTAssertGreaterThan(result.finalBitrate, result.bitrateAtRampStart);
+}
+
+- (void)testDelayGradientBacksOffOnGrowingQueue{
+	// Stable for 5 seconds, then the queue grows by 100 ms every second
+	DelayTraceResult result=RunDelayTrace([](double t){
+		return 0.05+(t>5.0 ? (t-5.0)*0.1 : 0.0);
+	}, 8.0, 5.0);
+	XCTAssertGreaterThan(result.bitrateAtRampStart, 20000u);
+	XCTAssertGreaterThan(result.overuseSamples, 0u);
+	XCTAssertLessThan(result.finalBitrate, result.bitrateAtRampStart/2);
+}
+
+- (void)testDelayGradientIgnoresConstantDelay{
+	// However long the path is, only a change in delay means a queue is building
+	DelayTraceResult low=RunDelayTrace([](double t){ return 0.02; }, 6.0, 3.0);
+	DelayTraceResult high=RunDelayTrace([](double t){ return 0.4; }, 6.0, 3.0);
+	XCTAssertEqual(low.finalBitrate, high.finalBitrate);
+	XCTAssertEqual(low.overuseSamples, 0u);
+}
+
+- (void)testCryptoWorkerPoolRunsEveryJobOnce{
+	CryptoWorkerPool pool(3);
+	XCTAssertEqual(pool.GetThreadCount(), 3u);
+	const size_t sizes[]={0, 1, 2, 4, 7, 100, 1000};
+	for(int round=0;round<20;round++){
+		for(size_t count:sizes){
+			std::vector<uint32_t> results(count, 0);
+			std::vector<int> calls(count, 0);
+			pool.Run(count, [&](size_t i){
+				// A slow job here and there, Run must still not return before it's done
+				if(i%97==13)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				results[i]=(uint32_t)(i*2654435761u)^(uint32_t)round;
+				calls[i]++;
+			});
+			for(size_t i=0;i<count;i++){
+				XCTAssertEqual(calls[i], 1, @"job %zu of %zu", i, count);
+				XCTAssertEqual(results[i], (uint32_t)(i*2654435761u)^(uint32_t)round);
+			}
+		}
+	}
+}
+
+- (void)testRackToleratesReorderingButNotLoss{
+	RackLossDetector rack;
+	// 1 and 2 go out 10ms apart and 2 gets there first. Until reordering is seen 1 is lost as soon as 2 is acked.
+	rack.PacketAcknowledged(0.01, 0.11, false);
+	XCTAssertEqual(rack.GetReorderWindow(), 0.0);
+	XCTAssertTrue(rack.IsLost(0.0, 0.11));
+	rack.PacketLost();
+	rack.PacketAcknowledged(0.0, 0.115, true);
+	XCTAssertEqual(rack.GetSpuriousLossCount(), 1u);
+	double window=rack.GetReorderWindow();
+	XCTAssertGreaterThan(window, 0.0);
+
+	// The same reordering again is waited out now, a packet that really went missing still isn't
+	rack.PacketAcknowledged(1.01, 1.11, false);
+	XCTAssertFalse(rack.IsLost(1.0, 1.12));
+	XCTAssertTrue(rack.IsLost(1.0, 1.11+window));
+	rack.PacketLost();
+
+	// Arriving after all makes the window grow
+	rack.PacketAcknowledged(1.0, 1.17, true);
+	XCTAssertEqual(rack.GetSpuriousLossCount(), 2u);
+	XCTAssertGreaterThan(rack.GetReorderWindow(), window);
+
+	// A packet nothing was sent after falls back to the timeout instead
+	XCTAssertFalse(rack.IsLost(1.5, 1.55));
+	XCTAssertTrue(rack.IsLost(1.5, 2.0));
+}
+
+- (void)testRackLossUndoneBySelectiveAck{
+	// 40 packets 20 ms apart, 5 is held up for longer than the ack mask reaches
+	PacketManager sender(StreamId::Audio);
+	PacketManager receiver(StreamId::Audio);
+	for(uint32_t seq=1;seq<=40;seq++){
+		if(seq!=5)
+			receiver.ackRemoteSeq(seq);
+	}
+	std::vector<uint32_t> newlyAcked;
+	sender.ackLocal(receiver.getLastRemoteSeq(), receiver.getRemoteAckMask(), newlyAcked);
+	XCTAssertEqual(newlyAcked.front(), 8u);
+	for(uint32_t seq:newlyAcked)
+		sender.lossDetector.PacketAcknowledged(seq*0.02, seq*0.02+0.1, false);
+	XCTAssertTrue(sender.lossDetector.IsLost(5*0.02, 0.9));
+	sender.lossDetector.PacketLost();
+
+	// Then it shows up, and only the selective ack can tell
+	XCTAssertTrue(receiver.ackRemoteSeq(5));
+	ExtraSelectiveAck sack;
+	receiver.getRemoteSelectiveAck(sack);
+	newlyAcked.clear();
+	sender.ackLocalSelective(sack, newlyAcked);
+	XCTAssertTrue(std::find(newlyAcked.begin(), newlyAcked.end(), 5u)!=newlyAcked.end());
+	XCTAssertTrue(sender.wasLocalAcked(5));
+	sender.lossDetector.PacketAcknowledged(5*0.02, 1.0, true);
+	XCTAssertEqual(sender.lossDetector.GetSpuriousLossCount(), 1u);
+	XCTAssertGreaterThan(sender.lossDetector.GetReorderWindow(), 0.0);
+}
+
+- (void)testSelectiveAckReachesPastAckMask{
+	PacketManager receiver(StreamId::Audio);
+	PacketManager sender(StreamId::Audio);
+	std::set<uint32_t> missing={20, 90, 91, 92, 150, 190};
+	for(uint32_t seq=1;seq<=200;seq++){
+		if(!missing.count(seq))
+			XCTAssertTrue(receiver.ackRemoteSeq(seq));
+	}
+	// Late and duplicate packets further back than the mask
+	XCTAssertTrue(receiver.ackRemoteSeq(90));
+	missing.erase(90);
+	XCTAssertFalse(receiver.ackRemoteSeq(100));
+	XCTAssertTrue(receiver.shouldSendSelectiveAck());
+
+	ExtraSelectiveAck sack;
+	receiver.getRemoteSelectiveAck(sack);
+	XCTAssertFalse(receiver.shouldSendSelectiveAck());
+	VersionInfo ver(PROTOCOL_VERSION, 110);
+	BufferOutputStream out(256);
+	sack.serialize(out, ver);
+	XCTAssertEqual(out.GetLength(), sack.getConstructorSize(ver));
+	BufferInputStream in(out.GetBuffer(), out.GetLength());
+	ExtraSelectiveAck parsed;
+	XCTAssertTrue(parsed.parse(in, ver));
+
+	std::vector<uint32_t> newlyAcked;
+	sender.ackLocal(receiver.getLastRemoteSeq(), receiver.getRemoteAckMask(), newlyAcked);
+	// All of the mask but 190
+	XCTAssertEqual(newlyAcked.size(), 32u);
+	XCTAssertEqual(newlyAcked.back(), 200u);
+	XCTAssertFalse(sender.wasLocalAcked(100));
+	newlyAcked.clear();
+	sender.ackLocalSelective(parsed, newlyAcked);
+	// Everything the mask didn't cover, oldest first and only once
+	XCTAssertFalse(newlyAcked.empty());
+	XCTAssertTrue(std::is_sorted(newlyAcked.begin(), newlyAcked.end()));
+	XCTAssertLessThan(newlyAcked.back(), 200u-32);
+	for(uint32_t seq:newlyAcked){
+		XCTAssertFalse(missing.count(seq), @"seq %u", seq);
+	}
+	newlyAcked.clear();
+	sender.ackLocalSelective(parsed, newlyAcked);
+	XCTAssertTrue(newlyAcked.empty());
+	for(uint32_t seq=200-MAX_RECENT_PACKETS+1;seq<=200;seq++){
+		XCTAssertEqual(sender.wasLocalAcked(seq), !missing.count(seq), @"seq %u", seq);
+	}
+	XCTAssertTrue(sender.wasCoveredBySelectiveAck(150));
+	XCTAssertFalse(sender.wasCoveredBySelectiveAck(200-MAX_RECENT_PACKETS));
+}
+
 @end
@@ -60,6 +60,7 @@ public:
 
 	size_t Size()
 	{
+		MutexGuard sync(mutex);
 		return queue.size();
 	}
 
@@ -9,7 +9,9 @@
 #include "utils.h"
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <bitset>
+#include <functional>
 #include <limits>
 #include <memory>
 #include <numeric>
@@ -354,4 +356,113 @@ private:
     std::shared_ptr<unsigned char> bufferStart;
     Mutex mutex;
 };
+
+// An outgoing packet being built in a single buffer. The payload is written after some headroom so that headers
+// which depend on it (peer tag, key fingerprint, msg_key) can be prepended in place, and padding goes into the
+// space after it.
+class SendBuffer
+{
+public:
+    TGVOIP_MOVE_ONLY(SendBuffer);
+    SendBuffer(std::shared_ptr<Buffer> &&_buffer, size_t headroom) : buffer(std::move(_buffer)), start(headroom), end(headroom)
+    {
+        if (headroom > buffer->Length())
+            throw std::out_of_range("headroom is larger than the buffer");
+    }
+    unsigned char *Data()
+    {
+        return **buffer + start;
+    }
+    size_t Length() const
+    {
+        return end - start;
+    }
+    size_t Headroom() const
+    {
+        return start;
+    }
+    size_t Tailroom() const
+    {
+        return buffer->Length() - end;
+    }
+    // Grows the packet at the front and returns the new start
+    unsigned char *Push(size_t count)
+    {
+        if (count > start)
+            throw std::out_of_range("not enough headroom");
+        start -= count;
+        return **buffer + start;
+    }
+    // Grows the packet at the back and returns a pointer to the added bytes
+    unsigned char *Put(size_t count)
+    {
+        if (count > Tailroom())
+            throw std::out_of_range("not enough tailroom");
+        unsigned char *added = **buffer + end;
+        end += count;
+        return added;
+    }
+    // Gives up the underlying buffer trimmed to the packet. Headroom that wasn't used costs a move.
+    std::shared_ptr<Buffer> Finish()
+    {
+        size_t length = end - start;
+        if (start > 0)
+            memmove(**buffer, **buffer + start, length);
+        buffer->Resize(length);
+        start = end = 0;
+        return std::move(buffer);
+    }
+
+private:
+    std::shared_ptr<Buffer> buffer;
+    size_t start;
+    size_t end;
+};
+
+// A fixed set of reusable buffers that are handed out as shared pointers. A buffer becomes free again
+// once the pool holds the only reference to it, so whoever consumes the data last returns it just by
+// letting go of the pointer. Get() is meant to be called from a single thread.
+template <size_t bufSize, size_t bufCount>
+class SharedBufferPool
+{
+public:
+    TGVOIP_DISALLOW_COPY_AND_ASSIGN(SharedBufferPool);
+    SharedBufferPool() : bufferStart(new unsigned char[bufSize * bufCount], std::default_delete<unsigned char[]>())
+    {
+        auto resizeFn = [](void *buf, size_t newSize) -> void * {
+            if (newSize > bufSize)
+                throw std::invalid_argument("newSize>bufferSize");
+            return buf;
+        };
+        // Buffers that outlive the pool keep the memory alive
+        auto freeFn = [lock = bufferStart](void *) {};
+        for (size_t i = 0; i < bufCount; i++)
+            buffers[i] = std::make_shared<Buffer>(Buffer::Wrap(bufferStart.get() + (bufSize * i), bufSize, freeFn, resizeFn));
+    }
+
+    // Returns a buffer resized to length, or nullptr if length doesn't fit or every buffer is still in use
+    std::shared_ptr<Buffer> Get(size_t length)
+    {
+        if (length > bufSize)
+            return nullptr;
+        for (size_t i = 0; i < bufCount; i++)
+        {
+            std::shared_ptr<Buffer> &buf = buffers[offset];
+            offset = (offset + 1) % bufCount;
+            if (buf.use_count() == 1)
+            {
+                // Pairs with the release in the last owner's reference drop, so its reads happen before we reuse the memory
+                std::atomic_thread_fence(std::memory_order_acquire);
+                buf->Resize(length);
+                return buf;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    std::array<std::shared_ptr<Buffer>, bufCount> buffers;
+    size_t offset = 0;
+    std::shared_ptr<unsigned char> bufferStart;
+};
 } // namespace tgvoip
@@ -0,0 +1,70 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "CryptoWorkerPool.h"
+
+using namespace tgvoip;
+
+CryptoWorkerPool::CryptoWorkerPool(unsigned int threadCount) : wakeup(threadCount, 0), finished(threadCount, 0)
+{
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        threads.push_back(std::make_unique<Thread>(std::bind(&CryptoWorkerPool::RunWorker, this)));
+        threads.back()->SetName("VoipCrypto");
+        threads.back()->Start();
+    }
+}
+
+CryptoWorkerPool::~CryptoWorkerPool()
+{
+    stopping.store(true);
+    wakeup.Release((int)threads.size());
+    for (std::unique_ptr<Thread> &thread : threads)
+        thread->Join();
+}
+
+void CryptoWorkerPool::Run(size_t count, const std::function<void(size_t)> &job)
+{
+    if (threads.empty() || count < 2)
+    {
+        for (size_t i = 0; i < count; i++)
+            job(i);
+        return;
+    }
+    this->job = &job;
+    jobCount = count;
+    nextJob.store(0, std::memory_order_release);
+    // Every wakeup is answered by exactly one release of finished, no matter which worker picks it up,
+    // so once we've collected all of them no worker is still looking at this batch
+    wakeup.Release((int)threads.size());
+    RunJobs();
+    finished.Acquire((int)threads.size());
+    this->job = nullptr;
+}
+
+unsigned int CryptoWorkerPool::GetThreadCount()
+{
+    return (unsigned int)threads.size();
+}
+
+void CryptoWorkerPool::RunWorker()
+{
+    while (true)
+    {
+        wakeup.Acquire();
+        if (stopping.load())
+            return;
+        RunJobs();
+        finished.Release();
+    }
+}
+
+void CryptoWorkerPool::RunJobs()
+{
+    size_t i;
+    while ((i = nextJob.fetch_add(1, std::memory_order_acq_rel)) < jobCount)
+        (*job)(i);
+}
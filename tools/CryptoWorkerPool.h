@@ -0,0 +1,45 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#pragma once
+#include "threading.h"
+#include "utils.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stddef.h>
+#include <vector>
+
+namespace tgvoip
+{
+
+// Fixed set of threads that packet encryption and decryption can be fanned out to.
+// The caller takes part in every batch, so a pool with N threads works on N+1 packets at a time.
+class CryptoWorkerPool
+{
+public:
+    TGVOIP_DISALLOW_COPY_AND_ASSIGN(CryptoWorkerPool);
+    CryptoWorkerPool(unsigned int threadCount);
+    ~CryptoWorkerPool();
+    // Calls job(i) for every i below count and returns once all calls have finished. Results written to
+    // per-index slots can be consumed in order right after. Not reentrant, only one thread may run batches.
+    void Run(size_t count, const std::function<void(size_t)> &job);
+    unsigned int GetThreadCount();
+
+private:
+    void RunWorker();
+    void RunJobs();
+
+    std::vector<std::unique_ptr<Thread>> threads;
+    Semaphore wakeup;
+    Semaphore finished;
+    const std::function<void(size_t)> *job = nullptr;
+    size_t jobCount = 0;
+    std::atomic<size_t> nextJob{0};
+    std::atomic<bool> stopping{false};
+};
+
+} // namespace tgvoip
@@ -0,0 +1,594 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "HardwareCrypto.h"
+#include "../VoIPController.h"
+#include "logging.h"
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define TGVOIP_HARDWARE_CRYPTO_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+using namespace tgvoip;
+
+#ifdef TGVOIP_HARDWARE_CRYPTO_X86
+
+// GCC and clang only emit these instructions in functions that ask for them, so the rest of the library stays baseline x86
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_AES
+#define TARGET_SHA
+#else
+#define TARGET_AES __attribute__((target("aes,sse4.1")))
+#define TARGET_SHA __attribute__((target("sha,sse4.1")))
+#endif
+
+namespace
+{
+
+struct AesKeySchedule
+{
+    __m128i rk[15];
+};
+
+static_assert(sizeof(AesKeySchedule) <= TGVOIP_CRYPTO_CONTEXT_SIZE, "AES key schedule doesn't fit into the crypto context");
+
+inline uint64_t LoadBE64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#ifdef _MSC_VER
+    return _byteswap_uint64(v);
+#else
+    return __builtin_bswap64(v);
+#endif
+}
+
+inline void StoreBE64(uint8_t *p, uint64_t v)
+{
+#ifdef _MSC_VER
+    v = _byteswap_uint64(v);
+#else
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, 8);
+}
+
+TARGET_AES inline __m128i KeyExpandMix(__m128i key, __m128i assist)
+{
+    __m128i t = _mm_slli_si128(key, 4);
+    key = _mm_xor_si128(key, t);
+    t = _mm_slli_si128(t, 4);
+    key = _mm_xor_si128(key, t);
+    t = _mm_slli_si128(t, 4);
+    key = _mm_xor_si128(key, t);
+    return _mm_xor_si128(key, assist);
+}
+
+// aeskeygenassist wants the round constant as an immediate
+template <int rcon>
+TARGET_AES inline void KeyExpandPair(__m128i &even, __m128i &odd, __m128i *out)
+{
+    even = KeyExpandMix(even, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(odd, rcon), 0xff));
+    out[0] = even;
+    odd = KeyExpandMix(odd, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0), 0xaa));
+    out[1] = odd;
+}
+
+TARGET_AES void AesExpandEncryptKey(const uint8_t *key, AesKeySchedule &ks)
+{
+    __m128i even = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key));
+    __m128i odd = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + 16));
+    ks.rk[0] = even;
+    ks.rk[1] = odd;
+    KeyExpandPair<0x01>(even, odd, ks.rk + 2);
+    KeyExpandPair<0x02>(even, odd, ks.rk + 4);
+    KeyExpandPair<0x04>(even, odd, ks.rk + 6);
+    KeyExpandPair<0x08>(even, odd, ks.rk + 8);
+    KeyExpandPair<0x10>(even, odd, ks.rk + 10);
+    KeyExpandPair<0x20>(even, odd, ks.rk + 12);
+    ks.rk[14] = KeyExpandMix(even, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(odd, 0x40), 0xff));
+}
+
+TARGET_AES void AesExpandDecryptKey(const uint8_t *key, AesKeySchedule &ks)
+{
+    AesKeySchedule enc;
+    AesExpandEncryptKey(key, enc);
+    ks.rk[0] = enc.rk[14];
+    for (int i = 1; i < 14; i++)
+        ks.rk[i] = _mm_aesimc_si128(enc.rk[14 - i]);
+    ks.rk[14] = enc.rk[0];
+}
+
+TARGET_AES inline __m128i AesEncryptBlock(__m128i block, const AesKeySchedule &ks)
+{
+    block = _mm_xor_si128(block, ks.rk[0]);
+    for (int i = 1; i < 14; i++)
+        block = _mm_aesenc_si128(block, ks.rk[i]);
+    return _mm_aesenclast_si128(block, ks.rk[14]);
+}
+
+TARGET_AES inline __m128i AesDecryptBlock(__m128i block, const AesKeySchedule &ks)
+{
+    block = _mm_xor_si128(block, ks.rk[0]);
+    for (int i = 1; i < 14; i++)
+        block = _mm_aesdec_si128(block, ks.rk[i]);
+    return _mm_aesdeclast_si128(block, ks.rk[14]);
+}
+
+// Eight independent blocks per round keep the AES unit busy instead of waiting out each instruction's latency
+TARGET_AES inline void AesEncrypt8(__m128i *blocks, const AesKeySchedule &ks)
+{
+    for (int j = 0; j < 8; j++)
+        blocks[j] = _mm_xor_si128(blocks[j], ks.rk[0]);
+    for (int i = 1; i < 14; i++)
+    {
+        __m128i rk = ks.rk[i];
+        for (int j = 0; j < 8; j++)
+            blocks[j] = _mm_aesenc_si128(blocks[j], rk);
+    }
+    for (int j = 0; j < 8; j++)
+        blocks[j] = _mm_aesenclast_si128(blocks[j], ks.rk[14]);
+}
+
+TARGET_AES inline void AesDecrypt8(__m128i *blocks, const AesKeySchedule &ks)
+{
+    for (int j = 0; j < 8; j++)
+        blocks[j] = _mm_xor_si128(blocks[j], ks.rk[0]);
+    for (int i = 1; i < 14; i++)
+    {
+        __m128i rk = ks.rk[i];
+        for (int j = 0; j < 8; j++)
+            blocks[j] = _mm_aesdec_si128(blocks[j], rk);
+    }
+    for (int j = 0; j < 8; j++)
+        blocks[j] = _mm_aesdeclast_si128(blocks[j], ks.rk[14]);
+}
+
+inline __m128i CounterBlock(uint64_t hi, uint64_t lo)
+{
+#ifdef _MSC_VER
+    return _mm_set_epi64x((long long)_byteswap_uint64(lo), (long long)_byteswap_uint64(hi));
+#else
+    return _mm_set_epi64x((long long)__builtin_bswap64(lo), (long long)__builtin_bswap64(hi));
+#endif
+}
+
+// Same semantics as OpenSSL's CRYPTO_ctr128_encrypt: iv is a 128-bit big-endian counter,
+// ecount holds the last keystream block and num the position within it
+TARGET_AES void AesCtrEncryptWithSchedule(uint8_t *inout, size_t length, const AesKeySchedule &ks, uint8_t *iv, uint8_t *ecount, uint32_t *num)
+{
+    unsigned int n = *num;
+    while (n && length)
+    {
+        *inout++ ^= ecount[n];
+        length--;
+        n = (n + 1) % 16;
+    }
+    uint64_t hi = LoadBE64(iv);
+    uint64_t lo = LoadBE64(iv + 8);
+    while (length >= 128)
+    {
+        __m128i blocks[8];
+        for (int j = 0; j < 8; j++)
+        {
+            blocks[j] = CounterBlock(hi, lo);
+            if (++lo == 0)
+                hi++;
+        }
+        AesEncrypt8(blocks, ks);
+        for (int j = 0; j < 8; j++)
+        {
+            __m128i *p = reinterpret_cast<__m128i *>(inout + j * 16);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), blocks[j]));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ecount), blocks[7]);
+        inout += 128;
+        length -= 128;
+    }
+    while (length >= 16)
+    {
+        __m128i block = AesEncryptBlock(CounterBlock(hi, lo), ks);
+        if (++lo == 0)
+            hi++;
+        __m128i *p = reinterpret_cast<__m128i *>(inout);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), block));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ecount), block);
+        inout += 16;
+        length -= 16;
+    }
+    if (length)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ecount), AesEncryptBlock(CounterBlock(hi, lo), ks));
+        if (++lo == 0)
+            hi++;
+        for (n = 0; n < length; n++)
+            inout[n] ^= ecount[n];
+    }
+    StoreBE64(iv, hi);
+    StoreBE64(iv + 8, lo);
+    *num = n;
+}
+
+// IGE chains every block on both the previous ciphertext and the previous plaintext, so unlike CTR it can't be pipelined
+TARGET_AES void AesIgeEncrypt(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv)
+{
+    AesKeySchedule ks;
+    AesExpandEncryptKey(key, ks);
+    __m128i prevCipher = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv));
+    __m128i prevPlain = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv + 16));
+    for (size_t offset = 0; offset + 16 <= length; offset += 16)
+    {
+        __m128i plain = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + offset));
+        __m128i cipher = _mm_xor_si128(AesEncryptBlock(_mm_xor_si128(plain, prevCipher), ks), prevPlain);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + offset), cipher);
+        prevCipher = cipher;
+        prevPlain = plain;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), prevCipher);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv + 16), prevPlain);
+}
+
+TARGET_AES void AesIgeDecrypt(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv)
+{
+    AesKeySchedule ks;
+    AesExpandDecryptKey(key, ks);
+    __m128i prevCipher = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv));
+    __m128i prevPlain = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv + 16));
+    for (size_t offset = 0; offset + 16 <= length; offset += 16)
+    {
+        __m128i cipher = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + offset));
+        __m128i plain = _mm_xor_si128(AesDecryptBlock(_mm_xor_si128(cipher, prevPlain), ks), prevCipher);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + offset), plain);
+        prevCipher = cipher;
+        prevPlain = plain;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), prevCipher);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv + 16), prevPlain);
+}
+
+TARGET_AES void AesCtrEncrypt(uint8_t *inout, size_t length, uint8_t *key, uint8_t *iv, uint8_t *ecount, uint32_t *num)
+{
+    AesKeySchedule ks;
+    AesExpandEncryptKey(key, ks);
+    AesCtrEncryptWithSchedule(inout, length, ks, iv, ecount, num);
+}
+
+void AesSetEncryptKey(void *ctx, const uint8_t *key)
+{
+    AesExpandEncryptKey(key, *static_cast<AesKeySchedule *>(ctx));
+}
+
+void AesCtrEncryptKeyed(uint8_t *inout, size_t length, const void *ctx, uint8_t *iv, uint8_t *ecount, uint32_t *num)
+{
+    AesCtrEncryptWithSchedule(inout, length, *static_cast<const AesKeySchedule *>(ctx), iv, ecount, num);
+}
+
+// Whole blocks only, which is all the protocol ever passes
+TARGET_AES void AesCbcEncrypt(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv)
+{
+    AesKeySchedule ks;
+    AesExpandEncryptKey(key, ks);
+    __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv));
+    for (size_t offset = 0; offset + 16 <= length; offset += 16)
+    {
+        __m128i plain = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + offset));
+        prev = AesEncryptBlock(_mm_xor_si128(plain, prev), ks);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + offset), prev);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), prev);
+}
+
+TARGET_AES void AesCbcDecrypt(uint8_t *in, uint8_t *out, size_t length, uint8_t *key, uint8_t *iv)
+{
+    AesKeySchedule ks;
+    AesExpandDecryptKey(key, ks);
+    __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iv));
+    size_t offset = 0;
+    for (; offset + 128 <= length; offset += 128)
+    {
+        __m128i cipher[8], blocks[8];
+        for (int j = 0; j < 8; j++)
+            blocks[j] = cipher[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + offset + j * 16));
+        AesDecrypt8(blocks, ks);
+        for (int j = 0; j < 8; j++)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + offset + j * 16), _mm_xor_si128(blocks[j], j ? cipher[j - 1] : prev));
+        prev = cipher[7];
+    }
+    for (; offset + 16 <= length; offset += 16)
+    {
+        __m128i cipher = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + offset));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + offset), _mm_xor_si128(AesDecryptBlock(cipher, ks), prev));
+        prev = cipher;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(iv), prev);
+}
+
+alignas(16) const uint32_t sha256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// Four rounds, msg[] holds the message schedule for the next 16. Templated so that every index is
+// known at compile time and the schedule stays in registers.
+template <int i>
+TARGET_SHA inline void Sha256Rounds4(__m128i &state0, __m128i &state1, __m128i *msg, const uint8_t *data, __m128i byteSwap)
+{
+    if constexpr (i < 4)
+        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)), byteSwap);
+    __m128i m = _mm_add_epi32(msg[i & 3], _mm_load_si128(reinterpret_cast<const __m128i *>(sha256RoundConstants + i * 4)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+    if constexpr (i >= 3 && i < 15)
+    {
+        __m128i &next = msg[(i + 1) & 3];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(msg[i & 3], msg[(i - 1) & 3], 4));
+        next = _mm_sha256msg2_epu32(next, msg[i & 3]);
+    }
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0E));
+    if constexpr (i >= 1 && i < 13)
+        msg[(i - 1) & 3] = _mm_sha256msg1_epu32(msg[(i - 1) & 3], msg[i & 3]);
+}
+
+template <int... i>
+TARGET_SHA inline void Sha256Block(__m128i &state0, __m128i &state1, const uint8_t *data, __m128i byteSwap, std::integer_sequence<int, i...>)
+{
+    __m128i msg[4];
+    (Sha256Rounds4<i>(state0, state1, msg, data, byteSwap), ...);
+}
+
+TARGET_SHA void Sha256Compress(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    // The SHA instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks; blocks--, data += 64)
+    {
+        __m128i abefSave = state0, cdghSave = state1;
+        Sha256Block(state0, state1, data, byteSwap, std::make_integer_sequence<int, 16>());
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+
+// Same idea for SHA-1, e[] alternates between the E value being consumed and the one being produced
+template <int g>
+TARGET_SHA inline void Sha1Rounds4(__m128i &abcd, __m128i *e, __m128i *msg, const uint8_t *data, __m128i byteSwap)
+{
+    if constexpr (g < 4)
+        msg[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + g * 16)), byteSwap);
+    if constexpr (g == 0)
+        e[0] = _mm_add_epi32(e[0], msg[0]);
+    else
+        e[g & 1] = _mm_sha1nexte_epu32(e[g & 1], msg[g & 3]);
+    e[(g + 1) & 1] = abcd;
+    if constexpr (g >= 3 && g < 19)
+        msg[(g + 1) & 3] = _mm_sha1msg2_epu32(msg[(g + 1) & 3], msg[g & 3]);
+    abcd = _mm_sha1rnds4_epu32(abcd, e[g & 1], g / 5);
+    if constexpr (g >= 1 && g < 17)
+        msg[(g - 1) & 3] = _mm_sha1msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+    if constexpr (g >= 2 && g < 18)
+        msg[(g - 2) & 3] = _mm_xor_si128(msg[(g - 2) & 3], msg[g & 3]);
+}
+
+template <int... g>
+TARGET_SHA inline void Sha1Block(__m128i &abcd, __m128i *e, const uint8_t *data, __m128i byteSwap, std::integer_sequence<int, g...>)
+{
+    __m128i msg[4];
+    (Sha1Rounds4<g>(abcd, e, msg, data, byteSwap), ...);
+}
+
+TARGET_SHA void Sha1Compress(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    for (; blocks; blocks--, data += 64)
+    {
+        __m128i abcdSave = abcd;
+        __m128i e[2] = {e0, e0};
+        Sha1Block(abcd, e, data, byteSwap, std::make_integer_sequence<int, 20>());
+        e0 = _mm_sha1nexte_epu32(e[0], e0);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+// Merkle-Damgard padding and buffering around one of the compression functions above
+template <size_t stateWords, void (*compress)(uint32_t *, const uint8_t *, size_t)>
+struct ShaContext
+{
+    uint32_t state[stateWords];
+    uint64_t length;
+    uint8_t buffer[64];
+
+    void Update(const uint8_t *msg, size_t len)
+    {
+        size_t buffered = (size_t)(length % 64);
+        length += len;
+        if (buffered)
+        {
+            size_t fill = std::min(len, 64 - buffered);
+            memcpy(buffer + buffered, msg, fill);
+            msg += fill;
+            len -= fill;
+            if (buffered + fill < 64)
+                return;
+            compress(state, buffer, 1);
+        }
+        if (len >= 64)
+        {
+            compress(state, msg, len / 64);
+            msg += len & ~(size_t)63;
+            len %= 64;
+        }
+        memcpy(buffer, msg, len);
+    }
+
+    void Final(uint8_t *output)
+    {
+        uint64_t bitLength = length * 8;
+        size_t buffered = (size_t)(length % 64);
+        buffer[buffered++] = 0x80;
+        if (buffered > 56)
+        {
+            memset(buffer + buffered, 0, 64 - buffered);
+            compress(state, buffer, 1);
+            buffered = 0;
+        }
+        memset(buffer + buffered, 0, 56 - buffered);
+        StoreBE64(buffer + 56, bitLength);
+        compress(state, buffer, 1);
+        for (size_t i = 0; i < stateWords; i++)
+        {
+            output[i * 4] = (uint8_t)(state[i] >> 24);
+            output[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+            output[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+            output[i * 4 + 3] = (uint8_t)state[i];
+        }
+    }
+};
+
+typedef ShaContext<5, Sha1Compress> Sha1Context;
+typedef ShaContext<8, Sha256Compress> Sha256Context;
+
+static_assert(sizeof(Sha256Context) <= TGVOIP_CRYPTO_CONTEXT_SIZE, "SHA-256 context doesn't fit into the crypto context");
+
+void Sha256Init(void *ctx)
+{
+    static const uint32_t initialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    Sha256Context *sha = static_cast<Sha256Context *>(ctx);
+    memcpy(sha->state, initialState, sizeof(initialState));
+    sha->length = 0;
+}
+
+void Sha256Update(void *ctx, const uint8_t *msg, size_t length)
+{
+    static_cast<Sha256Context *>(ctx)->Update(msg, length);
+}
+
+void Sha256Final(void *ctx, uint8_t *output)
+{
+    static_cast<Sha256Context *>(ctx)->Final(output);
+}
+
+void Sha256(uint8_t *msg, size_t length, uint8_t *output)
+{
+    Sha256Context ctx;
+    Sha256Init(&ctx);
+    ctx.Update(msg, length);
+    ctx.Final(output);
+}
+
+void Sha1(uint8_t *msg, size_t length, uint8_t *output)
+{
+    Sha1Context ctx = {{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0}, 0, {}};
+    ctx.Update(msg, length);
+    ctx.Final(output);
+}
+
+HardwareCrypto::Features DetectFeatures()
+{
+    HardwareCrypto::Features features = {false, false, false};
+    unsigned int leaf1Ecx, leaf7Ebx = 0;
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0);
+    int maxLeaf = regs[0];
+    if (maxLeaf < 1)
+        return features;
+    __cpuid(regs, 1);
+    leaf1Ecx = (unsigned int)regs[2];
+    if (maxLeaf >= 7)
+    {
+        __cpuidex(regs, 7, 0);
+        leaf7Ebx = (unsigned int)regs[1];
+    }
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &leaf1Ecx, &edx))
+        return features;
+    if (__get_cpuid_max(0, nullptr) >= 7)
+    {
+        unsigned int ecx;
+        __cpuid_count(7, 0, eax, leaf7Ebx, ecx, edx);
+    }
+#endif
+    // Everything here also needs SSSE3 shuffles and SSE4.1 blends and extracts
+    bool sse41 = (leaf1Ecx & (1U << 19)) && (leaf1Ecx & (1U << 9));
+    features.aes = sse41 && (leaf1Ecx & (1U << 25));
+    features.pclmul = (leaf1Ecx & (1U << 1)) != 0;
+    features.sha = sse41 && (leaf7Ebx & (1U << 29));
+    return features;
+}
+
+} // namespace
+
+#endif
+
+HardwareCrypto::Features HardwareCrypto::GetFeatures()
+{
+#ifdef TGVOIP_HARDWARE_CRYPTO_X86
+    static const Features features = DetectFeatures();
+    return features;
+#else
+    return Features{false, false, false};
+#endif
+}
+
+bool HardwareCrypto::Install(CryptoFunctions &functions)
+{
+    Features features = GetFeatures();
+#ifdef TGVOIP_HARDWARE_CRYPTO_X86
+    if (features.aes)
+    {
+        functions.aes_ige_encrypt = AesIgeEncrypt;
+        functions.aes_ige_decrypt = AesIgeDecrypt;
+        functions.aes_ctr_encrypt = AesCtrEncrypt;
+        functions.aes_cbc_encrypt = AesCbcEncrypt;
+        functions.aes_cbc_decrypt = AesCbcDecrypt;
+        functions.aes_set_encrypt_key = AesSetEncryptKey;
+        functions.aes_ctr_encrypt_keyed = AesCtrEncryptKeyed;
+    }
+    if (features.sha)
+    {
+        functions.sha1 = Sha1;
+        functions.sha256 = Sha256;
+        functions.sha256_init = Sha256Init;
+        functions.sha256_update = Sha256Update;
+        functions.sha256_final = Sha256Final;
+    }
+#endif
+    LOGI("Built-in crypto: AES-NI %s, PCLMUL %s, SHA %s", features.aes ? "yes" : "no", features.pclmul ? "yes" : "no", features.sha ? "yes" : "no");
+    return features.aes || features.sha;
+}
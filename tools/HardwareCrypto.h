@@ -0,0 +1,32 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#pragma once
+
+namespace tgvoip
+{
+
+struct CryptoFunctions;
+
+// Built-in AES and SHA on top of the x86 AES-NI and SHA extensions, selected at runtime.
+// Nothing uses it unless the embedder installs it over its own crypto functions.
+class HardwareCrypto
+{
+public:
+    struct Features
+    {
+        bool aes;
+        bool pclmul;
+        bool sha;
+    };
+
+    static Features GetFeatures();
+    // Points the entries this CPU can accelerate at the built-in implementations and leaves the rest alone.
+    // Returns false if nothing was replaced.
+    static bool Install(CryptoFunctions &functions);
+};
+
+} // namespace tgvoip
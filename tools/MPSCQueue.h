@@ -0,0 +1,208 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#pragma once
+#include "threading.h"
+#include "utils.h"
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+namespace tgvoip
+{
+
+// Bounded lock-free queue for any number of producers and a single consumer that may block.
+// Based on Dmitry Vyukov's bounded MPMC queue. Capacity is rounded up to a power of two.
+template <typename T>
+class MPSCQueue
+{
+public:
+    enum class OverflowPolicy
+    {
+        // Push fails when the queue is full
+        Reject,
+        // Push evicts the oldest item to make room
+        DropOldest
+    };
+
+    TGVOIP_DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+    MPSCQueue(size_t capacity, OverflowPolicy policy = OverflowPolicy::Reject) : policy(policy), semaphore(2, 0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        mask = size - 1;
+        cells = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~MPSCQueue()
+    {
+        while (TryPopInternal([](T &) {}))
+            ;
+    }
+
+    // Returns false if the item was rejected because the queue is full
+    bool Push(T &&thing)
+    {
+        return Push(std::move(thing), [](T &&) {});
+    }
+
+    // Same, but every item the DropOldest policy evicts is handed to evicted(T &&) on the calling thread instead of being destroyed
+    template <typename F>
+    bool Push(T &&thing, F &&evicted)
+    {
+        while (!TryPushInternal(thing))
+        {
+            if (policy == OverflowPolicy::Reject)
+                return false;
+            if (TryPopInternal([&](T &item) { evicted(std::move(item)); }))
+                dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (consumerWaiting.exchange(false))
+            semaphore.Release();
+        return true;
+    }
+
+    bool TryPop(T &out)
+    {
+        return TryPopInternal([&](T &item) { out = std::move(item); });
+    }
+
+    void PopBlocking(T &out)
+    {
+        while (true)
+        {
+            if (TryPop(out))
+                return;
+            consumerWaiting.store(true);
+            // Re-check after announcing ourselves so that a concurrent Push either sees the flag or its item is seen here
+            if (TryPop(out))
+            {
+                consumerWaiting.store(false);
+                return;
+            }
+            semaphore.Acquire();
+        }
+    }
+
+    // Returns false if nothing arrived within timeout seconds
+    bool PopBlocking(T &out, double timeout)
+    {
+        if (TryPop(out))
+            return true;
+        consumerWaiting.store(true);
+        if (TryPop(out))
+        {
+            consumerWaiting.store(false);
+            return true;
+        }
+        semaphore.TryAcquire(timeout);
+        consumerWaiting.store(false);
+        // A producer that saw the flag after we timed out leaves an extra release behind, the blocking loops above absorb it
+        return TryPop(out);
+    }
+
+    size_t Size() const
+    {
+        size_t enq = enqueuePos.load(std::memory_order_relaxed);
+        size_t deq = dequeuePos.load(std::memory_order_relaxed);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    size_t Capacity() const
+    {
+        return mask + 1;
+    }
+
+    // Number of items evicted by the DropOldest policy so far
+    uint64_t GetDroppedCount() const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    bool TryPushInternal(T &thing)
+    {
+        Cell *cell;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        new (&cell->storage) T(std::move(thing));
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Calls f(T &) with the item before it's destroyed
+    template <typename F>
+    bool TryPopInternal(F &&f)
+    {
+        Cell *cell;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        T *item = reinterpret_cast<T *>(&cell->storage);
+        f(*item);
+        item->~T();
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    OverflowPolicy policy;
+    alignas(TGVOIP_CACHE_LINE_SIZE) std::atomic<size_t> enqueuePos{0};
+    alignas(TGVOIP_CACHE_LINE_SIZE) std::atomic<size_t> dequeuePos{0};
+    alignas(TGVOIP_CACHE_LINE_SIZE) std::atomic<bool> consumerWaiting{false};
+    std::atomic<uint64_t> dropped{0};
+    Semaphore semaphore;
+};
+
+} // namespace tgvoip
@@ -7,10 +7,7 @@
 #include <math.h>
 #include <float.h>
 #include <stdint.h>
-
-#ifndef _WIN32
-#include <sys/time.h>
-#endif
+#include <string.h>
 
 #include "tools/MessageThread.h"
 #include "VoIPController.h"
@@ -18,18 +15,35 @@
 
 using namespace tgvoip;
 
+static const size_t NOT_QUEUED = SIZE_MAX;
+static const size_t INITIAL_SLOT_COUNT = 64;
+
 MessageThread::MessageThread() : Thread(std::bind(&MessageThread::Run, this)), running(true)
 {
 	SetName("MessageThread");
 
+	slots.resize(INITIAL_SLOT_COUNT);
+	for (Message &m : slots)
+		m.id = INVALID_ID;
+	heap.reserve(INITIAL_SLOT_COUNT);
+	// So that recording stats doesn't allocate on the message thread unless there are lots of tags
+	taskStats.reserve(32);
+
 #ifdef _WIN32
 #if !defined(WINAPI_FAMILY) || WINAPI_FAMILY != WINAPI_FAMILY_PHONE_APP
 	event = CreateEvent(NULL, false, false, NULL);
 #else
 	event = CreateEventEx(NULL, NULL, 0, EVENT_ALL_ACCESS);
 #endif
-#else
+#elif defined(__APPLE__)
 	pthread_cond_init(&cond, NULL);
+#else
+	// Timeouts are relative to GetCurrentTime(), which is monotonic, so the wall clock must not be able to stretch them
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
 #endif
 }
 
@@ -47,7 +61,10 @@ void MessageThread::Stop()
 {
 	if (running)
 	{
-		running = false;
+		{
+			MutexGuard _m(queueAccessMutex);
+			running = false;
+		}
 #ifdef _WIN32
 		SetEvent(event);
 #else
@@ -59,97 +76,120 @@ void MessageThread::Stop()
 
 void MessageThread::Run()
 {
-	loopMutex.Lock();
+	queueAccessMutex.Lock();
 	while (running)
 	{
 		double currentTime = VoIPController::GetCurrentTime();
-		double waitTimeout;
-		{
-			MutexGuard _m(queueAccessMutex);
-			waitTimeout = queue.empty() ? DBL_MAX : (queue[0].deliverAt - currentTime);
-		};
-
-		//LOGW("MessageThread wait timeout %f", waitTimeout);
-		if (waitTimeout > 0.0)
+		if (heap.empty() || slots[heap[0]].deliverAt > currentTime)
 		{
-#ifdef _WIN32
-			loopMutex.Unlock();
-			DWORD actualWaitTimeout = waitTimeout == DBL_MAX ? INFINITE : ((DWORD)round(waitTimeout * 1000.0));
-#if !defined(WINAPI_FAMILY) || WINAPI_FAMILY != WINAPI_FAMILY_PHONE_APP
-			WaitForSingleObject(event, actualWaitTimeout);
-#else
-			WaitForSingleObjectEx(event, actualWaitTimeout, false);
-#endif
-			// we don't really care if a context switch happens here and anything gets added to the queue by another thread
-			// since any new no-delay messages will get delivered on this iteration anyway
-			loopMutex.Lock();
-#else
-			if (waitTimeout != DBL_MAX)
-			{
-				struct timeval now;
-				struct timespec timeout;
-				gettimeofday(&now, NULL);
-				waitTimeout += now.tv_sec;
-				waitTimeout += (now.tv_usec / 1000000.0);
-				timeout.tv_sec = (time_t)(floor(waitTimeout));
-				timeout.tv_nsec = (long)((waitTimeout - floor(waitTimeout)) * 1000000000.0);
-				pthread_cond_timedwait(&cond, loopMutex.NativeHandle(), &timeout);
-			}
-			else
-			{
-				pthread_cond_wait(&cond, loopMutex.NativeHandle());
-			}
-#endif
+			//LOGW("MessageThread wait timeout %f", waitTimeout);
+			Wait(heap.empty() ? DBL_MAX : (slots[heap[0]].deliverAt - currentTime));
+			continue;
 		}
-		if (!running)
+
+		size_t slot = heap[0];
+		Unschedule(slot);
+		Message &m = slots[slot];
+		//LOGI("MessageThread delivering %u", m.id);
+		double lateness = currentTime - (m.deliverAt == 0.0 ? m.postedAt : m.deliverAt);
+		const char *tag = m.tag;
+		if (m.deliverAt == 0.0)
+			m.deliverAt = currentTime;
+		// The table may grow while the function runs, so it can't be called in place
+		Task func = std::move(m.func);
+		currentID = m.id;
+		cancelCurrent = false;
+		queueAccessMutex.Unlock();
+		if (func)
 		{
-			loopMutex.Unlock();
-			return;
+			func();
 		}
+		double runTime = VoIPController::GetCurrentTime() - currentTime;
+		queueAccessMutex.Lock();
+		RecordTaskStats(tag, lateness, runTime);
 
-		currentTime = VoIPController::GetCurrentTime();
-		std::vector<Message> msgsToDeliverNow;
+		slot = currentID & (slots.size() - 1);
+		Message &current = slots[slot];
+		if (!cancelCurrent && current.interval > 0.0)
 		{
-			MutexGuard _m(queueAccessMutex);
-			std::vector<Message> newQueue;
-			std::partition_copy(
-				std::make_move_iterator(queue.begin()),
-				std::make_move_iterator(queue.end()),
-				std::back_inserter(msgsToDeliverNow),
-				std::back_inserter(newQueue),
-				[&currentTime](const Message &message) { // Deliver now if
-					return message.deliverAt == 0.0 || currentTime >= message.deliverAt;
-				});
-			queue = std::move(newQueue);
+			current.deliverAt += current.interval;
+			current.func = std::move(func);
+			current.seq = ++lastSeq;
+			Schedule(slot);
 		}
-
-		for (Message &m : msgsToDeliverNow)
+		else
 		{
-			//LOGI("MessageThread delivering %u", m.msg);
-			cancelCurrent = false;
-			if (m.deliverAt == 0.0)
-				m.deliverAt = VoIPController::GetCurrentTime();
-			if (m.func != nullptr)
-			{
-				m.func();
-			}
-			if (!cancelCurrent && m.interval > 0.0)
-			{
-				m.deliverAt += m.interval;
-				InsertMessageInternal(m);
-			}
+			ReleaseSlot(slot);
 		}
+		currentID = INVALID_ID;
+	}
+	queueAccessMutex.Unlock();
+}
+
+void MessageThread::Wait(double timeout)
+{
+#ifdef _WIN32
+	queueAccessMutex.Unlock();
+	DWORD actualWaitTimeout = timeout == DBL_MAX ? INFINITE : ((DWORD)ceil(timeout * 1000.0));
+#if !defined(WINAPI_FAMILY) || WINAPI_FAMILY != WINAPI_FAMILY_PHONE_APP
+	WaitForSingleObject(event, actualWaitTimeout);
+#else
+	WaitForSingleObjectEx(event, actualWaitTimeout, false);
+#endif
+	// the event stays signaled if anything was posted before we got here, so nothing can be missed
+	queueAccessMutex.Lock();
+#else
+	if (timeout == DBL_MAX)
+	{
+		pthread_cond_wait(&cond, queueAccessMutex.NativeHandle());
+		return;
+	}
+	struct timespec ts;
+#ifdef __APPLE__
+	ts.tv_sec = (time_t)floor(timeout);
+	ts.tv_nsec = (long)((timeout - floor(timeout)) * 1000000000.0);
+	pthread_cond_timedwait_relative_np(&cond, queueAccessMutex.NativeHandle(), &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double deadline = ts.tv_sec + (double)ts.tv_nsec / 1000000000.0 + timeout;
+	ts.tv_sec = (time_t)floor(deadline);
+	ts.tv_nsec = (long)((deadline - floor(deadline)) * 1000000000.0);
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
 	}
-	loopMutex.Unlock();
+	pthread_cond_timedwait(&cond, queueAccessMutex.NativeHandle(), &ts);
+#endif
+#endif
+}
+
+uint32_t MessageThread::Post(std::function<void()> func, double delay, double interval, const char *tag)
+{
+	if (func == nullptr)
+		return PostTask(Task(), delay, interval, tag);
+	return PostTask(Task(std::move(func)), delay, interval, tag);
 }
 
-uint32_t MessageThread::Post(std::function<void()> func, double delay, double interval)
+uint32_t MessageThread::PostTask(Task &&task, double delay, double interval, const char *tag)
 {
 	assert(delay >= 0);
 	//LOGI("MessageThread post [function] delay %f", delay);
 	double currentTime = VoIPController::GetCurrentTime();
-	Message m{lastMessageID++, delay == 0.0 ? 0.0 : (currentTime + delay), interval, func};
-	InsertMessageInternal(m);
+	uint32_t id;
+	{
+		MutexGuard _m(queueAccessMutex);
+		size_t slot = AllocateSlot();
+		Message &m = slots[slot];
+		m.deliverAt = delay == 0.0 ? 0.0 : (currentTime + delay);
+		m.interval = interval;
+		m.seq = ++lastSeq;
+		m.postedAt = currentTime;
+		m.tag = tag ? tag : "other";
+		m.func = std::move(task);
+		Schedule(slot);
+		id = m.id;
+	}
 	if (!IsCurrent())
 	{
 #ifdef _WIN32
@@ -158,53 +198,183 @@ uint32_t MessageThread::Post(std::function<void()> func, double delay, double in
 		pthread_cond_signal(&cond);
 #endif
 	}
-	return m.id;
+	return id;
 }
 
-void MessageThread::InsertMessageInternal(MessageThread::Message &m)
+void MessageThread::Cancel(uint32_t id)
 {
+	if (id == INVALID_ID)
+		return;
 	MutexGuard _m(queueAccessMutex);
-	if (queue.empty())
+	if (id == currentID)
 	{
-		queue.push_back(m);
+		cancelCurrent = true;
+		return;
 	}
-	else
+	size_t slot = id & (slots.size() - 1);
+	if (slots[slot].id != id)
+		return;
+	Unschedule(slot);
+	ReleaseSlot(slot);
+}
+
+void MessageThread::CancelSelf()
+{
+	assert(IsCurrent());
+	MutexGuard _m(queueAccessMutex);
+	cancelCurrent = true;
+}
+
+size_t MessageThread::AllocateSlot()
+{
+	if ((usedSlots + 1) * 2 > slots.size())
+		Grow();
+	size_t mask = slots.size() - 1;
+	while (true)
 	{
-		if (queue[0].deliverAt > m.deliverAt)
-		{
-			queue.insert(queue.begin(), m);
-		}
-		else
+		uint32_t id = ++lastMessageID;
+		if (id == INVALID_ID)
+			continue;
+		size_t slot = id & mask;
+		if (slots[slot].id == INVALID_ID)
 		{
-			for (auto insertAfter = queue.begin(); insertAfter != queue.end(); ++insertAfter)
-			{
-				std::vector<Message>::iterator next = std::next(insertAfter);
-				if (next == queue.end() || (next->deliverAt > m.deliverAt && insertAfter->deliverAt <= m.deliverAt))
-				{
-					queue.insert(next, m);
-					break;
-				}
-			}
+			slots[slot].id = id;
+			usedSlots++;
+			return slot;
 		}
 	}
 }
 
-void MessageThread::Cancel(uint32_t id)
+void MessageThread::ReleaseSlot(size_t slot)
 {
-	MutexGuard _m(queueAccessMutex);
+	slots[slot].id = INVALID_ID;
+	slots[slot].func = nullptr;
+	usedSlots--;
+}
+
+void MessageThread::Grow()
+{
+	// Ids that differ modulo the old size also differ modulo the new one, so every message still has its own slot
+	std::vector<Message> newSlots(slots.size() * 2);
+	size_t newMask = newSlots.size() - 1;
+	for (Message &m : newSlots)
+		m.id = INVALID_ID;
+	for (Message &m : slots)
+	{
+		if (m.id != INVALID_ID)
+			newSlots[m.id & newMask] = std::move(m);
+	}
+	// Moving doesn't change any keys, so the heap order holds and only the indices need to be translated
+	for (size_t &slot : heap)
+		slot = slots[slot].id & newMask;
+	slots = std::move(newSlots);
+	heap.reserve(slots.size());
+}
 
-	queue.erase(
-		std::remove_if(
-			queue.begin(),
-			queue.end(),
-			[&id](const Message &message) {
-				return message.id == id;
-			}),
-		queue.end());
+void MessageThread::Schedule(size_t slot)
+{
+	slots[slot].heapIndex = heap.size();
+	heap.push_back(slot);
+	SiftUp(heap.size() - 1);
 }
 
-void MessageThread::CancelSelf()
+void MessageThread::Unschedule(size_t slot)
 {
-	assert(IsCurrent());
-	cancelCurrent = true;
+	size_t pos = slots[slot].heapIndex;
+	if (pos == NOT_QUEUED)
+		return;
+	slots[slot].heapIndex = NOT_QUEUED;
+	size_t last = heap.back();
+	heap.pop_back();
+	if (pos == heap.size())
+		return;
+	heap[pos] = last;
+	slots[last].heapIndex = pos;
+	SiftUp(pos);
+	SiftDown(slots[last].heapIndex);
+}
+
+bool MessageThread::IsEarlier(size_t a, size_t b) const
+{
+	const Message &ma = slots[a];
+	const Message &mb = slots[b];
+	return ma.deliverAt < mb.deliverAt || (ma.deliverAt == mb.deliverAt && ma.seq < mb.seq);
+}
+
+void MessageThread::SiftUp(size_t pos)
+{
+	size_t slot = heap[pos];
+	while (pos > 0)
+	{
+		size_t parent = (pos - 1) / 2;
+		if (!IsEarlier(slot, heap[parent]))
+			break;
+		heap[pos] = heap[parent];
+		slots[heap[pos]].heapIndex = pos;
+		pos = parent;
+	}
+	heap[pos] = slot;
+	slots[slot].heapIndex = pos;
+}
+
+void MessageThread::SiftDown(size_t pos)
+{
+	size_t slot = heap[pos];
+	size_t count = heap.size();
+	while (true)
+	{
+		size_t child = pos * 2 + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && IsEarlier(heap[child + 1], heap[child]))
+			child++;
+		if (!IsEarlier(heap[child], slot))
+			break;
+		heap[pos] = heap[child];
+		slots[heap[pos]].heapIndex = pos;
+		pos = child;
+	}
+	heap[pos] = slot;
+	slots[slot].heapIndex = pos;
+}
+
+void MessageThread::RecordTaskStats(const char *tag, double lateness, double runTime)
+{
+	TaskStats *stats = nullptr;
+	for (TaskStats &s : taskStats)
+	{
+		if (s.tag == tag || strcmp(s.tag, tag) == 0)
+		{
+			stats = &s;
+			break;
+		}
+	}
+	if (!stats)
+	{
+		taskStats.emplace_back();
+		stats = &taskStats.back();
+		stats->tag = tag;
+	}
+
+	double latenessMs = std::max(lateness, 0.0) * 1000.0;
+	double runTimeMs = runTime * 1000.0;
+	stats->count++;
+	stats->totalLateness += latenessMs;
+	stats->maxLateness = std::max(stats->maxLateness, latenessMs);
+	stats->totalRunTime += runTimeMs;
+	stats->maxRunTime = std::max(stats->maxRunTime, runTimeMs);
+	size_t latenessBucket = 0;
+	while (latenessBucket < TaskStats::HISTOGRAM_SIZE - 1 && latenessMs > TaskStats::BucketUpperBound(latenessBucket))
+		latenessBucket++;
+	stats->lateness[latenessBucket]++;
+	size_t runTimeBucket = 0;
+	while (runTimeBucket < TaskStats::HISTOGRAM_SIZE - 1 && runTimeMs > TaskStats::BucketUpperBound(runTimeBucket))
+		runTimeBucket++;
+	stats->runTime[runTimeBucket]++;
+}
+
+std::vector<MessageThread::TaskStats> MessageThread::GetTaskStats()
+{
+	MutexGuard _m(queueAccessMutex);
+	return taskStats;
 }
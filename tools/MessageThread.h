@@ -11,16 +11,148 @@
 #include <functional>
 #include <algorithm>
 #include <atomic>
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
 
 namespace tgvoip
 {
+// Move-only void() callable that keeps the callable in inline storage and never allocates.
+// Big enough for std::bind(&VoIPController::Foo, this) and lambdas capturing a few pointers or shared_ptrs.
+class Task
+{
+public:
+	enum
+	{
+		INLINE_SIZE = 64
+	};
+
+	template <typename F>
+	static constexpr bool Fits = sizeof(std::decay_t<F>) <= INLINE_SIZE && alignof(std::decay_t<F>) <= alignof(max_align_t) && std::is_nothrow_move_constructible<std::decay_t<F>>::value;
+
+	TGVOIP_DISALLOW_COPY_AND_ASSIGN(Task);
+	Task() = default;
+
+	Task(std::nullptr_t)
+	{
+	}
+
+	template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Task>::value>>
+	Task(F &&func)
+	{
+		using Callable = std::decay_t<F>;
+		static_assert(Fits<F>, "Task callable doesn't fit into the inline storage");
+		new (&storage) Callable(std::forward<F>(func));
+		ops = &OpsFor<Callable>::ops;
+	}
+
+	Task(Task &&other) noexcept
+	{
+		MoveFrom(other);
+	}
+
+	~Task()
+	{
+		Reset();
+	}
+
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other)
+		{
+			Reset();
+			MoveFrom(other);
+		}
+		return *this;
+	}
+
+	Task &operator=(std::nullptr_t)
+	{
+		Reset();
+		return *this;
+	}
+
+	explicit operator bool() const
+	{
+		return ops != nullptr;
+	}
+
+	void operator()()
+	{
+		ops->invoke(&storage);
+	}
+
+private:
+	struct Ops
+	{
+		void (*invoke)(void *self);
+		// Move-constructs into dst and destroys src
+		void (*relocate)(void *dst, void *src);
+		void (*destroy)(void *self);
+	};
+
+	template <typename Callable>
+	struct OpsFor
+	{
+		static void Invoke(void *self)
+		{
+			(*reinterpret_cast<Callable *>(self))();
+		}
+
+		static void Relocate(void *dst, void *src)
+		{
+			Callable *from = reinterpret_cast<Callable *>(src);
+			new (dst) Callable(std::move(*from));
+			from->~Callable();
+		}
+
+		static void Destroy(void *self)
+		{
+			reinterpret_cast<Callable *>(self)->~Callable();
+		}
+
+		static constexpr Ops ops{Invoke, Relocate, Destroy};
+	};
+
+	void Reset()
+	{
+		if (ops)
+		{
+			ops->destroy(&storage);
+			ops = nullptr;
+		}
+	}
+
+	void MoveFrom(Task &other)
+	{
+		if (other.ops)
+		{
+			other.ops->relocate(&storage, &other.storage);
+			ops = other.ops;
+			other.ops = nullptr;
+		}
+	}
+
+	const Ops *ops = nullptr;
+	typename std::aligned_storage<INLINE_SIZE, alignof(max_align_t)>::type storage;
+};
+
 class MessageThread : public Thread
 {
 public:
 	TGVOIP_DISALLOW_COPY_AND_ASSIGN(MessageThread);
 	MessageThread();
 	virtual ~MessageThread();
-	uint32_t Post(std::function<void()> func, double delay = 0, double interval = 0);
+	// tag has to be a string literal, it groups the message's timings in GetTaskStats()
+	uint32_t Post(std::function<void()> func, double delay = 0, double interval = 0, const char *tag = nullptr);
+	// Stores the callable inline instead of going through std::function, doesn't allocate once the queue is warmed up
+	template <typename F, typename = std::enable_if_t<Task::Fits<F> && !std::is_same<std::decay_t<F>, std::function<void()>>::value>>
+	uint32_t Post(F &&func, double delay = 0, double interval = 0, const char *tag = nullptr)
+	{
+		return PostTask(Task(std::forward<F>(func)), delay, interval, tag);
+	}
+	uint32_t PostTask(Task &&task, double delay = 0, double interval = 0, const char *tag = nullptr);
 	void Cancel(uint32_t id);
 	void CancelSelf();
 	void Stop();
@@ -30,25 +162,76 @@ public:
 		INVALID_ID = 0
 	};
 
+	// How late messages with the same tag were delivered and how long they ran, in milliseconds
+	struct TaskStats
+	{
+		enum
+		{
+			HISTOGRAM_SIZE = 12
+		};
+
+		// Bucket i counts values up to BucketUpperBound(i), the last bucket everything above
+		static double BucketUpperBound(size_t i)
+		{
+			return 0.25 * (double)(1 << i);
+		}
+
+		// "other" for messages posted without a tag
+		const char *tag;
+		uint64_t count = 0;
+		double totalLateness = 0.0;
+		double maxLateness = 0.0;
+		double totalRunTime = 0.0;
+		double maxRunTime = 0.0;
+		uint64_t lateness[HISTOGRAM_SIZE] = {};
+		uint64_t runTime[HISTOGRAM_SIZE] = {};
+	};
+
+	std::vector<TaskStats> GetTaskStats();
+
 private:
 	struct Message
 	{
+		// INVALID_ID while the slot is free
 		uint32_t id;
 		double deliverAt;
 		double interval;
-		std::function<void()> func;
+		// Keeps messages that are due at the same time in the order they were posted
+		uint64_t seq;
+		// Lateness of messages without a delay is counted from here
+		double postedAt;
+		const char *tag;
+		size_t heapIndex;
+		Task func;
 	};
 
-
 	void Run();
-	void InsertMessageInternal(Message &m);
+	// All of these expect queueAccessMutex to be held
+	void Wait(double timeout);
+	size_t AllocateSlot();
+	void ReleaseSlot(size_t slot);
+	void Grow();
+	void Schedule(size_t slot);
+	void Unschedule(size_t slot);
+	bool IsEarlier(size_t a, size_t b) const;
+	void SiftUp(size_t pos);
+	void SiftDown(size_t pos);
+	void RecordTaskStats(const char *tag, double lateness, double runTime);
 
 	std::atomic<bool> running;
-	std::vector<Message> queue;
-	Mutex loopMutex;
+	// Messages are stored at slots[id & (slots.size() - 1)], Post picks the next id whose slot is free.
+	// That keeps Cancel O(1) without a separate index, and the table is at most half full.
+	std::vector<Message> slots;
+	// Binary min-heap of slot indices ordered by delivery time
+	std::vector<size_t> heap;
+	size_t usedSlots = 0;
 	Mutex queueAccessMutex;
-	uint32_t lastMessageID = 1;
+	uint32_t lastMessageID = 0;
+	uint64_t lastSeq = 0;
+	// Message being delivered right now, its slot stays taken until it returns
+	uint32_t currentID = INVALID_ID;
 	bool cancelCurrent = false;
+	std::vector<TaskStats> taskStats;
 
 #ifdef _WIN32
 	HANDLE event;
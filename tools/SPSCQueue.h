@@ -0,0 +1,102 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#pragma once
+#include "utils.h"
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+
+namespace tgvoip
+{
+
+// Bounded wait-free ring for exactly one producer thread and one consumer thread.
+// Capacity is rounded up to a power of two.
+template <typename T>
+class SPSCQueue
+{
+public:
+    TGVOIP_DISALLOW_COPY_AND_ASSIGN(SPSCQueue);
+    SPSCQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        mask = size - 1;
+        slots = std::make_unique<Slot[]>(size);
+    }
+
+    ~SPSCQueue()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        for (; h != t; h++)
+            SlotAt(h)->~T();
+    }
+
+    // Producer side. Returns false, leaving thing untouched, if the queue is full.
+    bool Push(T &&thing)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead > mask)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead > mask)
+                return false;
+        }
+        new (SlotAt(t)) T(std::move(thing));
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool Pop(T &out)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail)
+                return false;
+        }
+        T *slot = SlotAt(h);
+        out = std::move(*slot);
+        slot->~T();
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    size_t Capacity() const
+    {
+        return mask + 1;
+    }
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    T *SlotAt(size_t index)
+    {
+        return reinterpret_cast<T *>(&slots[index & mask]);
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    // Consumer-owned
+    alignas(TGVOIP_CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+    size_t cachedTail = 0;
+    // Producer-owned
+    alignas(TGVOIP_CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+};
+
+} // namespace tgvoip
@@ -11,14 +11,21 @@
 
 #if defined(_POSIX_THREADS) || defined(_POSIX_VERSION) || defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
 
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sched.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef __APPLE__
 #include "os/darwin/DarwinSpecific.h"
 #endif
 
+// Lets Semaphore::TryAcquire wait against the monotonic clock so that a wall clock jump can't stall the send thread
+#if (defined(__GLIBC__) && defined(__USE_GNU) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))) || (defined(__ANDROID__) && __ANDROID_API__ >= 30)
+#define TGVOIP_HAVE_SEM_CLOCKWAIT
+#endif
+
 namespace tgvoip
 {
 class Mutex
@@ -158,6 +165,12 @@ public:
 		dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
 	}
 
+	// Returns false if nothing was released within timeout seconds
+	bool TryAcquire(double timeout)
+	{
+		return dispatch_semaphore_wait(sem, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC))) == 0;
+	}
+
 	void Release()
 	{
 		dispatch_semaphore_signal(sem);
@@ -200,6 +213,30 @@ public:
 		sem_wait(&sem);
 	}
 
+	// Returns false if nothing was released within timeout seconds
+	bool TryAcquire(double timeout)
+	{
+#ifdef TGVOIP_HAVE_SEM_CLOCKWAIT
+		const clockid_t clock = CLOCK_MONOTONIC;
+#else
+		const clockid_t clock = CLOCK_REALTIME;
+#endif
+		timespec ts;
+		clock_gettime(clock, &ts);
+		long long nsec = ts.tv_nsec + (long long)(timeout * 1000000000.0);
+		ts.tv_sec += nsec / 1000000000LL;
+		ts.tv_nsec = nsec % 1000000000LL;
+		int res;
+#ifdef TGVOIP_HAVE_SEM_CLOCKWAIT
+		while ((res = sem_clockwait(&sem, clock, &ts)) == -1 && errno == EINTR)
+			;
+#else
+		while ((res = sem_timedwait(&sem, &ts)) == -1 && errno == EINTR)
+			;
+#endif
+		return res == 0;
+	}
+
 	void Release()
 	{
 		sem_post(&sem);
@@ -227,6 +264,7 @@ private:
 
 #include <Windows.h>
 #include <assert.h>
+#include <math.h>
 
 namespace tgvoip
 {
@@ -380,6 +418,16 @@ public:
 #endif
 	}
 
+	// Returns false if nothing was released within timeout seconds
+	bool TryAcquire(double timeout)
+	{
+#if !defined(WINAPI_FAMILY) || WINAPI_FAMILY != WINAPI_FAMILY_PHONE_APP
+		return WaitForSingleObject(h, (DWORD)ceil(timeout * 1000)) == WAIT_OBJECT_0;
+#else
+		return WaitForSingleObjectEx(h, (DWORD)ceil(timeout * 1000), false) == WAIT_OBJECT_0;
+#endif
+	}
+
 	void Release()
 	{
 		ReleaseSemaphore(h, 1, NULL);
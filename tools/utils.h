@@ -18,6 +18,12 @@
     TypeName(TypeName &&) = default;           \
     TypeName &operator=(TypeName &&) = default
 
+// Used to keep atomics written by different threads on separate cache lines
+#define TGVOIP_CACHE_LINE_SIZE 64
+
+// Caller-provided storage for the optional streaming hash and expanded key contexts in CryptoFunctions
+#define TGVOIP_CRYPTO_CONTEXT_SIZE 512
+
 template <typename T, size_t size, typename AVG_T = T>
 class HistoricBuffer
 {
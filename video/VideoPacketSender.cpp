@@ -107,7 +107,7 @@ void VideoPacketSender::SetSource(VideoSource *source)
         return;
 
     sourceChangeTime = lastVideoResolutionChangeTime = VoIPController::GetCurrentTime();
-    uint32_t bitrate = videoCongestionControl.GetBitrate();
+    uint32_t bitrate = GetAllowedBitrate();
     currentVideoBitrate = bitrate;
     source->SetBitrate(bitrate);
     source->Reset(stream->codec, stream->resolution = GetVideoResolutionForCurrentBitrate());
@@ -121,6 +121,28 @@ void VideoPacketSender::SetSource(VideoSource *source)
     });
 }
 
+void VideoPacketSender::SetBitrateLimit(uint32_t limit)
+{
+    bitrateLimit = limit;
+    if (!source)
+        return;
+    uint32_t bitrate = GetAllowedBitrate();
+    if (bitrate != currentVideoBitrate)
+    {
+        currentVideoBitrate = bitrate;
+        LOGD("Setting video bitrate to %u", bitrate);
+        source->SetBitrate(bitrate);
+    }
+}
+
+uint32_t VideoPacketSender::GetAllowedBitrate()
+{
+    uint32_t bitrate = videoCongestionControl.GetBitrate();
+    if (bitrateLimit == UINT32_MAX)
+        return bitrate;
+    return bitrate ? std::min(bitrate, bitrateLimit) : bitrateLimit;
+}
+
 void VideoPacketSender::SendFrame(const Buffer &_frame, uint32_t flags, uint32_t rotation)
 {
     std::shared_ptr<Buffer> framePtr = std::make_shared<Buffer>(Buffer::CopyOf(_frame));
@@ -28,6 +28,8 @@ public:
     virtual void PacketAcknowledged(const RecentOutgoingPacket &packet) override;
     virtual void PacketLost(const RecentOutgoingPacket &packet) override;
     void SetSource(VideoSource *source);
+    // Caps the source bitrate at the share of the delay-based estimate audio didn't take
+    void SetBitrateLimit(uint32_t limit);
 
     uint32_t GetBitrate()
     {
@@ -45,6 +47,7 @@ private:
 
     void SendFrame(const Buffer &frame, uint32_t flags, uint32_t rotation);
     int GetVideoResolutionForCurrentBitrate();
+    uint32_t GetAllowedBitrate();
 
     VideoSource *source = NULL;
     video::ScreamCongestionController videoCongestionControl;
@@ -55,6 +58,7 @@ private:
     uint32_t sendVideoPacketID = MessageThread::INVALID_ID;
     uint32_t videoPacketLossCount = 0;
     uint32_t currentVideoBitrate = 0;
+    uint32_t bitrateLimit = UINT32_MAX;
     double lastVideoResolutionChangeTime = 0.0;
     double sourceChangeTime = 0.0;
 